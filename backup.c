@@ -0,0 +1,151 @@
+#include "backup.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stats.h"
+#include "trace.h"
+
+typedef struct BackupTask
+{
+  void (*run)(void *);
+  void *arg;
+  struct BackupTask *next;
+} BackupTask;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signaled when a task is queued or the pool is stopping.
+static pthread_cond_t task_queued = PTHREAD_COND_INITIALIZER;
+// Signaled when a backup completes.
+static pthread_cond_t task_done = PTHREAD_COND_INITIALIZER;
+
+static BackupTask *queue_head = NULL;
+static BackupTask *queue_tail = NULL;
+static unsigned int max_backups = 0;
+// Backups queued or in progress.
+static unsigned int pending_backups = 0;
+static int stopping = 0;
+
+static pthread_t *workers = NULL;
+static unsigned int num_workers = 0;
+
+static void *backup_worker()
+{
+  while (1)
+  {
+    pthread_mutex_lock(&pool_mutex);
+    while (queue_head == NULL && !stopping)
+    {
+      pthread_cond_wait(&task_queued, &pool_mutex);
+    }
+
+    BackupTask *task = queue_head;
+    if (task == NULL)
+    {
+      // Stopping and nothing left to do
+      pthread_mutex_unlock(&pool_mutex);
+      break;
+    }
+
+    queue_head = task->next;
+    if (queue_head == NULL)
+      queue_tail = NULL;
+    pthread_mutex_unlock(&pool_mutex);
+
+    task->run(task->arg);
+    free(task);
+
+    pthread_mutex_lock(&pool_mutex);
+    pending_backups--;
+    pthread_cond_broadcast(&task_done);
+    pthread_mutex_unlock(&pool_mutex);
+  }
+
+  return NULL;
+}
+
+int backup_pool_start(unsigned int num)
+{
+  workers = malloc(num * sizeof(pthread_t));
+  if (workers == NULL)
+    return 1;
+
+  max_backups = num;
+  stopping = 0;
+  for (num_workers = 0; num_workers < num; num_workers++)
+  {
+    if (pthread_create(&workers[num_workers], NULL, backup_worker, NULL) != 0)
+    {
+      perror("Failed to create backup thread");
+      backup_pool_stop();
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int backup_pool_submit(void (*run)(void *), void *arg)
+{
+  BackupTask *task = malloc(sizeof(BackupTask));
+  if (task == NULL)
+    return 1;
+
+  task->run = run;
+  task->arg = arg;
+  task->next = NULL;
+
+  pthread_mutex_lock(&pool_mutex);
+  // Throttle: the job thread waits here instead of reaping children
+  if (pending_backups >= max_backups)
+  {
+    uint64_t start = stats_now();
+    TRACE_BEGIN("wait backup slot", NULL);
+    while (pending_backups >= max_backups)
+    {
+      pthread_cond_wait(&task_done, &pool_mutex);
+    }
+    TRACE_END("wait backup slot");
+    stats_backup_wait(stats_now() - start);
+  }
+
+  pending_backups++;
+  if (queue_tail == NULL)
+    queue_head = task;
+  else
+    queue_tail->next = task;
+  queue_tail = task;
+
+  pthread_cond_signal(&task_queued);
+  pthread_mutex_unlock(&pool_mutex);
+  return 0;
+}
+
+void backup_pool_wait()
+{
+  pthread_mutex_lock(&pool_mutex);
+  while (pending_backups > 0)
+  {
+    pthread_cond_wait(&task_done, &pool_mutex);
+  }
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+void backup_pool_stop()
+{
+  pthread_mutex_lock(&pool_mutex);
+  stopping = 1;
+  pthread_cond_broadcast(&task_queued);
+  pthread_mutex_unlock(&pool_mutex);
+
+  // Workers only leave once the queue is empty
+  for (unsigned int i = 0; i < num_workers; i++)
+  {
+    pthread_join(workers[i], NULL);
+  }
+
+  free(workers);
+  workers = NULL;
+  num_workers = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+// Pool of backup threads. Each backup is a task run by one of the
+// threads; at most as many backups as there are threads are in progress
+// or queued at any time.
+
+/// Starts the backup threads.
+/// @param workers Number of backup threads, i.e. the maximum number of
+/// concurrent backups.
+/// @return 0 if the pool was started successfully, 1 otherwise.
+int backup_pool_start(unsigned int workers);
+
+/// Queues a backup task, blocking while the maximum number of backups
+/// is already in progress.
+/// @param run Function that performs the backup.
+/// @param arg Argument passed to run.
+/// @return 0 if the task was queued successfully, 1 otherwise.
+int backup_pool_submit(void (*run)(void *), void *arg);
+
+/// Waits until every backup queued so far has completed.
+void backup_pool_wait();
+
+/// Waits for the pending backups and stops the backup threads.
+void backup_pool_stop();
+
+#endif // KVS_BACKUP_H
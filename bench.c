@@ -0,0 +1,422 @@
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "histogram.h"
+#include "operations.h"
+#include "output.h"
+#include "stats.h"
+
+enum BenchOp
+{
+  OP_READ,
+  OP_WRITE,
+  OP_DELETE,
+  OP_SHOW,
+  OP_COUNT
+};
+
+static const char *const op_names[OP_COUNT] = {"read", "write", "delete", "show"};
+
+typedef struct BenchConfig
+{
+  size_t keys;
+  // Commands issued by each thread.
+  size_t ops;
+  // Keys per READ, WRITE and DELETE.
+  size_t batch;
+  unsigned int threads;
+  // Share of each command, in percent; writes take the rest.
+  double reads;
+  double deletes;
+  double shows;
+  // Skew of the zipfian key distribution, 0 for uniform.
+  double zipf;
+  uint64_t seed;
+} BenchConfig;
+
+// Precomputed constants of the zipfian generator of Gray et al.,
+// "Quickly generating billion-record synthetic databases".
+typedef struct Zipf
+{
+  double theta;
+  double zetan;
+  double alpha;
+  double eta;
+  double half_pow_theta;
+} Zipf;
+
+typedef struct BenchThread
+{
+  pthread_t thread;
+  uint64_t rng;
+  Histogram histograms[OP_COUNT];
+  OutputBuffer out;
+} BenchThread;
+
+static BenchConfig config = {
+    .keys = 100000,
+    .ops = 1000000,
+    .batch = 1,
+    .threads = 1,
+    .reads = 90,
+    .deletes = 0,
+    .shows = 0,
+    .zipf = 0,
+    .seed = 1,
+};
+
+static Zipf zipf;
+static pthread_barrier_t start_barrier;
+// Discards the output of the commands.
+static int null_fd = -1;
+
+// xorshift64*: small state, good enough to pick keys.
+static uint64_t next_random(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 2685821657736338717ULL;
+}
+
+// @return Random number in [0, 1).
+static double random_unit(uint64_t *state)
+{
+  return (double)(next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(Zipf *z, size_t n, double theta)
+{
+  z->theta = theta;
+  z->zetan = 0;
+  for (size_t i = 1; i <= n; i++)
+  {
+    z->zetan += 1 / pow((double)i, theta);
+  }
+  double zeta2 = 1 + 1 / pow(2, theta);
+  z->alpha = 1 / (1 - theta);
+  z->eta = (1 - pow(2 / (double)n, 1 - theta)) / (1 - zeta2 / z->zetan);
+  z->half_pow_theta = 1 + pow(0.5, theta);
+}
+
+// Picks the rank of a key, 0 being the most frequent one.
+static size_t pick_key(uint64_t *state)
+{
+  if (config.zipf <= 0)
+    return (size_t)(next_random(state) % config.keys);
+
+  double u = random_unit(state);
+  double uz = u * zipf.zetan;
+  if (uz < 1)
+    return 0;
+  if (uz < zipf.half_pow_theta)
+    return 1;
+
+  size_t rank = (size_t)((double)config.keys * pow(zipf.eta * u - zipf.eta + 1, zipf.alpha));
+  return rank < config.keys ? rank : config.keys - 1;
+}
+
+static void make_key(char *key, size_t rank)
+{
+  snprintf(key, MAX_STRING_SIZE, "key%zu", rank);
+}
+
+// Writes every key once, so that reads and deletes find them.
+static int preload()
+{
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  size_t batch = MAX_WRITE_SIZE - 1;
+
+  for (size_t first = 0; first < config.keys; first += batch)
+  {
+    size_t count = config.keys - first < batch ? config.keys - first : batch;
+    for (size_t i = 0; i < count; i++)
+    {
+      make_key(keys[i], first + i);
+      snprintf(values[i], MAX_STRING_SIZE, "v%zu", first + i);
+    }
+    if (kvs_write(count, keys, values, 0))
+      return 1;
+  }
+  return 0;
+}
+
+static enum BenchOp pick_op(uint64_t *state)
+{
+  double r = random_unit(state) * 100;
+  if (r < config.reads)
+    return OP_READ;
+  r -= config.reads;
+  if (r < config.deletes)
+    return OP_DELETE;
+  r -= config.deletes;
+  if (r < config.shows)
+    return OP_SHOW;
+  return OP_WRITE;
+}
+
+static void *worker(void *arg)
+{
+  BenchThread *thread = arg;
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+
+  pthread_barrier_wait(&start_barrier);
+
+  for (size_t op = 0; op < config.ops; op++)
+  {
+    enum BenchOp kind = pick_op(&thread->rng);
+    if (kind != OP_SHOW)
+    {
+      for (size_t i = 0; i < config.batch; i++)
+      {
+        make_key(keys[i], pick_key(&thread->rng));
+        if (kind == OP_WRITE)
+          snprintf(values[i], MAX_STRING_SIZE, "v%zu", op);
+      }
+    }
+
+    uint64_t start = stats_now();
+    switch (kind)
+    {
+    case OP_READ:
+      kvs_read(config.batch, keys, &thread->out);
+      break;
+    case OP_WRITE:
+      kvs_write(config.batch, keys, values, 0);
+      break;
+    case OP_DELETE:
+      kvs_delete(config.batch, keys, &thread->out);
+      break;
+    case OP_SHOW:
+      kvs_show(&thread->out);
+      break;
+    case OP_COUNT:
+      break;
+    }
+    histogram_record(&thread->histograms[kind], stats_now() - start);
+  }
+
+  output_flush(&thread->out);
+  return NULL;
+}
+
+static void print_latencies(FILE *results, const char *name, const Histogram *histogram, int last)
+{
+  fprintf(results,
+          "    \"%s\": {\"count\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}%s\n",
+          name,
+          (unsigned long long)histogram->count,
+          (unsigned long long)histogram_percentile(histogram, 50),
+          (unsigned long long)histogram_percentile(histogram, 99),
+          (unsigned long long)histogram_percentile(histogram, 99.9),
+          (unsigned long long)histogram->max,
+          last ? "" : ",");
+}
+
+static void print_results(FILE *results, BenchThread *threads, double seconds)
+{
+  Histogram *total = calloc(OP_COUNT + 1, sizeof(Histogram));
+  if (total == NULL)
+    return;
+
+  // total[OP_COUNT] holds every command
+  for (unsigned int t = 0; t < config.threads; t++)
+  {
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+      histogram_merge(&total[op], &threads[t].histograms[op]);
+      histogram_merge(&total[OP_COUNT], &threads[t].histograms[op]);
+    }
+  }
+
+  uint64_t commands = total[OP_COUNT].count;
+  uint64_t keyed = commands - total[OP_SHOW].count;
+  fprintf(results, "{\n");
+  fprintf(results,
+          "  \"config\": {\"keys\": %zu, \"ops_per_thread\": %zu, \"batch\": %zu, \"threads\": %u, "
+          "\"reads\": %g, \"deletes\": %g, \"shows\": %g, \"writes\": %g, "
+          "\"distribution\": \"%s\", \"zipf\": %g, \"seed\": %llu},\n",
+          config.keys, config.ops, config.batch, config.threads,
+          config.reads, config.deletes, config.shows, 100 - config.reads - config.deletes - config.shows,
+          config.zipf <= 0 ? "uniform" : "zipf", config.zipf, (unsigned long long)config.seed);
+  fprintf(results, "  \"elapsed_s\": %.6f,\n", seconds);
+  fprintf(results, "  \"ops_per_sec\": %.1f,\n", (double)commands / seconds);
+  fprintf(results, "  \"keys_per_sec\": %.1f,\n", (double)keyed * (double)config.batch / seconds);
+  fprintf(results, "  \"latency\": {\n");
+  for (int op = 0; op < OP_COUNT; op++)
+  {
+    print_latencies(results, op_names[op], &total[op], 0);
+  }
+  print_latencies(results, "all", &total[OP_COUNT], 1);
+  fprintf(results, "  }\n}\n");
+  free(total);
+}
+
+// Parses a size option, which must be positive.
+// @return 0 if the value was parsed, 1 otherwise.
+static int parse_size(const char *value, size_t *size)
+{
+  char *end;
+  unsigned long long parsed = strtoull(value, &end, 10);
+  if (*end != '\0' || parsed == 0)
+    return 1;
+  *size = (size_t)parsed;
+  return 0;
+}
+
+static int parse_percent(const char *value, double *percent)
+{
+  char *end;
+  *percent = strtod(value, &end);
+  return *end != '\0' || *percent < 0 || *percent > 100;
+}
+
+static int parseOptions(int argc, char *argv[])
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    size_t threads = 0;
+    int invalid;
+
+    if (strncmp(arg, "--keys=", 7) == 0)
+      invalid = parse_size(arg + 7, &config.keys);
+    else if (strncmp(arg, "--ops=", 6) == 0)
+      invalid = parse_size(arg + 6, &config.ops);
+    else if (strncmp(arg, "--batch=", 8) == 0)
+      invalid = parse_size(arg + 8, &config.batch) || config.batch >= MAX_WRITE_SIZE;
+    else if (strncmp(arg, "--threads=", 10) == 0)
+    {
+      invalid = parse_size(arg + 10, &threads) || threads > 1024;
+      config.threads = (unsigned int)threads;
+    }
+    else if (strncmp(arg, "--reads=", 8) == 0)
+      invalid = parse_percent(arg + 8, &config.reads);
+    else if (strncmp(arg, "--deletes=", 10) == 0)
+      invalid = parse_percent(arg + 10, &config.deletes);
+    else if (strncmp(arg, "--shows=", 8) == 0)
+      invalid = parse_percent(arg + 8, &config.shows);
+    else if (strcmp(arg, "--uniform") == 0)
+    {
+      config.zipf = 0;
+      invalid = 0;
+    }
+    else if (strncmp(arg, "--zipf=", 7) == 0)
+    {
+      char *end;
+      config.zipf = strtod(arg + 7, &end);
+      invalid = *end != '\0' || config.zipf <= 0 || config.zipf >= 1;
+    }
+    else if (strncmp(arg, "--seed=", 7) == 0)
+    {
+      char *end;
+      config.seed = strtoull(arg + 7, &end, 10);
+      invalid = *end != '\0';
+    }
+    else
+    {
+      fprintf(stderr, "Unknown option %s\n", arg);
+      return 1;
+    }
+
+    if (invalid)
+    {
+      fprintf(stderr, "Invalid value in %s\n", arg);
+      return 1;
+    }
+  }
+
+  if (config.reads + config.deletes + config.shows > 100)
+  {
+    fprintf(stderr, "Reads, deletes and shows add up to more than 100%%\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (parseOptions(argc, argv))
+  {
+    fprintf(stderr, "Usage: %s [options]\n"
+                    "Options:\n"
+                    "  --keys=N       Keys written before the run (default 100000)\n"
+                    "  --ops=N        Commands issued by each thread (default 1000000)\n"
+                    "  --batch=N      Keys per READ, WRITE and DELETE (default 1)\n"
+                    "  --threads=N    Threads issuing commands (default 1)\n"
+                    "  --reads=P      Percentage of READs (default 90)\n"
+                    "  --deletes=P    Percentage of DELETEs (default 0)\n"
+                    "  --shows=P      Percentage of SHOWs (default 0); WRITEs take the rest\n"
+                    "  --uniform      Pick keys uniformly (the default)\n"
+                    "  --zipf=S       Pick keys with a zipfian skew S, 0 < S < 1\n"
+                    "  --seed=N       Seed of the key and command choices (default 1)\n"
+                    "Results are printed to stdout as JSON.\n",
+            argv[0]);
+    return 1;
+  }
+
+  null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd < 0)
+  {
+    perror("Failed to open /dev/null");
+    return 1;
+  }
+
+  if (config.zipf > 0)
+    zipf_init(&zipf, config.keys, config.zipf);
+
+  KvsOptions options = {.max_backups = 1};
+  if (kvs_init(&options))
+  {
+    fprintf(stderr, "Failed to initialize KVS\n");
+    return 1;
+  }
+
+  BenchThread *threads = calloc(config.threads, sizeof(BenchThread));
+  if (threads == NULL || preload())
+  {
+    fprintf(stderr, "Failed to prepare the benchmark\n");
+    kvs_terminate();
+    return 1;
+  }
+
+  pthread_barrier_init(&start_barrier, NULL, config.threads + 1);
+  for (unsigned int t = 0; t < config.threads; t++)
+  {
+    // Seeds 0 would keep xorshift at 0
+    threads[t].rng = (config.seed + 1) * 0x9E3779B97F4A7C15ULL + t;
+    output_init(&threads[t].out, null_fd, OUTPUT_JOB);
+    if (pthread_create(&threads[t].thread, NULL, worker, &threads[t]) != 0)
+    {
+      perror("Failed to create thread");
+      return 1;
+    }
+  }
+
+  pthread_barrier_wait(&start_barrier);
+  uint64_t start = stats_now();
+  for (unsigned int t = 0; t < config.threads; t++)
+  {
+    pthread_join(threads[t].thread, NULL);
+  }
+  double seconds = (double)(stats_now() - start) / 1e9;
+
+  print_results(stdout, threads, seconds);
+
+  pthread_barrier_destroy(&start_barrier);
+  free(threads);
+  kvs_terminate();
+  close(null_fd);
+  return 0;
+}
@@ -0,0 +1,366 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "parser.h"
+#include "protocol.h"
+
+// Client of kvs --serve: sends the commands read from a file (stdin by
+// default) to the server, and writes what the server answers to stdout.
+// With --binary, the commands are parsed here and sent as binary frames
+// (see protocol.h), and the answers are checked to come back in order.
+
+// Size of the commands sent at once; binary frames are added while a
+// frame of the largest size still fits.
+#define CLIENT_BUFFER_SIZE (2 * PARSER_BUFFER_SIZE)
+
+// Answers to binary requests, read as they arrive.
+typedef struct BinaryAnswers
+{
+  uint32_t sent;
+  uint32_t answered;
+  // Bytes of the header of the current answer read so far; the output
+  // follows once the header is complete.
+  size_t headerUsed;
+  unsigned char header[PROTOCOL_ANSWER_HEADER];
+} BinaryAnswers;
+
+// Writes every byte, retrying on partial writes and interruptions.
+// @return 0 if every byte was written, 1 otherwise.
+static int writeAll(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t written = write(fd, data, len);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+static int connectTo(const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+  {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void putU32(unsigned char *p, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static unsigned char *putString(unsigned char *p, const char *str)
+{
+  size_t len = strlen(str);
+  *p++ = (unsigned char)len;
+  memcpy(p, str, len);
+  return p + len;
+}
+
+// Encodes a command as a binary request.
+// @return Size of the frame, 0 if the command is not sent.
+static size_t encodeCommand(const ParsedCommand *cmd, uint32_t seq, unsigned char *frame)
+{
+  unsigned char *p = frame + PROTOCOL_REQUEST_HEADER;
+  ProtocolOpcode opcode;
+  switch (cmd->command)
+  {
+  case CMD_WRITE:
+    opcode = OP_WRITE;
+    break;
+  case CMD_READ:
+    opcode = OP_READ;
+    break;
+  case CMD_DELETE:
+    opcode = OP_DELETE;
+    break;
+  case CMD_SCAN:
+    opcode = OP_SCAN;
+    break;
+  case CMD_SHOW:
+    opcode = OP_SHOW;
+    break;
+  case CMD_STATS:
+    opcode = OP_STATS;
+    break;
+  case CMD_WAIT:
+    opcode = OP_WAIT;
+    putU32(p, cmd->delay);
+    p += 4;
+    break;
+  case CMD_BACKUP:
+    opcode = OP_BACKUP;
+    break;
+  case CMD_INVALID:
+    fprintf(stderr, "Invalid command. See HELP for usage\n");
+    return 0;
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case EOC:
+    return 0;
+  }
+
+  if (cmd->command == CMD_WRITE || cmd->command == CMD_READ || cmd->command == CMD_DELETE || cmd->command == CMD_SCAN)
+  {
+    if (cmd->num_pairs == 0)
+    {
+      fprintf(stderr, "Invalid command. See HELP for usage\n");
+      return 0;
+    }
+
+    *p++ = (unsigned char)cmd->num_pairs;
+    *p++ = (unsigned char)(cmd->num_pairs >> 8);
+    for (size_t i = 0; i < cmd->num_pairs; i++)
+    {
+      p = putString(p, cmd->keys[i]);
+      if (cmd->command == CMD_WRITE)
+        p = putString(p, cmd->values[i]);
+    }
+    if (cmd->ttl_ms > 0)
+    {
+      putU32(p, cmd->ttl_ms);
+      p += 4;
+    }
+  }
+
+  size_t size = (size_t)(p - frame);
+  putU32(frame, (uint32_t)(size - 4));
+  putU32(frame + 4, seq);
+  frame[8] = (unsigned char)opcode;
+  return size;
+}
+
+// Parses commands and encodes them until the buffer is nearly full.
+// @return Bytes of frames added to the buffer.
+static size_t encodeCommands(int fd, ParsedCommand *cmd, BinaryAnswers *answers, unsigned char *buffer, int *done)
+{
+  size_t used = 0;
+  while (used + PROTOCOL_MAX_FRAME + 4 <= CLIENT_BUFFER_SIZE)
+  {
+    parse_command(fd, cmd);
+    if (cmd->command == EOC)
+    {
+      *done = 1;
+      break;
+    }
+
+    size_t size = encodeCommand(cmd, answers->sent, buffer + used);
+    if (size > 0)
+    {
+      answers->sent++;
+      used += size;
+    }
+  }
+  return used;
+}
+
+// Writes the output of the binary answers received to stdout.
+// @return 0 if the answers are well formed and in order, 1 otherwise.
+static int decodeAnswers(BinaryAnswers *answers, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    if (answers->headerUsed < PROTOCOL_ANSWER_HEADER)
+    {
+      size_t chunk = PROTOCOL_ANSWER_HEADER - answers->headerUsed;
+      if (chunk > len)
+        chunk = len;
+      memcpy(answers->header + answers->headerUsed, data, chunk);
+      answers->headerUsed += chunk;
+      data += chunk;
+      len -= chunk;
+      if (answers->headerUsed < PROTOCOL_ANSWER_HEADER)
+        break;
+
+      const unsigned char *h = answers->header;
+      uint32_t seq = (uint32_t)h[0] | (uint32_t)h[1] << 8 | (uint32_t)h[2] << 16 | (uint32_t)h[3] << 24;
+      if (seq != answers->answered)
+      {
+        fprintf(stderr, "Answer %u arrived instead of %u\n", seq, answers->answered);
+        return 1;
+      }
+      if (h[4] != PROTOCOL_OK)
+        fprintf(stderr, "Request %u was rejected as invalid\n", seq);
+      continue;
+    }
+
+    // The output of the answer ends at a '\0'
+    const char *end = memchr(data, '\0', len);
+    size_t chunk = end == NULL ? len : (size_t)(end - data);
+    if (writeAll(STDOUT_FILENO, data, chunk))
+      return 1;
+    data += chunk;
+    len -= chunk;
+    if (end != NULL)
+    {
+      data++;
+      len--;
+      answers->headerUsed = 0;
+      answers->answered++;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int binary = argc > 1 && strcmp(argv[1], "--binary") == 0;
+  if (argc - binary < 2 || argc - binary > 3)
+  {
+    fprintf(stderr, "Usage: %s [--binary] <socket> [commands_file]\n"
+                    "Sends the commands (stdin by default) to kvs --serve=<socket> and\n"
+                    "writes the answers to stdout. --binary sends them as binary frames.\n",
+            argv[0]);
+    return 1;
+  }
+  const char *socketPath = argv[1 + binary];
+  const char *inputPath = argc - binary == 3 ? argv[2 + binary] : NULL;
+
+  int inputFd = inputPath != NULL ? open(inputPath, O_RDONLY) : STDIN_FILENO;
+  if (inputFd < 0)
+  {
+    perror(inputPath);
+    return 1;
+  }
+
+  int fd = connectTo(socketPath);
+  unsigned char *commands = malloc(CLIENT_BUFFER_SIZE);
+  ParsedCommand *cmd = binary ? malloc(sizeof(ParsedCommand)) : NULL;
+  if (fd < 0 || commands == NULL || (binary && cmd == NULL))
+  {
+    if (fd >= 0)
+      close(fd);
+    free(commands);
+    free(cmd);
+    return 1;
+  }
+
+  BinaryAnswers answers = {0};
+  size_t pending = 0;
+  size_t sent = 0;
+  if (binary)
+  {
+    commands[0] = PROTOCOL_MAGIC;
+    pending = 1;
+  }
+
+  // Answers are read while commands are still being sent, and commands are
+  // only sent as the socket takes them, so neither side blocks on a full
+  // socket buffer while the other waits to write. Binary commands are
+  // parsed as they are needed instead of waiting for input.
+  struct pollfd fds[2] = {{fd, POLLIN, 0}, {inputFd, POLLIN, 0}};
+  char buffer[PARSER_BUFFER_SIZE];
+  int sending = 1;
+  int result = 0;
+  while (1)
+  {
+    if (binary && sending && pending == sent)
+    {
+      int done = 0;
+      pending = encodeCommands(inputFd, cmd, &answers, commands, &done);
+      sent = 0;
+      if (done && pending == 0)
+      {
+        sending = 0;
+        shutdown(fd, SHUT_WR);
+      }
+    }
+
+    fds[0].events = pending > sent ? POLLIN | POLLOUT : POLLIN;
+    fds[1].revents = 0;
+    if (poll(fds, !binary && sending && pending == sent ? 2 : 1, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      result = 1;
+      break;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      ssize_t bytes = read(fd, buffer, sizeof(buffer));
+      if (bytes <= 0)
+      {
+        // The server is done: everything sent was answered
+        if (bytes < 0 || sending || answers.answered != answers.sent)
+        {
+          fprintf(stderr, "Connection closed by the server\n");
+          result = 1;
+        }
+        break;
+      }
+      if (binary ? decodeAnswers(&answers, buffer, (size_t)bytes) : writeAll(STDOUT_FILENO, buffer, (size_t)bytes))
+      {
+        result = 1;
+        break;
+      }
+    }
+
+    if (pending > sent && (fds[0].revents & POLLOUT))
+    {
+      ssize_t bytes = send(fd, commands + sent, pending - sent, MSG_DONTWAIT);
+      if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        fprintf(stderr, "Failed to send commands\n");
+        result = 1;
+        break;
+      }
+      if (bytes > 0)
+        sent += (size_t)bytes;
+    }
+    else if (!binary && sending && pending == sent && fds[1].revents != 0)
+    {
+      ssize_t bytes = read(inputFd, commands, PARSER_BUFFER_SIZE);
+      pending = bytes > 0 ? (size_t)bytes : 0;
+      sent = 0;
+      if (bytes <= 0)
+      {
+        // Tells the server there are no more commands
+        sending = 0;
+        shutdown(fd, SHUT_WR);
+      }
+    }
+  }
+
+  close(fd);
+  if (binary)
+    parser_release(inputFd);
+  if (inputFd != STDIN_FILENO)
+    close(inputFd);
+  free(commands);
+  free(cmd);
+  return result;
+}
@@ -0,0 +1,159 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "kvs.h"
+#include "stats.h"
+
+// Merges a full backup and the delta backups that follow it into a single
+// full backup, in the same format kvs writes .bck files in.
+
+// Splits a "(key, value)" line, optionally followed by " EXPIRES <ms>".
+// @param expiresAt Pointer to store the wall-clock milliseconds the pair
+// expires at in, 0 if it never does.
+// @return 0 if the line is well formed, 1 otherwise.
+static int parsePair(char *line, char **key, char **value, uint64_t *expiresAt)
+{
+  size_t len = strlen(line);
+  if (len > 0 && line[len - 1] == '\n')
+    line[--len] = '\0';
+
+  *expiresAt = 0;
+  char *deadline = strstr(line, ") EXPIRES ");
+  if (deadline != NULL)
+  {
+    char *end;
+    *expiresAt = strtoull(deadline + 10, &end, 10);
+    if (end == deadline + 10 || *end != '\0' || *expiresAt == 0)
+      return 1;
+    deadline[1] = '\0';
+    len = (size_t)(deadline + 1 - line);
+  }
+
+  char *separator = strstr(line, ", ");
+  if (line[0] != '(' || len < 2 || line[len - 1] != ')' || separator == NULL)
+    return 1;
+
+  line[len - 1] = '\0';
+  *separator = '\0';
+  *key = line + 1;
+  *value = separator + 2;
+  return 0;
+}
+
+// Applies a backup file to the table.
+// @param delta 0 for a full backup, 1 for a delta backup.
+// @return 0 if the file was applied successfully, 1 otherwise.
+static int applyFile(HashTable *ht, const char *filename, int delta)
+{
+  FILE *file = fopen(filename, "r");
+  if (file == NULL)
+  {
+    perror(filename);
+    return 1;
+  }
+
+  // Room for " EXPIRES <ms>" too
+  char line[2 * MAX_STRING_SIZE + 40];
+  int result = 0;
+  unsigned int lineNumber = 0;
+  while (result == 0 && fgets(line, sizeof(line), file) != NULL)
+  {
+    lineNumber++;
+    char *key, *value;
+    uint64_t expiresAt;
+    char op = delta ? line[0] : '+';
+    char *pair = delta ? line + 1 : line;
+
+    if (op == '-')
+    {
+      // "-(key)"
+      size_t len = strcspn(pair, "\n");
+      if (pair[0] != '(' || len < 2 || pair[len - 1] != ')')
+        result = 1;
+      else
+      {
+        pair[len - 1] = '\0';
+        delete_pair(ht, pair + 1);
+      }
+    }
+    else if (op != '+' || parsePair(pair, &key, &value, &expiresAt))
+    {
+      result = 1;
+    }
+    else
+    {
+      uint64_t expires = expiresAt != 0 ? stats_from_wall_ms(expiresAt) : 0;
+      if (expiresAt != 0 && expires == 0)
+        delete_pair(ht, key); // Expired since: whatever it overwrote is gone too
+      else if (write_pair(ht, key, value, expires))
+        result = 1;
+    }
+  }
+
+  if (result)
+    fprintf(stderr, "%s:%u: malformed line\n", filename, lineNumber);
+
+  fclose(file);
+  return result;
+}
+
+static int writeBackup(HashTable *ht, const char *filename)
+{
+  Snapshot *snapshot = snapshot_table(ht);
+  if (snapshot == NULL)
+    return 1;
+
+  FILE *file = fopen(filename, "w");
+  if (file == NULL)
+  {
+    perror(filename);
+    free(snapshot);
+    return 1;
+  }
+
+  for (size_t i = 0; i < snapshot->count; i++)
+  {
+    KeyValue *pair = &snapshot->pairs[i];
+    if (pair->expires != 0)
+      fprintf(file, "(%s, %s) EXPIRES %" PRIu64 "\n", pair->key, pair->value, stats_wall_ms(pair->expires));
+    else
+      fprintf(file, "(%s, %s)\n", pair->key, pair->value);
+  }
+
+  free(snapshot);
+  return fclose(file) != 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: %s [output.bck] [base.bck] [delta...]\n", argv[0]);
+    return 1;
+  }
+
+  HashTable *ht = create_hash_table(0);
+  if (ht == NULL)
+  {
+    fprintf(stderr, "Failed to create table\n");
+    return 1;
+  }
+
+  // Single-threaded, every stripe stays held
+  lock_stripes(ht, ALL_STRIPES, 1);
+
+  int result = applyFile(ht, argv[2], 0);
+  for (int i = 3; result == 0 && i < argc; i++)
+  {
+    result = applyFile(ht, argv[i], 1);
+  }
+
+  if (result == 0)
+    result = writeBackup(ht, argv[1]);
+
+  free_table(ht);
+  return result;
+}
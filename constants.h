@@ -2,3 +2,10 @@
 #define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 512
 #define MAX_LINE_LENGTH 256
+#define OUTPUT_BUFFER_SIZE 65536
+#define PARSER_BUFFER_SIZE 65536
+#define DELTA_CHAIN_LENGTH 16
+#define WAL_BUFFER_SIZE 65536
+#define JOB_CHUNK_SIZE 262144
+#define JOB_MAX_CHUNKS 64
+#define PIPELINE_DEPTH 8
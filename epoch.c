@@ -0,0 +1,140 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct EpochRecord
+{
+  // Epoch announced by the thread, 0 outside read-side sections.
+  _Alignas(64) atomic_uint_fast64_t epoch;
+  // Whether a live thread owns the record.
+  int in_use;
+  struct EpochRecord *next;
+} EpochRecord;
+
+// Starts at 1 so that 0 can mean "not reading".
+static atomic_uint_fast64_t global_epoch = 1;
+
+// Records are only ever added, so they can be walked without the mutex.
+static _Atomic(EpochRecord *) records = NULL;
+static pthread_mutex_t records_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Gives the record of an exiting thread back for reuse.
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local EpochRecord *local_record = NULL;
+static _Thread_local unsigned int depth = 0;
+
+static void release_record(void *arg)
+{
+  EpochRecord *record = arg;
+  atomic_store(&record->epoch, 0);
+
+  pthread_mutex_lock(&records_mutex);
+  record->in_use = 0;
+  pthread_mutex_unlock(&records_mutex);
+}
+
+static void create_record_key()
+{
+  pthread_key_create(&record_key, release_record);
+}
+
+static EpochRecord *acquire_record()
+{
+  pthread_once(&record_key_once, create_record_key);
+
+  pthread_mutex_lock(&records_mutex);
+  EpochRecord *record = atomic_load(&records);
+  while (record != NULL && record->in_use)
+  {
+    record = record->next;
+  }
+
+  if (record == NULL)
+  {
+    record = aligned_alloc(64, sizeof(EpochRecord));
+    if (record == NULL)
+    {
+      // Readers cannot run safely without announcing themselves
+      perror("Failed to allocate epoch record");
+      abort();
+    }
+    atomic_init(&record->epoch, 0);
+    record->next = atomic_load(&records);
+    atomic_store(&records, record);
+  }
+  record->in_use = 1;
+  pthread_mutex_unlock(&records_mutex);
+
+  pthread_setspecific(record_key, record);
+  return record;
+}
+
+void epoch_enter()
+{
+  if (depth++ > 0)
+    return;
+
+  if (local_record == NULL)
+    local_record = acquire_record();
+
+  atomic_store_explicit(&local_record->epoch, atomic_load(&global_epoch), memory_order_relaxed);
+  // The announcement must be visible before any shared pointer is read
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit()
+{
+  if (--depth > 0)
+    return;
+
+  atomic_store_explicit(&local_record->epoch, 0, memory_order_release);
+}
+
+uint64_t epoch_current()
+{
+  return atomic_load(&global_epoch);
+}
+
+// Moves the global epoch forward if every reader announced it.
+// @return Global epoch after the attempt.
+static uint64_t try_advance()
+{
+  // Whatever was unlinked before must be visible to readers announced after
+  atomic_thread_fence(memory_order_seq_cst);
+
+  uint_fast64_t global = atomic_load(&global_epoch);
+  for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next)
+  {
+    uint_fast64_t announced = atomic_load(&record->epoch);
+    if (announced != 0 && announced != global)
+      return global;
+  }
+
+  // On failure global is updated to the epoch another thread moved to
+  if (atomic_compare_exchange_strong(&global_epoch, &global, global + 1))
+    global++;
+  return global;
+}
+
+uint64_t epoch_reclaimable()
+{
+  uint64_t global = try_advance();
+  return global >= 2 ? global - 2 : 0;
+}
+
+void epoch_synchronize()
+{
+  // Readers in a section now announced at most the current epoch, and the
+  // epoch only moves two steps ahead once all of them have left
+  uint64_t target = epoch_current() + 2;
+  while (try_advance() < target)
+  {
+    sched_yield();
+  }
+}
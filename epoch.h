@@ -0,0 +1,32 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+#include <stdint.h>
+
+// Epoch-based reclamation. Readers announce the global epoch while they
+// walk shared structures without locks; memory they may still see is
+// retired with the epoch it was unlinked in and only freed once every
+// reader has moved past it. Announcing is a plain store, so readers never
+// write to a cache line shared with other threads.
+
+/// Enters a read-side section. Sections may be nested.
+void epoch_enter();
+
+/// Leaves a read-side section.
+void epoch_exit();
+
+/// Gets the epoch memory unlinked now must be retired with.
+/// @return Current global epoch.
+uint64_t epoch_current();
+
+/// Moves the global epoch forward, unless a reader is still in an older
+/// one.
+/// @return Latest epoch whose retired memory can be freed, i.e. the global
+/// epoch minus two.
+uint64_t epoch_reclaimable();
+
+/// Waits until every read-side section in progress has ended. Must not be
+/// called from inside one.
+void epoch_synchronize();
+
+#endif // KVS_EPOCH_H
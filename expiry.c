@@ -0,0 +1,119 @@
+#include "expiry.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "stats.h"
+#include "trace.h"
+#include "wheel.h"
+
+#define TICK_NS ((uint64_t)EXPIRY_TICK_MS * 1000000)
+
+static pthread_mutex_t expiry_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signaled when the wheel stops being empty, or the thread is stopping.
+static pthread_cond_t expiry_changed = PTHREAD_COND_INITIALIZER;
+
+static void (*expire_key)(const char *key) = NULL;
+static TimingWheel wheel;
+static int stopping = 0;
+
+static pthread_t expiry_thread;
+static int expiry_thread_started = 0;
+
+// Removes the pairs of the keys due, if they have expired.
+static void expire_entries(WheelEntry *due)
+{
+  while (due != NULL)
+  {
+    WheelEntry *next = due->next;
+    expire_key(due->key);
+    free(due);
+    due = next;
+  }
+}
+
+// Advances the wheel every tick while it holds keys, and sleeps while it
+// is empty.
+static void *expiry_worker()
+{
+  pthread_mutex_lock(&expiry_mutex);
+  while (!stopping)
+  {
+    if (wheel.count == 0)
+    {
+      pthread_cond_wait(&expiry_changed, &expiry_mutex);
+      continue;
+    }
+
+    WheelEntry *due = wheel_advance(&wheel, stats_now() / TICK_NS);
+    if (due != NULL)
+    {
+      // Writes can schedule more keys meanwhile
+      pthread_mutex_unlock(&expiry_mutex);
+      TRACE_BEGIN("expire", NULL);
+      expire_entries(due);
+      TRACE_END("expire");
+      pthread_mutex_lock(&expiry_mutex);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)EXPIRY_TICK_MS * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    if (!stopping)
+      pthread_cond_timedwait(&expiry_changed, &expiry_mutex, &deadline);
+  }
+  pthread_mutex_unlock(&expiry_mutex);
+  return NULL;
+}
+
+int expiry_start(void (*expire)(const char *key))
+{
+  expire_key = expire;
+  stopping = 0;
+  wheel_init(&wheel, stats_now() / TICK_NS);
+  if (pthread_create(&expiry_thread, NULL, expiry_worker, NULL) != 0)
+  {
+    perror("Failed to create expiry thread");
+    return 1;
+  }
+  expiry_thread_started = 1;
+  return 0;
+}
+
+int expiry_schedule(const char *key, uint64_t expires)
+{
+  pthread_mutex_lock(&expiry_mutex);
+  if (wheel.count == 0)
+  {
+    // Idle since who knows when: catch up before measuring the deadline
+    // from the current tick
+    wheel_advance(&wheel, stats_now() / TICK_NS);
+    pthread_cond_signal(&expiry_changed);
+  }
+  // Rounded up, so that keys are never taken before they expire
+  int failed = wheel_add(&wheel, key, (expires + TICK_NS - 1) / TICK_NS);
+  pthread_mutex_unlock(&expiry_mutex);
+  return failed;
+}
+
+void expiry_stop()
+{
+  if (expiry_thread_started)
+  {
+    pthread_mutex_lock(&expiry_mutex);
+    stopping = 1;
+    pthread_cond_signal(&expiry_changed);
+    pthread_mutex_unlock(&expiry_mutex);
+    pthread_join(expiry_thread, NULL);
+    expiry_thread_started = 0;
+  }
+  wheel_destroy(&wheel);
+  expire_key = NULL;
+}
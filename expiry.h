@@ -0,0 +1,32 @@
+#ifndef KVS_EXPIRY_H
+#define KVS_EXPIRY_H
+
+#include <stdint.h>
+
+// Milliseconds per tick of the expiry wheel: pairs are removed up to this
+// late, but read as missing as soon as they expire.
+#define EXPIRY_TICK_MS 10
+
+// Background removal of expired pairs. Every write with a time to live
+// schedules its keys in a timing wheel (see wheel.h), which a thread
+// advances every tick; the keys due are handed one at a time to a
+// function that removes them if they have expired (see expire_pair),
+// holding only what guards the key, so the table is never scanned nor
+// locked as a whole.
+
+/// Starts the thread that removes the expired pairs.
+/// @param expire Function that removes a pair if it has expired.
+/// @return 0 if the thread was started successfully, 1 otherwise.
+int expiry_start(void (*expire)(const char *key));
+
+/// Schedules the removal of a pair. If the pair is overwritten meanwhile,
+/// it is only removed if the new pair has expired by then.
+/// @param key Key of the pair.
+/// @param expires Time the pair expires at, as given by stats_now.
+/// @return 0 if the removal was scheduled, 1 otherwise.
+int expiry_schedule(const char *key, uint64_t expires);
+
+/// Stops the thread, dropping the removals still scheduled.
+void expiry_stop();
+
+#endif // KVS_EXPIRY_H
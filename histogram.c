@@ -0,0 +1,72 @@
+#include "histogram.h"
+
+#include <math.h>
+#include <stddef.h>
+
+static size_t bucket_index(uint64_t value)
+{
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return (size_t)value;
+
+  unsigned int shift = 63 - (unsigned int)__builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  return ((size_t)(shift + 1) << HISTOGRAM_SUB_BITS) + (size_t)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// @return Highest value recorded in the bucket.
+static uint64_t bucket_value(size_t index)
+{
+  if (index < HISTOGRAM_SUB_BUCKETS)
+    return index;
+
+  unsigned int shift = (unsigned int)(index >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t base = HISTOGRAM_SUB_BUCKETS + (index & (HISTOGRAM_SUB_BUCKETS - 1));
+  return ((base + 1) << shift) - 1;
+}
+
+static uint64_t load(const _Atomic uint64_t *counter)
+{
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Single writer: a load and a store, without a locked instruction.
+static void add(_Atomic uint64_t *counter, uint64_t value)
+{
+  atomic_store_explicit(counter, load(counter) + value, memory_order_relaxed);
+}
+
+void histogram_record(Histogram *histogram, uint64_t value)
+{
+  add(&histogram->buckets[bucket_index(value)], 1);
+  add(&histogram->count, 1);
+  if (value > load(&histogram->max))
+    atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+}
+
+void histogram_merge(Histogram *into, const Histogram *from)
+{
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    add(&into->buckets[i], load(&from->buckets[i]));
+  }
+  add(&into->count, load(&from->count));
+  if (load(&from->max) > load(&into->max))
+    atomic_store_explicit(&into->max, load(&from->max), memory_order_relaxed);
+}
+
+uint64_t histogram_percentile(const Histogram *histogram, double percentile)
+{
+  // The count may lag behind the buckets of a histogram being written
+  uint64_t rank = (uint64_t)ceil(percentile / 100 * (double)load(&histogram->count));
+  uint64_t max = load(&histogram->max);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    seen += load(&histogram->buckets[i]);
+    if (seen >= rank && seen > 0)
+    {
+      uint64_t value = bucket_value(i);
+      return value < max ? value : max;
+    }
+  }
+  return max;
+}
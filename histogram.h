@@ -0,0 +1,42 @@
+#ifndef KVS_HISTOGRAM_H
+#define KVS_HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Values are recorded in buckets 1/16 of a power of two wide, so
+// percentiles are reported within about 6% of the exact value, whatever
+// their magnitude.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+// Log-linear histogram of 64-bit values. A zeroed histogram is empty.
+// Each histogram has a single writer, which updates it with plain
+// stores: other threads may read it meanwhile, and see each counter
+// either before or after an update.
+typedef struct Histogram
+{
+  _Atomic uint64_t count;
+  _Atomic uint64_t max;
+  _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+/// Records a value. Only the writer of the histogram may call it.
+/// @param histogram Histogram to update.
+/// @param value Value to record.
+void histogram_record(Histogram *histogram, uint64_t value);
+
+/// Adds the values of a histogram to another one.
+/// @param into Histogram to add to, private to the caller.
+/// @param from Histogram to add.
+void histogram_merge(Histogram *into, const Histogram *from);
+
+/// Gets the value below which a percentage of the values fall.
+/// @param histogram Histogram to query.
+/// @param percentile Percentage, e.g. 99.9.
+/// @return Highest value of the bucket the percentile falls in, no more
+/// than the maximum; 0 if the histogram is empty.
+uint64_t histogram_percentile(const Histogram *histogram, double percentile);
+
+#endif // KVS_HISTOGRAM_H
@@ -0,0 +1,113 @@
+#include "index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void index_init(OrderedIndex *index, uint32_t seed)
+{
+  for (unsigned int level = 0; level < INDEX_MAX_LEVEL; level++)
+  {
+    index->head[level] = NULL;
+  }
+  index->bytes = 0;
+  // xorshift stays at 0 once there
+  index->seed = seed != 0 ? seed : 1;
+}
+
+// Draws the height of a new node: each level above the first is kept with
+// probability 1/4.
+static unsigned int random_height(OrderedIndex *index)
+{
+  uint32_t x = index->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  index->seed = x;
+
+  unsigned int height = 1;
+  while (height < INDEX_MAX_LEVEL && (x & 3) == 0)
+  {
+    height++;
+    x >>= 2;
+  }
+  return height;
+}
+
+// Finds, on every level, the link after which key belongs. The head works
+// as a node that is part of every level.
+static void find_links(OrderedIndex *index, const char *key, IndexNode **links[INDEX_MAX_LEVEL])
+{
+  IndexNode **next = index->head;
+  for (unsigned int level = INDEX_MAX_LEVEL; level-- > 0;)
+  {
+    while (next[level] != NULL && strcmp(next[level]->key, key) < 0)
+    {
+      next = next[level]->next;
+    }
+    links[level] = &next[level];
+  }
+}
+
+IndexNode *index_insert(OrderedIndex *index, const char *key, struct KeyNode *pair)
+{
+  IndexNode **links[INDEX_MAX_LEVEL];
+  find_links(index, key, links);
+
+  unsigned int height = random_height(index);
+  size_t size = sizeof(IndexNode) + height * sizeof(IndexNode *);
+  IndexNode *node = malloc(size);
+  if (node == NULL)
+    return NULL;
+  index->bytes += size;
+
+  node->pair = pair;
+  strcpy(node->key, key);
+  for (unsigned int level = 0; level < height; level++)
+  {
+    node->next[level] = *links[level];
+    *links[level] = node;
+  }
+  return node;
+}
+
+void index_remove(OrderedIndex *index, const char *key)
+{
+  IndexNode **links[INDEX_MAX_LEVEL];
+  find_links(index, key, links);
+
+  IndexNode *node = *links[0];
+  if (node == NULL || strcmp(node->key, key) != 0)
+    return;
+
+  // A node is part of every level up to its height, and only those
+  unsigned int height = 0;
+  while (height < INDEX_MAX_LEVEL && *links[height] == node)
+  {
+    *links[height] = node->next[height];
+    height++;
+  }
+  index->bytes -= sizeof(IndexNode) + height * sizeof(IndexNode *);
+  free(node);
+}
+
+IndexNode *index_seek(OrderedIndex *index, const char *key)
+{
+  if (key == NULL)
+    return index->head[0];
+
+  IndexNode **links[INDEX_MAX_LEVEL];
+  find_links(index, key, links);
+  return *links[0];
+}
+
+void index_destroy(OrderedIndex *index)
+{
+  IndexNode *node = index->head[0];
+  while (node != NULL)
+  {
+    IndexNode *next = node->next[0];
+    free(node);
+    node = next;
+  }
+  index_init(index, index->seed);
+}
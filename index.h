@@ -0,0 +1,65 @@
+#ifndef KVS_INDEX_H
+#define KVS_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Levels of a skiplist. Each level holds about a quarter of the nodes of
+// the one below, so 16 levels keep searches logarithmic well past the
+// number of keys a stripe holds.
+#define INDEX_MAX_LEVEL 16
+
+struct KeyNode;
+
+typedef struct IndexNode
+{
+  // Node holding the current value of the key.
+  struct KeyNode *pair;
+  char key[MAX_STRING_SIZE];
+  // Next node on each level the node is part of.
+  struct IndexNode *next[];
+} IndexNode;
+
+// Skiplist of keys in ascending order. It is not synchronized: the owner
+// guards it with a lock of its own.
+typedef struct OrderedIndex
+{
+  IndexNode *head[INDEX_MAX_LEVEL];
+  // Bytes allocated for the nodes.
+  size_t bytes;
+  // State of the generator of node heights, never 0.
+  uint32_t seed;
+} OrderedIndex;
+
+/// Initializes an empty index.
+/// @param index Index to initialize.
+/// @param seed Seed of the node heights; indexes filled at the same time
+/// should use different seeds.
+void index_init(OrderedIndex *index, uint32_t seed);
+
+/// Adds a key, which must not be in the index yet.
+/// @param index Index to add to.
+/// @param key Key to be added, shorter than MAX_STRING_SIZE.
+/// @param pair Node holding the pair of the key.
+/// @return Node of the key, NULL on failure.
+IndexNode *index_insert(OrderedIndex *index, const char *key, struct KeyNode *pair);
+
+/// Removes a key, if present.
+/// @param index Index to remove from.
+/// @param key Key to be removed.
+void index_remove(OrderedIndex *index, const char *key);
+
+/// Finds the first key not lower than a given one. The following keys are
+/// reached through next[0].
+/// @param index Index to search.
+/// @param key Key to look for, NULL for the first key of the index.
+/// @return Node found, NULL if every key is lower.
+IndexNode *index_seek(OrderedIndex *index, const char *key);
+
+/// Frees every node of an index.
+/// @param index Index to be destroyed.
+void index_destroy(OrderedIndex *index);
+
+#endif // KVS_INDEX_H
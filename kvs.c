@@ -1,110 +1,827 @@
 #include "kvs.h"
 #include "string.h"
 
+#include "epoch.h"
+#include "stats.h"
+
+#include <stdint.h>
 #include <stdlib.h>
-#include <ctype.h>
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// FNV-1a hash over the whole key.
+// @param key Null-terminated string.
 // @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+static size_t hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+// Copies a key into a buffer padded with zeros, the way nodes store it.
+// @return 0 if the key was copied, 1 if it is too long to be stored.
+static int pad_key(char padded[MAX_STRING_SIZE], const char *key) {
+    size_t len = strnlen(key, MAX_STRING_SIZE);
+    if (len == MAX_STRING_SIZE) return 1;
+    memcpy(padded, key, len);
+    memset(padded + len, 0, MAX_STRING_SIZE - len);
+    return 0;
+}
+
+// Compares two padded keys over their whole size, 16 bytes at a time,
+// rather than byte by byte up to the terminator.
+static int keys_equal(const char *a, const char *b) {
+#ifdef __SSE2__
+    size_t i = 0;
+    for (; i + 16 <= MAX_STRING_SIZE; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) return 0;
+    }
+    return memcmp(a + i, b + i, MAX_STRING_SIZE - i) == 0;
+#else
+    return memcmp(a, b, MAX_STRING_SIZE) == 0;
+#endif
+}
+
+// Rounds a capacity up to the next power of two, so buckets can be
+// addressed with a mask.
+static size_t round_capacity(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    return size;
+}
+
+// Loads a link that readers may be following. Writers hold the stripe of
+// the link, so they only need the acquire to pair with other writers'
+// stores when stripes change hands.
+static KeyNode *load_link(_Atomic(KeyNode *) *link) {
+    return atomic_load_explicit(link, memory_order_acquire);
+}
+
+// Publishes a link: everything written to the node before becomes
+// visible to the readers that follow the link.
+static void store_link(_Atomic(KeyNode *) *link, KeyNode *keyNode) {
+    atomic_store_explicit(link, keyNode, memory_order_release);
+}
+
+static TableState *tables_of(HashTable *ht) {
+    return atomic_load_explicit(&ht->tables, memory_order_acquire);
+}
+
+static int is_rehashing(HashTable *ht) {
+    return tables_of(ht)->next != NULL;
+}
+
+static _Atomic(KeyNode *) *bucket_of(BucketArray *array, size_t h) {
+    return &array->buckets[h & (array->size - 1)];
+}
+
+static BucketArray *new_bucket_array(size_t size) {
+    BucketArray *array = calloc(1, sizeof(BucketArray) + size * sizeof(_Atomic(KeyNode *)));
+    if (array) array->size = size;
+    return array;
+}
+
+// Publishes new bucket arrays, then waits until no reader can still be
+// using the old ones. Every stripe must be locked for writing.
+// @return 0 if the arrays were replaced, 1 otherwise.
+static int replace_tables(HashTable *ht, BucketArray *main, BucketArray *next) {
+    TableState *tables = malloc(sizeof(TableState));
+    if (!tables) return 1;
+    tables->main = main;
+    tables->next = next;
+
+    TableState *old = tables_of(ht);
+    atomic_store_explicit(&ht->tables, tables, memory_order_release);
+    // Rare (the table only doubles), so waiting here is cheaper than
+    // retiring arrays
+    epoch_synchronize();
+    if (old->main != main && old->main != next) free(old->main);
+    free(old);
+    return 0;
+}
+
+// Hands a node unlinked from a stripe to the reclamation, and frees the
+// nodes of the stripe no reader can see anymore.
+// The stripe must be locked for writing.
+static void retire_node(HashTable *ht, LockStripe *stripe, KeyNode *keyNode) {
+    keyNode->version = epoch_current();
+    keyNode->retired = stripe->retired;
+    stripe->retired = keyNode;
+    if (++stripe->retired_count < RETIRE_BATCH) return;
+
+    // Retired newest first, so everything after the first reclaimable
+    // node is reclaimable too
+    uint64_t reclaimable = epoch_reclaimable();
+    KeyNode **link = &stripe->retired;
+    while (*link != NULL && (*link)->version > reclaimable) {
+        link = &(*link)->retired;
+    }
+
+    KeyNode *old = *link;
+    *link = NULL;
+    while (old != NULL) {
+        KeyNode *next = old->retired;
+        slab_free(&ht->nodes, old);
+        stripe->retired_count--;
+        old = next;
+    }
+}
+
+static int is_expired(const KeyNode *keyNode, uint64_t now) {
+    return keyNode->expires != 0 && keyNode->expires <= now;
+}
+
+static KeyNode *copy_node(HashTable *ht, KeyNode *keyNode) {
+    KeyNode *copy = slab_alloc(&ht->nodes);
+    if (!copy) return NULL;
+    copy->hash = keyNode->hash;
+    memcpy(copy->key, keyNode->key, sizeof(copy->key));
+    memcpy(copy->value, keyNode->value, sizeof(copy->value));
+    copy->version = keyNode->version;
+    copy->entry = keyNode->entry;
+    copy->expires = keyNode->expires;
+    atomic_init(&copy->referenced, atomic_load_explicit(&keyNode->referenced, memory_order_relaxed));
+    return copy;
+}
+
+// Moves every node of an old bucket to the new table. The old bucket and
+// both of its destinations belong to the same stripe.
+// Nodes are copied into the new table before the old bucket is emptied,
+// so a reader that finds the old bucket empty finds them in the new one.
+// @return 0 if the bucket was migrated, 1 if the copies failed.
+static int migrate_bucket(HashTable *ht, TableState *tables, size_t index) {
+    _Atomic(KeyNode *) *oldBucket = &tables->main->buckets[index];
+
+    KeyNode *copies = NULL;
+    for (KeyNode *keyNode = load_link(oldBucket); keyNode != NULL; keyNode = load_link(&keyNode->next)) {
+        KeyNode *copy = copy_node(ht, keyNode);
+        if (!copy) {
+            while (copies != NULL) {
+                KeyNode *next = load_link(&copies->next);
+                slab_free(&ht->nodes, copies);
+                copies = next;
+            }
+            return 1;
+        }
+        atomic_init(&copy->next, copies);
+        copies = copy;
+    }
+
+    while (copies != NULL) {
+        KeyNode *next = load_link(&copies->next);
+        _Atomic(KeyNode *) *bucket = bucket_of(tables->next, copies->hash);
+        atomic_init(&copies->next, load_link(bucket));
+        store_link(bucket, copies);
+        copies->entry->pair = copies;
+        copies = next;
+    }
+
+    KeyNode *keyNode = load_link(oldBucket);
+    store_link(oldBucket, NULL);
+    LockStripe *stripe = &ht->stripes[index & (LOCK_STRIPES - 1)];
+    while (keyNode != NULL) {
+        KeyNode *next = load_link(&keyNode->next);
+        retire_node(ht, stripe, keyNode);
+        keyNode = next;
+    }
+    return 0;
+}
+
+// Migrates up to REHASH_STEP buckets of a stripe from the old table to the
+// new one. The stripe must be locked for writing.
+static void rehash_step(HashTable *ht, size_t stripe) {
+    TableState *tables = tables_of(ht);
+    if (tables->next == NULL) return;
+
+    LockStripe *lockStripe = &ht->stripes[stripe];
+    size_t stripe_buckets = tables->main->size / LOCK_STRIPES;
+    if (lockStripe->rehash_cursor == stripe_buckets) return;
+
+    for (int step = 0; step < REHASH_STEP && lockStripe->rehash_cursor < stripe_buckets; step++) {
+        if (migrate_bucket(ht, tables, stripe + lockStripe->rehash_cursor * LOCK_STRIPES)) return;
+        lockStripe->rehash_cursor++;
+    }
+
+    if (lockStripe->rehash_cursor == stripe_buckets &&
+        atomic_fetch_sub(&ht->rehash_pending, 1) == 1) {
+        // Last stripe migrated, the tables can be swapped
+        atomic_store(&ht->maintenance, 1);
+    }
+}
+
+// Starts moving the table into one twice as large. Entries are migrated
+// by rehash_step, so no single operation pays for the whole table.
+// Every stripe must be locked for writing.
+static void start_rehash(HashTable *ht) {
+    TableState *tables = tables_of(ht);
+    BucketArray *new_buckets = new_bucket_array(tables->main->size * 2);
+    if (!new_buckets) return; // Keep working with the current table
+
+    // Readers must look in both arrays before any node is migrated
+    if (replace_tables(ht, tables->main, new_buckets)) {
+        free(new_buckets);
+        return;
+    }
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        ht->stripes[s].rehash_cursor = 0;
+    }
+    atomic_store(&ht->rehash_pending, LOCK_STRIPES);
+}
+
+// Replaces the old table by the new one, migrating whatever stripes have
+// not been touched since the rehash started.
+// Every stripe must be locked for writing.
+static void finish_rehash(HashTable *ht) {
+    TableState *tables = tables_of(ht);
+    size_t stripe_buckets = tables->main->size / LOCK_STRIPES;
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        while (ht->stripes[s].rehash_cursor < stripe_buckets) {
+            // Out of memory: stay rehashing, a later write will retry
+            if (migrate_bucket(ht, tables, s + ht->stripes[s].rehash_cursor * LOCK_STRIPES)) return;
+            ht->stripes[s].rehash_cursor++;
+        }
+    }
+
+    if (replace_tables(ht, tables->next, NULL)) return;
+    atomic_store(&ht->rehash_pending, 0);
+}
+
+static int needs_growth(HashTable *ht) {
+    TableState *tables = tables_of(ht);
+    BucketArray *newest = tables->next ? tables->next : tables->main;
+    return atomic_load(&ht->count) >= newest->size * MAX_LOAD_FACTOR;
+}
+
+// Grows the table or finishes a rehash, when a write asked for it.
+static void maintain_table(HashTable *ht) {
+    if (!atomic_exchange(&ht->maintenance, 0)) return;
+
+    lock_stripes(ht, ALL_STRIPES, 1);
+    if (is_rehashing(ht) && (atomic_load(&ht->rehash_pending) == 0 || needs_growth(ht))) {
+        // Done, or the new table is already full: stop waiting for the
+        // stripes that are not being written to
+        finish_rehash(ht);
+    }
+    if (!is_rehashing(ht) && needs_growth(ht)) {
+        start_rehash(ht);
+    }
+    for (size_t s = LOCK_STRIPES; s-- > 0;) {
+        pthread_rwlock_unlock(&ht->stripes[s].lock);
+    }
+}
+
+size_t key_hash(const char *key) {
+    return hash(key);
+}
+
+size_t key_stripe(const char *key) {
+    return hash(key) & (LOCK_STRIPES - 1);
+}
+
+void lock_stripes(HashTable *ht, StripeMask stripes, int exclusive) {
+    uint64_t start = 0;
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        if (!(stripes & ((StripeMask)1 << s))) continue;
+        pthread_rwlock_t *lock = &ht->stripes[s].lock;
+        // Only contended stripes are timed, so uncontended locking costs
+        // no clock reads
+        if ((exclusive ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock)) == 0) continue;
+        if (start == 0) start = stats_now();
+        if (exclusive) {
+            pthread_rwlock_wrlock(lock);
+        } else {
+            pthread_rwlock_rdlock(lock);
+        }
+    }
+    if (start != 0) stats_lock_wait(stats_now() - start);
+}
+
+void unlock_stripes(HashTable *ht, StripeMask stripes) {
+    for (size_t s = LOCK_STRIPES; s-- > 0;) {
+        if (stripes & ((StripeMask)1 << s)) {
+            pthread_rwlock_unlock(&ht->stripes[s].lock);
+        }
+    }
+    maintain_table(ht);
+}
+
+// Finds the node holding key, in either table. The old table is searched
+// first: a node being migrated is copied into the new one before it
+// leaves the old one. Nodes of other keys are told apart by their hash,
+// almost always without reading their key.
+// @param key Key padded with pad_key.
+// @param prev Pointer to store the link pointing to the node.
+static KeyNode *find_node(HashTable *ht, const char *key, size_t h, _Atomic(KeyNode *) **prev) {
+    TableState *tables = tables_of(ht);
+    BucketArray *arrays[2] = {tables->main, tables->next};
+    for (int t = 0; t < 2 && arrays[t] != NULL; t++) {
+        _Atomic(KeyNode *) *link = bucket_of(arrays[t], h);
+        KeyNode *keyNode;
+        while ((keyNode = load_link(link)) != NULL) {
+            if (keyNode->hash == (uint32_t)h && keys_equal(keyNode->key, key)) {
+                if (prev) *prev = link;
+                return keyNode;
+            }
+            link = &keyNode->next;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t next_version(HashTable *ht) {
+    if (!ht->track_changes) return 0;
+    return atomic_fetch_add(&ht->version, 1) + 1;
+}
+
+// Records a deleted node, discarding the tombstones no longer needed.
+// The stripe must be locked for writing.
+static void add_tombstone(HashTable *ht, LockStripe *stripe, KeyNode *keyNode) {
+    atomic_init(&keyNode->next, stripe->tombstones);
+    stripe->tombstones = keyNode;
+
+    // Only walk the list when the floor moved since the last time
+    uint64_t floor = atomic_load(&ht->tombstone_floor);
+    if (floor == stripe->pruned_floor) return;
+    stripe->pruned_floor = floor;
+
+    // Tombstones are private copies, never seen by readers
+    KeyNode *last = keyNode;
+    KeyNode *old;
+    while ((old = load_link(&last->next)) != NULL && old->version > floor) {
+        last = old;
+    }
+
+    // Everything older than the floor goes back to the pool
+    atomic_init(&last->next, NULL);
+    while (old != NULL) {
+        KeyNode *next = load_link(&old->next);
+        slab_free(&ht->nodes, old);
+        old = next;
     }
-    return -1; // Invalid index for non-alphabetic or number strings
 }
 
+// Adds to and takes from a usage counter of a stripe. Only writers of the
+// stripe change it, so a plain load and store will do.
+static void charge(atomic_size_t *counter, size_t add, size_t sub) {
+    size_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + add - sub, memory_order_relaxed);
+}
+
+static void charge_index(LockStripe *stripe) {
+    atomic_store_explicit(&stripe->index_bytes, stripe->index.bytes, memory_order_relaxed);
+}
+
+// Bytes held by the pairs of a stripe, as counted against its budget.
+// The stripe must be locked.
+static size_t stripe_bytes(LockStripe *stripe) {
+    return atomic_load_explicit(&stripe->node_bytes, memory_order_relaxed) + stripe->index.bytes;
+}
+
+// Unlinks a pair from its bucket and index, keeping a copy as a tombstone
+// if changes are tracked. The stripe must be locked for writing.
+// @param prev Link pointing to the node.
+// @return 0 if the pair was removed, 1 otherwise.
+static int remove_pair(HashTable *ht, LockStripe *stripe, _Atomic(KeyNode *) *prev, KeyNode *keyNode) {
+    if (ht->track_changes) {
+        // Kept for the next delta backup; the node itself may still be
+        // followed by readers
+        KeyNode *tombstone = copy_node(ht, keyNode);
+        if (!tombstone) return 1;
+        tombstone->version = next_version(ht);
+        tombstone->entry = NULL;
+        add_tombstone(ht, stripe, tombstone);
+    }
 
-struct HashTable* create_hash_table() {
+    // Bypass the node in its bucket. Readers on the node still find the
+    // rest of the chain through it
+    store_link(prev, load_link(&keyNode->next));
+    atomic_fetch_sub(&ht->count, 1);
+    index_remove(&stripe->index, keyNode->key);
+
+    charge(&stripe->node_bytes, 0, sizeof(KeyNode));
+    charge_index(stripe);
+    charge(&stripe->key_bytes, 0, strlen(keyNode->key));
+    charge(&stripe->value_bytes, 0, strlen(keyNode->value));
+
+    retire_node(ht, stripe, keyNode); // Back to the pool once unreachable
+    return 0;
+}
+
+// Evicts pairs of a stripe until it is back within its budget, with the
+// CLOCK policy: a hand walks the keys of the stripe in order, clearing the
+// referenced bit of the pairs used since it last passed them, and evicts
+// the first pair whose bit is already clear. Readers only ever set the
+// bit, so they pay for no lock nor list update. Past EVICTION_SWEEP set
+// bits, the pair under the hand is evicted anyway.
+// The stripe must be locked for writing.
+// @param keep Pair just written, which is never evicted; NULL for none.
+static void evict(HashTable *ht, LockStripe *stripe, KeyNode *keep) {
+    IndexNode *entry = index_seek(&stripe->index, stripe->clock_hand[0] != '\0' ? stripe->clock_hand : NULL);
+    size_t passed = 0;
+    // Times the hand passed keep since it last changed a pair
+    unsigned int kept = 0;
+    while (stripe_bytes(stripe) > ht->stripe_budget) {
+        if (entry == NULL) {
+            entry = index_seek(&stripe->index, NULL); // Wrap around
+            if (entry == NULL) break;
+        }
+
+        IndexNode *next = entry->next[0];
+        KeyNode *keyNode = entry->pair;
+        if (keyNode == keep) {
+            if (kept++ > 0) break; // Nothing else is left to evict
+        } else if (atomic_load_explicit(&keyNode->referenced, memory_order_relaxed) && passed++ < EVICTION_SWEEP) {
+            atomic_store_explicit(&keyNode->referenced, 0, memory_order_relaxed);
+            kept = 0;
+        } else {
+            _Atomic(KeyNode *) *prev;
+            if (find_node(ht, keyNode->key, keyNode->hash, &prev) != keyNode ||
+                remove_pair(ht, stripe, prev, keyNode)) {
+                break;
+            }
+            atomic_fetch_add_explicit(&ht->evictions, 1, memory_order_relaxed);
+            kept = 0;
+        }
+        entry = next;
+    }
+
+    // The next eviction resumes where this one stopped
+    if (entry != NULL) {
+        strcpy(stripe->clock_hand, entry->key);
+    } else {
+        stripe->clock_hand[0] = '\0';
+    }
+}
+
+struct HashTable* create_hash_table(size_t capacity) {
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht) return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-      ht->table[i] = NULL;
+  // The table grows once count reaches size * MAX_LOAD_FACTOR
+  size_t buckets = capacity / MAX_LOAD_FACTOR + 1;
+  TableState *tables = malloc(sizeof(TableState));
+  if (!tables) {
+      free(ht);
+      return NULL;
+  }
+  tables->main = new_bucket_array(round_capacity(buckets > TABLE_SIZE ? buckets : TABLE_SIZE));
+  tables->next = NULL;
+  if (!tables->main) {
+      free(tables);
+      free(ht);
+      return NULL;
   }
+  atomic_init(&ht->tables, tables);
+  atomic_init(&ht->count, 0);
+  atomic_init(&ht->rehash_pending, 0);
+  atomic_init(&ht->maintenance, 0);
+  for (size_t s = 0; s < LOCK_STRIPES; s++) {
+      pthread_rwlock_init(&ht->stripes[s].lock, NULL);
+      ht->stripes[s].rehash_cursor = 0;
+      // Distinct seeds, so that stripes filled together differ in shape
+      index_init(&ht->stripes[s].index, (uint32_t)(s * 2654435761u + 1));
+      ht->stripes[s].retired = NULL;
+      ht->stripes[s].retired_count = 0;
+      ht->stripes[s].tombstones = NULL;
+      ht->stripes[s].pruned_floor = 0;
+      atomic_init(&ht->stripes[s].node_bytes, 0);
+      atomic_init(&ht->stripes[s].index_bytes, 0);
+      atomic_init(&ht->stripes[s].key_bytes, 0);
+      atomic_init(&ht->stripes[s].value_bytes, 0);
+      ht->stripes[s].clock_hand[0] = '\0';
+  }
+  slab_init(&ht->nodes, sizeof(KeyNode));
+  ht->track_changes = 0;
+  atomic_init(&ht->version, 0);
+  atomic_init(&ht->tombstone_floor, 0);
+  ht->stripe_budget = 0;
+  atomic_init(&ht->evictions, 0);
   return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
+int write_pair(HashTable *ht, const char *key, const char *value, uint64_t expires) {
+    char padded[MAX_STRING_SIZE];
+    size_t valueLen = strlen(value);
+    if (pad_key(padded, key) || valueLen >= MAX_STRING_SIZE) {
+        return 1;
+    }
+
+    size_t h = hash(key);
+    LockStripe *stripe = &ht->stripes[h & (LOCK_STRIPES - 1)];
+    rehash_step(ht, h & (LOCK_STRIPES - 1));
 
     // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            return 0;
-        }
-        keyNode = keyNode->next; // Move to the next node
+    _Atomic(KeyNode *) *prev;
+    KeyNode *oldNode = find_node(ht, padded, h, &prev);
+
+    KeyNode *keyNode = slab_alloc(&ht->nodes);
+    if (!keyNode) return 1;
+    keyNode->hash = (uint32_t)h;
+    memcpy(keyNode->key, padded, MAX_STRING_SIZE);
+    memcpy(keyNode->value, value, valueLen + 1);
+    keyNode->expires = expires;
+
+    if (oldNode != NULL) {
+        atomic_init(&keyNode->referenced, 1);
+        // Replace the node by an updated copy: readers see either one,
+        // never a value being overwritten
+        keyNode->version = next_version(ht);
+        keyNode->entry = oldNode->entry;
+        keyNode->entry->pair = keyNode;
+        atomic_init(&keyNode->next, load_link(&oldNode->next));
+        store_link(prev, keyNode);
+        charge(&stripe->value_bytes, valueLen, strlen(oldNode->value));
+        retire_node(ht, stripe, oldNode);
+        return 0;
     }
 
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
+    // Indexed first, so that a failure leaves nothing to undo
+    keyNode->entry = index_insert(&stripe->index, key, keyNode);
+    if (!keyNode->entry) {
+        slab_free(&ht->nodes, keyNode);
+        return 1;
+    }
+    keyNode->version = next_version(ht);
+    // New keys only survive the hand if they are used again, so that a
+    // stream of keys written once does not push out the ones in use
+    atomic_init(&keyNode->referenced, 0);
+
+    // Key not found. New entries always go to the newest table
+    TableState *tables = tables_of(ht);
+    _Atomic(KeyNode *) *bucket = bucket_of(tables->next ? tables->next : tables->main, h);
+    atomic_init(&keyNode->next, load_link(bucket)); // Link to existing nodes
+    store_link(bucket, keyNode); // Place new key node at the start of the list
+    atomic_fetch_add(&ht->count, 1);
+
+    charge(&stripe->node_bytes, sizeof(KeyNode), 0);
+    charge_index(stripe);
+    charge(&stripe->key_bytes, strlen(key), 0);
+    charge(&stripe->value_bytes, valueLen, 0);
+    if (ht->stripe_budget != 0 && stripe_bytes(stripe) > ht->stripe_budget) {
+        evict(ht, stripe, keyNode);
+    }
+
+    // The table can only be resized with every stripe held, which is left
+    // to unlock_stripes
+    if (needs_growth(ht)) {
+        atomic_store(&ht->maintenance, 1);
+    }
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    char* value;
+const char* read_pair(HashTable *ht, const char *key) {
+    // Reads neither lock nor advance the rehash: published nodes never
+    // change, and unlinked ones are only freed once this reader is done
+    char padded[MAX_STRING_SIZE];
+    if (pad_key(padded, key)) return NULL; // Too long to have been written
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return copy of the value if found
-        }
-        keyNode = keyNode->next; // Move to the next node
+    KeyNode *keyNode = find_node(ht, padded, hash(key), NULL);
+    if (keyNode == NULL) {
+        return NULL; // Key not found, or evicted
+    }
+    // Only pairs with a time to live pay for reading the clock
+    if (keyNode->expires != 0 && is_expired(keyNode, stats_now())) {
+        return NULL; // Not removed yet
     }
-    return NULL; // Key not found
+    // Marks the pair for the eviction hand. Already marked pairs are not
+    // written again, so that hot pairs do not bounce between readers
+    if (ht->stripe_budget != 0 && !atomic_load_explicit(&keyNode->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&keyNode->referenced, 1, memory_order_relaxed);
+    }
+    return keyNode->value; // Borrowed, until the read-side section ends
 }
 
 int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+    char padded[MAX_STRING_SIZE];
+    if (pad_key(padded, key)) return 1;
 
-    // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
+    size_t h = hash(key);
+    rehash_step(ht, h & (LOCK_STRIPES - 1));
+
+    _Atomic(KeyNode *) *prev;
+    KeyNode *keyNode = find_node(ht, padded, h, &prev);
+    if (keyNode == NULL) {
+        return 1;
+    }
+
+    int expired = keyNode->expires != 0 && is_expired(keyNode, stats_now());
+    if (remove_pair(ht, &ht->stripes[h & (LOCK_STRIPES - 1)], prev, keyNode)) {
+        return 1;
+    }
+    return expired; // Already missing, as far as readers could tell
+}
+
+int expire_pair(HashTable *ht, const char *key) {
+    char padded[MAX_STRING_SIZE];
+    if (pad_key(padded, key)) return 1;
+
+    size_t h = hash(key);
+    _Atomic(KeyNode *) *prev;
+    KeyNode *keyNode = find_node(ht, padded, h, &prev);
+    if (keyNode == NULL || !is_expired(keyNode, stats_now())) {
+        return 1; // Deleted, or written again since
+    }
+    return remove_pair(ht, &ht->stripes[h & (LOCK_STRIPES - 1)], prev, keyNode);
+}
+
+void track_changes(HashTable *ht) {
+    ht->track_changes = 1;
+}
+
+uint64_t table_version(HashTable *ht) {
+    return atomic_load(&ht->version);
+}
+
+void set_tombstone_floor(HashTable *ht, uint64_t version) {
+    atomic_store(&ht->tombstone_floor, version);
+}
+
+void set_memory_budget(HashTable *ht, size_t bytes) {
+    // A share of 0 would mean no limit
+    size_t share = bytes / LOCK_STRIPES;
+    ht->stripe_budget = bytes == 0 ? 0 : share > 0 ? share : 1;
+    if (ht->stripe_budget == 0) return;
+    // A restored table may already be over the budget
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        evict(ht, &ht->stripes[s], NULL);
+    }
+}
+
+void memory_usage(HashTable *ht, MemoryUsage *usage) {
+    *usage = (MemoryUsage){0};
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        LockStripe *stripe = &ht->stripes[s];
+        usage->node_bytes += atomic_load_explicit(&stripe->node_bytes, memory_order_relaxed);
+        usage->index_bytes += atomic_load_explicit(&stripe->index_bytes, memory_order_relaxed);
+        usage->key_bytes += atomic_load_explicit(&stripe->key_bytes, memory_order_relaxed);
+        usage->value_bytes += atomic_load_explicit(&stripe->value_bytes, memory_order_relaxed);
+    }
+    usage->budget = ht->stripe_budget * LOCK_STRIPES;
+    usage->evictions = atomic_load_explicit(&ht->evictions, memory_order_relaxed);
+}
+
+// Appends a pair to a snapshot, growing it if needed.
+// @return 0 if the pair was appended successfully, 1 otherwise.
+static int append_pair(Snapshot **snapshot, size_t *capacity, const char *key, const char *value,
+                       uint64_t expires) {
+    if ((*snapshot)->count == *capacity) {
+        size_t new_capacity = *capacity * 2;
+        Snapshot *grown = realloc(*snapshot, sizeof(Snapshot) + new_capacity * sizeof(KeyValue));
+        if (!grown) return 1;
+        *snapshot = grown;
+        *capacity = new_capacity;
+    }
+
+    KeyValue *pair = &(*snapshot)->pairs[(*snapshot)->count++];
+    strcpy(pair->key, key);
+    strcpy(pair->value, value);
+    pair->expires = expires;
+    return 0;
+}
+
+static Snapshot *empty_snapshot(size_t capacity) {
+    Snapshot *snapshot = malloc(sizeof(Snapshot) + capacity * sizeof(KeyValue));
+    if (snapshot) snapshot->count = 0;
+    return snapshot;
+}
+
+// Next index entry of every stripe, as a min-heap on the keys, to merge
+// the stripes in key order.
+typedef struct EntryHeap {
+    size_t size;
+    IndexNode *entries[LOCK_STRIPES];
+} EntryHeap;
+
+static void sift_down(EntryHeap *heap, size_t i) {
+    IndexNode *entry = heap->entries[i];
+    while (2 * i + 1 < heap->size) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < heap->size &&
+            strcmp(heap->entries[child + 1]->key, heap->entries[child]->key) < 0) {
+            child++;
+        }
+        if (strcmp(heap->entries[child]->key, entry->key) >= 0) break;
+        heap->entries[i] = heap->entries[child];
+        i = child;
+    }
+    heap->entries[i] = entry;
+}
+
+// Takes the lowest entry, replacing it by the next one of its stripe.
+static IndexNode *pop_entry(EntryHeap *heap) {
+    IndexNode *entry = heap->entries[0];
+    if (entry->next[0] != NULL) {
+        heap->entries[0] = entry->next[0];
+    } else {
+        heap->entries[0] = heap->entries[--heap->size];
+    }
+    if (heap->size > 0) sift_down(heap, 0);
+    return entry;
+}
+
+Snapshot *snapshot_range(HashTable *ht, const char *first, const char *last) {
+    // Whole tables are copied without growing the snapshot
+    size_t capacity = first == NULL && last == NULL ? atomic_load(&ht->count) + 1 : 64;
+    Snapshot *snapshot = empty_snapshot(capacity);
+    if (!snapshot) return NULL;
+
+    EntryHeap heap = {.size = 0};
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        IndexNode *entry = index_seek(&ht->stripes[s].index, first);
+        if (entry != NULL) heap.entries[heap.size++] = entry;
+    }
+    for (size_t i = heap.size / 2; i-- > 0;) {
+        sift_down(&heap, i);
+    }
+
+    uint64_t now = stats_now();
+    while (heap.size > 0) {
+        IndexNode *entry = pop_entry(&heap);
+        if (last != NULL && strcmp(entry->key, last) > 0) break;
+        if (is_expired(entry->pair, now)) continue;
+        if (append_pair(&snapshot, &capacity, entry->key, entry->pair->value, entry->pair->expires)) {
+            free(snapshot);
+            return NULL;
+        }
+    }
+    return snapshot;
+}
+
+Snapshot *snapshot_table(HashTable *ht) {
+    return snapshot_range(ht, NULL, NULL);
+}
+
+Snapshot *snapshot_changes(HashTable *ht, uint64_t since, Snapshot **deleted) {
+    size_t written_capacity = 64, deleted_capacity = 64;
+    Snapshot *written = empty_snapshot(written_capacity);
+    *deleted = empty_snapshot(deleted_capacity);
+    if (!written || !*deleted) goto fail;
+
+    uint64_t now = stats_now();
+    TableState *tables = tables_of(ht);
+    BucketArray *arrays[2] = {tables->main, tables->next};
+    for (int t = 0; t < 2 && arrays[t] != NULL; t++) {
+        for (size_t i = 0; i < arrays[t]->size; i++) {
+            for (KeyNode *keyNode = load_link(&arrays[t]->buckets[i]); keyNode != NULL;
+                 keyNode = load_link(&keyNode->next)) {
+                if (is_expired(keyNode, now)) {
+                    // Not removed yet, so there is no tombstone for it
+                    if (append_pair(deleted, &deleted_capacity, keyNode->key, "", 0)) goto fail;
+                } else if (keyNode->version > since &&
+                           append_pair(&written, &written_capacity, keyNode->key, keyNode->value,
+                                       keyNode->expires)) {
+                    goto fail;
+                }
             }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
     }
-    
-    return 1;
+
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        // Newest first, so stop at the first one already backed up
+        for (KeyNode *keyNode = ht->stripes[s].tombstones;
+             keyNode != NULL && keyNode->version > since; keyNode = load_link(&keyNode->next)) {
+            if (append_pair(deleted, &deleted_capacity, keyNode->key, "", 0)) goto fail;
+        }
+    }
+    return written;
+
+fail:
+    free(written);
+    free(*deleted);
+    *deleted = NULL;
+    return NULL;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    const KeyValue *pairA = a;
+    const KeyValue *pairB = b;
+    return strcmp(pairA->key, pairB->key);
+}
+
+void sort_snapshot(Snapshot *snapshot) {
+    qsort(snapshot->pairs, snapshot->count, sizeof(KeyValue), compare_pairs);
 }
 
 void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
-        }
+    // Nodes live in the slabs, which are released all at once
+    slab_destroy(&ht->nodes);
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        index_destroy(&ht->stripes[s].index);
+    }
+    TableState *tables = tables_of(ht);
+    free(tables->main);
+    free(tables->next);
+    free(tables);
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        pthread_rwlock_destroy(&ht->stripes[s].lock);
     }
     free(ht);
-}
\ No newline at end of file
+}
@@ -1,46 +1,296 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+// Initial number of buckets. The table doubles whenever the load factor
+// reaches MAX_LOAD_FACTOR, so this is only a starting capacity.
+#define TABLE_SIZE 64
+#define MAX_LOAD_FACTOR 1
+// Number of buckets migrated by each write/delete while the table is rehashing.
+#define REHASH_STEP 4
+// Number of reader/writer locks guarding the buckets. Bucket i belongs to
+// stripe i % LOCK_STRIPES, which holds for every table size since sizes are
+// powers of two no smaller than LOCK_STRIPES.
+#define LOCK_STRIPES 64
+#define ALL_STRIPES UINT64_MAX
+// Number of nodes a stripe retires before trying to free them.
+#define RETIRE_BATCH 64
+// Most index entries the eviction hand passes per eviction, so that a
+// stripe whose every pair was recently read still evicts in bounded time.
+#define EVICTION_SWEEP 128
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 
+#include "constants.h"
+#include "index.h"
+#include "slab.h"
+
+// Set of stripes, one bit per stripe.
+typedef uint64_t StripeMask;
+
+// Keys and values are stored inline, so a chain walk touches a single
+// allocation per node. Readers walk the chains without locks, so a
+// published node is never changed: writes replace it by a copy, and
+// replaced or deleted nodes are retired until no reader can see them.
+// The fields a chain walk reads come first, and nodes are aligned to a
+// cache line (see slab_init), so that they share one. The node takes two
+// lines exactly.
 typedef struct KeyNode
 {
-    char *key;
-    char *value;
-    struct KeyNode *next;
+    _Alignas(64) _Atomic(struct KeyNode *) next;
+    // Low half of the hash of the key, compared before the key itself. It
+    // places the node in bucket arrays of up to 2^32 buckets.
+    uint32_t hash;
+    // Set when the pair is read or overwritten, cleared as the eviction
+    // hand passes it: pairs still clear on the next pass are evicted.
+    // Readers only set it when a budget is set and it is clear.
+    atomic_uchar referenced;
+    // Padded with zeros, so that keys compare as fixed-size blocks.
+    char key[MAX_STRING_SIZE];
+    // Version of the table when the pair was last written (or deleted, for
+    // tombstones), 0 unless changes are tracked. Once the node is retired,
+    // the epoch it was retired in.
+    uint64_t version;
+    // Next node retired by the same stripe.
+    struct KeyNode *retired;
+    // Entry of the key in the ordered index of its stripe.
+    IndexNode *entry;
+    char value[MAX_STRING_SIZE];
+    // Time the pair expires at, as given by stats_now, 0 if it never does.
+    // Expired pairs read as missing until they are removed.
+    uint64_t expires;
 } KeyNode;
 
+typedef struct BucketArray
+{
+    size_t size;
+    _Atomic(KeyNode *) buckets[];
+} BucketArray;
+
+// Bucket arrays of a table. While rehashing, entries are moved
+// incrementally from main into next, which replaces main once empty.
+typedef struct TableState
+{
+    BucketArray *main;
+    // NULL unless rehashing.
+    BucketArray *next;
+} TableState;
+
+typedef struct KeyValue
+{
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+    // Time the pair expires at, as in write_pair; 0 if it never does.
+    uint64_t expires;
+} KeyValue;
+
+// Point-in-time copy of every pair of a table.
+typedef struct Snapshot
+{
+    size_t count;
+    KeyValue pairs[];
+} Snapshot;
+
+typedef struct LockStripe
+{
+    _Alignas(64) pthread_rwlock_t lock;
+    // Number of buckets of this stripe already moved out of the main array.
+    size_t rehash_cursor;
+    // Keys of this stripe in ascending order. Unlike the buckets, it is
+    // only walked with the stripe locked.
+    OrderedIndex index;
+    // Nodes unlinked from this stripe that readers may still see, newest
+    // first.
+    KeyNode *retired;
+    size_t retired_count;
+    // Keys of this stripe deleted while changes are tracked, newest first.
+    KeyNode *tombstones;
+    // Tombstone floor when the tombstones were last pruned.
+    uint64_t pruned_floor;
+    // Memory held by the pairs of this stripe, changed with the stripe
+    // locked for writing but read without locks (see MemoryUsage).
+    atomic_size_t node_bytes;
+    atomic_size_t index_bytes;
+    atomic_size_t key_bytes;
+    atomic_size_t value_bytes;
+    // Key the eviction hand stopped at, empty to start from the first one.
+    char clock_hand[MAX_STRING_SIZE];
+} LockStripe;
+
 typedef struct HashTable
 {
-    KeyNode *table[TABLE_SIZE];
-    // pthread_mutex_t mutex[TABLE_SIZE];
+    // Replaced as a whole, with every stripe held and only once no reader
+    // can still use the previous state, so that readers without locks
+    // always see a consistent pair of arrays.
+    _Atomic(TableState *) tables;
+    atomic_size_t count;
+    // Stripes that still have buckets to migrate.
+    atomic_size_t rehash_pending;
+    // Set when the table must grow or finish a rehash.
+    atomic_int maintenance;
+    LockStripe stripes[LOCK_STRIPES];
+    // Allocator of the nodes.
+    SlabPool nodes;
+    // When set, writes and deletes are stamped with a version so that the
+    // changes since a given version can be listed.
+    int track_changes;
+    atomic_uint_fast64_t version;
+    // Tombstones up to this version are no longer needed by anyone.
+    atomic_uint_fast64_t tombstone_floor;
+    // Bytes each stripe may hold (see MemoryUsage), 0 for no limit.
+    size_t stripe_budget;
+    atomic_size_t evictions;
 } HashTable;
 
+// Memory held by the pairs of a table. Every pair takes a node and an
+// entry in the ordered index of its stripe; tombstones and retired nodes
+// are not counted, as they are only kept for a while.
+typedef struct MemoryUsage
+{
+    // Bytes of the nodes, which hold their key and value inline.
+    size_t node_bytes;
+    // Bytes of the index entries.
+    size_t index_bytes;
+    // Characters of the keys and values stored, without padding.
+    size_t key_bytes;
+    size_t value_bytes;
+    // Limit of node_bytes + index_bytes, 0 if there is none.
+    size_t budget;
+    // Pairs evicted to stay within the budget.
+    size_t evictions;
+} MemoryUsage;
+
 /// Creates a new event hash table.
+/// @param capacity Number of pairs the table holds before it first grows.
+/// Smaller values (e.g. 0) start with TABLE_SIZE buckets.
 /// @return Newly created hash table, NULL on failure
-struct HashTable *create_hash_table();
+struct HashTable *create_hash_table(size_t capacity);
+
+/// Gets the hash a key is placed in the table by. Stripes and buckets
+/// use its low bits, so users of their own should use the high ones.
+/// @param key Key to hash.
+/// @return Hash of the key.
+size_t key_hash(const char *key);
+
+/// Gets the stripe guarding the bucket of a key.
+/// @param key Key to look up.
+/// @return Index of the stripe, below LOCK_STRIPES.
+size_t key_stripe(const char *key);
+
+/// Locks a set of stripes, in ascending order so that concurrent callers
+/// never deadlock.
+/// @param ht Hash table to lock.
+/// @param stripes Stripes to be locked.
+/// @param exclusive 1 to lock for writing, 0 to lock for reading.
+void lock_stripes(HashTable *ht, StripeMask stripes, int exclusive);
+
+/// Unlocks a set of stripes previously locked with lock_stripes, then
+/// grows the table if a write asked for it.
+/// @param ht Hash table to unlock.
+/// @param stripes Stripes to be unlocked.
+void unlock_stripes(HashTable *ht, StripeMask stripes);
 
 /// Appends a new key value pair to the hash table.
+/// The stripe of the key must be locked for writing.
 /// @param ht Hash table to be modified.
 /// @param key Key of the pair to be written.
 /// @param value Value of the pair to be written.
-/// @return 0 if the node was appended successfully, 1 otherwise.
-int write_pair(HashTable *ht, const char *key, const char *value);
+/// @param expires Time the pair expires at, as given by stats_now, 0 for
+/// a pair that never expires.
+/// @return 0 if the node was appended successfully, 1 otherwise (including
+/// keys or values that do not fit in MAX_STRING_SIZE).
+int write_pair(HashTable *ht, const char *key, const char *value, uint64_t expires);
+
+/// Reads the value of given key, without taking any lock.
+/// Must be called inside an epoch read-side section (see epoch.h), or with
+/// the stripe of the key locked.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @return Value stored in the table, NULL if not found or expired. The value is not
+/// copied: it stays valid only until the section ends (or the stripe is
+/// unlocked).
+const char *read_pair(HashTable *ht, const char *key);
 
 /// Deletes the value of given key.
+/// The stripe of the key must be locked for writing.
 /// @param ht Hash table to delete from.
 /// @param key Key of the pair to be deleted.
-/// @return 0 if the node was deleted successfully, 1 otherwise.
-char *read_pair(HashTable *ht, const char *key);
-
-/// Appends a new node to the list.
-/// @param list Event list to be modified.
-/// @param key Key of the pair to read.
-/// @return 0 if the node was appended successfully, 1 otherwise.
+/// @return 0 if the node was deleted successfully, 1 otherwise (including
+/// expired pairs, which are removed all the same).
 int delete_pair(HashTable *ht, const char *key);
 
+/// Removes a pair if it has expired.
+/// The stripe of the key must be locked for writing.
+/// @param ht Hash table to remove from.
+/// @param key Key of the pair.
+/// @return 0 if the pair was removed, 1 if it is missing or still live.
+int expire_pair(HashTable *ht, const char *key);
+
+/// Limits the memory the pairs of a table hold. The limit is split evenly
+/// between the stripes, and a write that takes a stripe past its share
+/// evicts pairs of the stripe that were not read or written recently.
+/// Evictions are removals like deletes, so the budget must not be combined
+/// with track_changes. Must be called before the table is shared between
+/// threads.
+/// @param ht Hash table to limit.
+/// @param bytes Bytes of nodes and index entries, 0 for no limit.
+void set_memory_budget(HashTable *ht, size_t bytes);
+
+/// Adds up the memory held by the pairs of a table, without taking any
+/// lock: each stripe is counted exactly, but stripes may change while
+/// others are being counted.
+/// @param ht Hash table to measure.
+/// @param usage Pointer to store the usage in.
+void memory_usage(HashTable *ht, MemoryUsage *usage);
+
+/// Copies every live pair of the table, in key order. Every stripe must be
+/// locked, but only for as long as the copy takes: the snapshot can then be
+/// written out while the table keeps changing.
+/// @param ht Hash table to copy.
+/// @return Newly allocated snapshot (to be freed by the caller), NULL on
+/// failure.
+Snapshot *snapshot_table(HashTable *ht);
+
+/// Copies the live pairs whose keys are within a range, in key order. Every
+/// stripe must be locked.
+/// @param ht Hash table to copy.
+/// @param first Lowest key of the range, NULL for no lower bound.
+/// @param last Highest key of the range, NULL for no upper bound.
+/// @return Newly allocated snapshot (to be freed by the caller), NULL on
+/// failure.
+Snapshot *snapshot_range(HashTable *ht, const char *first, const char *last);
+
+/// Starts stamping writes and deletes with versions. Must be called before
+/// the table is shared between threads.
+/// @param ht Hash table to track.
+void track_changes(HashTable *ht);
+
+/// Gets the version of the last change made to the table. Every stripe
+/// must be locked for the version to match a snapshot.
+/// @param ht Hash table to query.
+/// @return Current version.
+uint64_t table_version(HashTable *ht);
+
+/// Allows tombstones up to a version to be discarded.
+/// @param ht Hash table to update.
+/// @param version Oldest version anyone may still ask changes since.
+void set_tombstone_floor(HashTable *ht, uint64_t version);
+
+/// Copies the live pairs written and the keys deleted after a given
+/// version. Changes must be tracked, and every stripe must be locked.
+/// @param ht Hash table to copy from.
+/// @param since Version of the previous copy.
+/// @param deleted Pointer to store the deleted keys (with empty values).
+/// @return Newly allocated snapshot of the written pairs (to be freed by
+/// the caller, as well as *deleted), NULL on failure.
+Snapshot *snapshot_changes(HashTable *ht, uint64_t since, Snapshot **deleted);
+
+/// Sorts the pairs of a snapshot by key.
+/// @param snapshot Snapshot to be sorted.
+void sort_snapshot(Snapshot *snapshot);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
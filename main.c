@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,25 +8,42 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <semaphore.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "constants.h"
+#include "kvs.h"
 #include "parser.h"
+#include "ring.h"
 #include "operations.h"
+#include "scheduler.h"
+#include "server.h"
+#include "shard.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
 
 char *folderName;
 int MAX_CONCURRENT_BACKUPS;
 int MAX_CONCURRENT_THREADS;
 
-int concurrent_backups = 0;
 int concurrent_threads = 0;
-
-pthread_mutex_t backup_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-DIR *dirp;
+// Whether each job is parsed in a thread of its own, ahead of execution.
+int PIPELINE_JOBS = 0;
+// Whether the statistics are written to stderr once every job is done.
+int PRINT_STATS = 0;
+// File the trace is written to once every job is done, or NULL.
+const char *TRACE_PATH = NULL;
+// Socket clients are served on once every job is done, or NULL.
+const char *SERVER_PATH = NULL;
+
+#ifdef KVS_TRACE
+// Names of the commands in the trace, indexed by enum Command.
+static const char *const COMMAND_NAMES[] = {
+    "WRITE", "READ", "DELETE", "SHOW", "SCAN", "STATS",
+    "WAIT", "BACKUP", "HELP", "EMPTY", "INVALID", "EOC"};
+#endif
 
 char *generateOutFilename(char *filename, char *outFilename)
 {
@@ -37,162 +55,349 @@ char *generateOutFilename(char *filename, char *outFilename)
   return outFilename;
 }
 
-int executeCommand(int fdOut, int fdIn, char *inputFilename)
+// READ writes its pairs in key order.
+static void sortKeys(ParsedCommand *cmd)
+{
+  if (cmd->command == CMD_READ)
+  {
+    qsort(cmd->keys, cmd->num_pairs, MAX_STRING_SIZE, (int (*)(const void *, const void *))strcmp);
+  }
+}
+
+static void parseCommand(int fd, ParsedCommand *cmd)
+{
+  uint64_t start = stats_now();
+  parse_command(fd, cmd);
+  sortKeys(cmd);
+  stats_parse(stats_now() - start);
+}
+
+// Records the latency of the commands STATS reports on.
+static void recordLatency(enum Command command, uint64_t ns)
+{
+  switch (command)
+  {
+  case CMD_WRITE:
+    stats_command(STATS_WRITE, ns);
+    break;
+  case CMD_READ:
+    stats_command(STATS_READ, ns);
+    break;
+  case CMD_DELETE:
+    stats_command(STATS_DELETE, ns);
+    break;
+  case CMD_SHOW:
+    stats_command(STATS_SHOW, ns);
+    break;
+  case CMD_SCAN:
+    stats_command(STATS_SCAN, ns);
+    break;
+  case CMD_BACKUP:
+    stats_command(STATS_BACKUP, ns);
+    break;
+  case CMD_STATS:
+  case CMD_WAIT:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    break;
+  }
+}
+
+static const char HELP_TEXT[] =
+    "Available commands:\n"
+    "  WRITE [(key,value)(key2,value2),...] [TTL <ms>]\n"
+    "  READ [key,key2,...]\n"
+    "  DELETE [key,key2,...]\n"
+    "  SHOW\n"
+    "  SCAN [prefix] | [first,last]\n"
+    "  STATS\n"
+    "  WAIT <delay_ms>\n"
+    "  BACKUP\n"
+    "  HELP\n";
+
+// Reports an error to the client of a session, or to stderr if reply
+// is NULL.
+static void reportError(OutputBuffer *reply, const char *message)
+{
+  if (reply != NULL)
+  {
+    output_puts(reply, message);
+  }
+  else
+  {
+    fputs(message, stderr);
+  }
+}
+
+// Runs a parsed command. Errors and HELP go to reply when the command
+// came from a client, or to stderr and stdout when reply is NULL.
+// @return 1 once the commands have ended, 0 otherwise.
+static int runCommand(ParsedCommand *cmd, OutputBuffer *out, OutputBuffer *reply, char *inputFilename, BackupState *backups)
 {
-  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-  unsigned int delay;
-  size_t num_pairs;
+  uint64_t start = stats_now();
+  TRACE_BEGIN(COMMAND_NAMES[cmd->command], NULL);
 
-  while (1)
+  switch (cmd->command)
   {
-    switch (get_next(fdIn))
+  case CMD_WRITE:
+    if (cmd->num_pairs == 0)
     {
-    case CMD_WRITE:
-      num_pairs = parse_write(fdIn, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-      if (num_pairs == 0)
-      {
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-      }
+      reportError(reply, "Invalid command. See HELP for usage\n");
+    }
 
-      if (kvs_write(num_pairs, keys, values))
-      {
-        fprintf(stderr, "Failed to write pair\n");
-      }
+    if (kvs_write(cmd->num_pairs, cmd->keys, cmd->values, cmd->ttl_ms))
+    {
+      reportError(reply, "Failed to write pair\n");
+    }
 
-      break;
+    break;
 
-    case CMD_READ:
-      num_pairs = parse_read_delete(fdIn, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+  case CMD_READ:
+    if (cmd->num_pairs == 0)
+    {
+      reportError(reply, "Invalid command. See HELP for usage\n");
+    }
 
-      if (num_pairs == 0)
-      {
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-      }
+    if (kvs_read(cmd->num_pairs, cmd->keys, out))
+    {
+      reportError(reply, "Failed to read pair\n");
+    }
+    break;
 
-      qsort(keys, num_pairs, MAX_STRING_SIZE, (int (*)(const void *, const void *))strcmp);
+  case CMD_DELETE:
+    if (cmd->num_pairs == 0)
+    {
+      reportError(reply, "Invalid command. See HELP for usage\n");
+    }
 
+    if (kvs_delete(cmd->num_pairs, cmd->keys, out))
+    {
+      reportError(reply, "Failed to delete pair\n");
+    }
+    break;
 
-      if (kvs_read(num_pairs, keys, fdOut))
-      {
-        fprintf(stderr, "Failed to read pair\n");
-      }
-      break;
+  case CMD_SHOW:
 
-    case CMD_DELETE:
-      num_pairs = parse_read_delete(fdIn, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+    kvs_show(out);
+    break;
 
-      if (num_pairs == 0)
-      {
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-      }
+  case CMD_SCAN:
+    if (cmd->num_pairs == 0)
+    {
+      reportError(reply, "Invalid command. See HELP for usage\n");
+    }
+    else if (kvs_scan(cmd->num_pairs, cmd->keys, out))
+    {
+      reportError(reply, "Failed to scan pairs\n");
+    }
+    break;
 
-      if (kvs_delete(num_pairs, keys, fdOut))
-      {
-        fprintf(stderr, "Failed to delete pair\n");
-      }
-      break;
+  case CMD_STATS:
+    kvs_stats(out);
+    break;
 
-    case CMD_SHOW:
+  case CMD_WAIT:
+    if (cmd->wait_result == -1)
+    {
+      reportError(reply, "Invalid command. See HELP for usage\n");
+    }
 
-      kvs_show(fdOut);
-      break;
+    if (cmd->delay > 0)
+    {
+      kvs_wait(cmd->delay);
+    }
+    break;
 
-    case CMD_WAIT:
-      if (parse_wait(fdIn, &delay, NULL) == -1)
-      {
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-      }
+  case CMD_BACKUP:
+    if (kvs_backup(inputFilename, backups))
+    {
+      reportError(reply, "Failed to perform backup.\n");
+    }
+    break;
 
-      if (delay > 0)
-      {
-        kvs_wait(delay);
-      }
-      break;
+  case CMD_INVALID:
+    reportError(reply, "Invalid command. See HELP for usage\n");
+    break;
 
-    case CMD_BACKUP:
+  case CMD_HELP:
+    if (reply != NULL)
+    {
+      output_puts(reply, HELP_TEXT);
+    }
+    else
+    {
+      fputs(HELP_TEXT, stdout);
+    }
+    break;
 
-      
+  case CMD_EMPTY:
+    break;
 
-      while (concurrent_backups >= MAX_CONCURRENT_BACKUPS)
-      {
-        int status;
-        printf("Waiting for one backup complete...\n");
-        wait(&status);
-        concurrent_backups--;
-        printf("Backup complete.\n");
-      }
+  case EOC:
+    output_flush(out);
+    TRACE_END(COMMAND_NAMES[cmd->command]);
+    return 1;
+  }
 
-      pthread_mutex_lock(&backup_mutex);
+  TRACE_END(COMMAND_NAMES[cmd->command]);
+  recordLatency(cmd->command, stats_now() - start);
+  return 0;
+}
 
-      int pid = fork();
-      if (pid == 0)
-      {
-        pthread_mutex_unlock(&backup_mutex);
+// Limits the parser of the calling thread to the bytes of a chunk, if
+// end is not 0.
+// @return 0 if the parser is ready, 1 otherwise.
+static int openRange(int fd, size_t start, size_t end, char *inputFilename)
+{
+  if (end > 0 && parser_set_range(fd, start, end) != 0)
+  {
+    printf("Error mapping file %s\n", inputFilename);
+    return 1;
+  }
+  return 0;
+}
 
-        int backup_result = kvs_backup(inputFilename);
+// Runs a command a client of the server sent.
+static void serveCommand(ParsedCommand *cmd, OutputBuffer *out, char *sessionName, BackupState *backups)
+{
+  sortKeys(cmd);
+  runCommand(cmd, out, out, sessionName, backups);
+}
 
-        if (backup_result != 0)
-        {
-          fprintf(stderr, "Failed to perform backup.\n");
-          exit(1);
-        }
+// Parses and runs the commands one after the other.
+static void executeSequential(OutputBuffer *out, int fdIn, size_t start, size_t end, char *inputFilename, BackupState *backups)
+{
+  ParsedCommand *cmd = malloc(sizeof(ParsedCommand));
+  if (cmd == NULL || openRange(fdIn, start, end, inputFilename))
+  {
+    free(cmd);
+    parser_release(fdIn);
+    return;
+  }
 
-        _exit(0);
-      }
-      else if (pid > 0)
-      {
-        concurrent_backups++;
-        pthread_mutex_unlock(&backup_mutex);
-      }
-      else
-      {
+  do
+  {
+    parseCommand(fdIn, cmd);
+  } while (!runCommand(cmd, out, NULL, inputFilename, backups));
 
-        perror("Fork failed");
-      }
-      break;
+  free(cmd);
+  parser_release(fdIn);
+}
 
-    case CMD_INVALID:
-      fprintf(stderr, "Invalid command. See HELP for usage\n");
-      break;
+// Parser stage of a pipelined job, running in its own thread.
+typedef struct ParseStage
+{
+  int fd;
+  size_t start;
+  size_t end;
+  char *inputFilename;
+  SpscRing *ring;
+} ParseStage;
 
-    case CMD_HELP:
-      printf(
-          "Available commands:\n"
-          "  WRITE [(key,value)(key2,value2),...]\n"
-          "  READ [key,key2,...]\n"
-          "  DELETE [key,key2,...]\n"
-          "  SHOW\n"
-          "  WAIT <delay_ms>\n"
-          "  BACKUP\n"
-          "  HELP\n");
+static void *parseStage(void *arg)
+{
+  ParseStage *stage = arg;
+  int failed = openRange(stage->fd, stage->start, stage->end, stage->inputFilename);
+  enum Command command;
 
-      break;
+  do
+  {
+    ParsedCommand *cmd = ring_claim(stage->ring);
+    if (failed)
+      cmd->command = EOC;
+    else
+      parseCommand(stage->fd, cmd);
+    // The slot belongs to the executor once published
+    command = cmd->command;
+    ring_publish(stage->ring);
+  } while (command != EOC);
+
+  // The parser state of the file lives in this thread
+  parser_release(stage->fd);
+  return NULL;
+}
 
-    case CMD_EMPTY:
-      break;
+// Parses the commands in a thread of its own, up to PIPELINE_DEPTH
+// commands ahead, while this thread runs them.
+static void executePipelined(OutputBuffer *out, int fdIn, size_t start, size_t end, char *inputFilename, BackupState *backups)
+{
+  ParseStage stage = {fdIn, start, end, inputFilename, ring_create(PIPELINE_DEPTH, sizeof(ParsedCommand))};
+  pthread_t parser;
 
-    case EOC:
-      return 0;
-      break;
-    }
+  if (stage.ring == NULL || pthread_create(&parser, NULL, parseStage, &stage) != 0)
+  {
+    if (stage.ring != NULL)
+      ring_destroy(stage.ring);
+    executeSequential(out, fdIn, start, end, inputFilename, backups);
+    return;
   }
 
-  return 0;
+  int done;
+  do
+  {
+    ParsedCommand *cmd = ring_peek(stage.ring);
+    done = runCommand(cmd, out, NULL, inputFilename, backups);
+    ring_release(stage.ring);
+  } while (!done);
+
+  pthread_join(parser, NULL);
+  ring_destroy(stage.ring);
 }
 
-int readLine(char *filePath)
+// Runs the commands of a job, or of the bytes between start and end if
+// end is not 0.
+int executeCommand(OutputBuffer *out, int fdIn, size_t start, size_t end, char *inputFilename)
 {
-  int fd;
-  int fdOut;
+  BackupState backups;
+  kvs_backup_begin(&backups);
+
+  if (PIPELINE_JOBS)
+    executePipelined(out, fdIn, start, end, inputFilename, &backups);
+  else
+    executeSequential(out, fdIn, start, end, inputFilename, &backups);
+
+  kvs_backup_end(&backups);
+  return 0;
+}
 
-  fd = open(filePath, O_RDONLY);
+// Runs the commands of a job file, or of the bytes between start and end
+// if end is not 0, writing their output to fdOut.
+static int runCommands(char *filePath, int fdOut, size_t start, size_t end)
+{
+  int fd = open(filePath, O_RDONLY);
   if (fd == -1)
   {
     printf("Error opening file %s\n", filePath);
     return -1;
   }
 
+  OutputBuffer *out = malloc(sizeof(OutputBuffer));
+  if (out == NULL)
+  {
+    printf("Error allocating output buffer for %s\n", filePath);
+    close(fd);
+    return -1;
+  }
+  output_init(out, fdOut, OUTPUT_JOB);
+
+  executeCommand(out, fd, start, end, filePath);
+  free(out);
+
+  if (close(fd) == -1)
+  {
+    printf("Error closing file %s\n", filePath);
+    return -1;
+  }
+
+  return 0;
+}
+
+int readLine(char *filePath)
+{
+  int fdOut;
+
   size_t len = strlen(filePath);
   char outFilename[len + 1];
   generateOutFilename(filePath, outFilename);
@@ -204,64 +409,613 @@ int readLine(char *filePath)
     return -1;
   }
 
-  executeCommand(fdOut, fd, filePath);
+  int result = runCommands(filePath, fdOut, 0, 0);
 
-  if (close(fd) == -1)
+  close(fdOut);
+
+  return result;
+}
+
+// A job file split in chunks that run on different threads.
+typedef struct SplitJob
+{
+  pthread_mutex_t mutex;
+  unsigned int count;
+  // Chunks still running.
+  unsigned int remaining;
+  // Output file of the job, written by the first chunk.
+  int fdOut;
+  // Output of the other chunks, appended in order once all are done.
+  FILE *parts[JOB_MAX_CHUNKS];
+} SplitJob;
+
+typedef struct JobFile
+{
+  size_t size;
+  // Bytes of the file to run, for a chunk of a split job.
+  size_t start;
+  size_t end;
+  SplitJob *split;
+  unsigned int chunk;
+  char path[];
+} JobFile;
+
+static JobFile *newJobFile(const char *path, size_t size)
+{
+  JobFile *job = malloc(sizeof(JobFile) + strlen(path) + 1);
+  if (job == NULL)
+    return NULL;
+
+  job->size = size;
+  job->start = job->end = 0;
+  job->split = NULL;
+  job->chunk = 0;
+  strcpy(job->path, path);
+  return job;
+}
+
+// Key of a job and the offset of the last command that touched it.
+typedef struct TouchedKey
+{
+  char key[MAX_STRING_SIZE];
+  // SIZE_MAX for an empty slot.
+  size_t offset;
+} TouchedKey;
+
+// Keys touched so far while a job is scanned for chunks, in an open
+// addressing table with linear probing, at most half full.
+typedef struct TouchedKeys
+{
+  TouchedKey *slots;
+  // A power of two.
+  size_t capacity;
+  size_t used;
+} TouchedKeys;
+
+// @return 0 if the slots were allocated, 1 otherwise.
+static int allocTouched(TouchedKeys *touched, size_t capacity)
+{
+  touched->slots = malloc(capacity * sizeof(TouchedKey));
+  if (touched->slots == NULL)
+    return 1;
+
+  for (size_t i = 0; i < capacity; i++)
   {
-    printf("Error closing file %s\n", filePath);
-    return -1;
+    touched->slots[i].offset = SIZE_MAX;
   }
+  touched->capacity = capacity;
+  touched->used = 0;
+  return 0;
+}
 
-  printf("\n");
+static TouchedKey *findTouched(TouchedKeys *touched, const char *key)
+{
+  size_t mask = touched->capacity - 1;
+  size_t i = key_hash(key) & mask;
+  while (touched->slots[i].offset != SIZE_MAX && strcmp(touched->slots[i].key, key) != 0)
+  {
+    i = (i + 1) & mask;
+  }
+  return &touched->slots[i];
+}
 
-  close(fdOut);
+// Records that the command at offset touches a key.
+// @param previous Set to the offset of the last command that touched the
+// key before, SIZE_MAX if none did.
+// @return 0 on success, 1 if the table could not grow.
+static int touchKey(TouchedKeys *touched, const char *key, size_t offset, size_t *previous)
+{
+  if (2 * (touched->used + 1) > touched->capacity)
+  {
+    TouchedKeys grown;
+    if (allocTouched(&grown, 2 * touched->capacity))
+      return 1;
 
+    for (size_t i = 0; i < touched->capacity; i++)
+    {
+      if (touched->slots[i].offset != SIZE_MAX)
+        *findTouched(&grown, touched->slots[i].key) = touched->slots[i];
+    }
+    grown.used = touched->used;
+    free(touched->slots);
+    *touched = grown;
+  }
+
+  TouchedKey *slot = findTouched(touched, key);
+  *previous = slot->offset;
+  if (slot->offset == SIZE_MAX)
+  {
+    strcpy(slot->key, key);
+    touched->used++;
+  }
+  slot->offset = offset;
   return 0;
 }
 
-void *read_line_thread()
+// Looks for up to count chunks of about the same size that can run
+// concurrently without changing the job's output: no chunk may hold a
+// SHOW, SCAN, STATS, WAIT or BACKUP, nor touch a key another chunk
+// touches. Cuts are placed at even offsets, then pushed forward past any
+// command that touches a key also touched before the cut.
+// @return Number of chunks found, their offsets stored in bounds; less
+// than 2 if the job cannot be split.
+static unsigned int findChunks(char *filePath, size_t size, unsigned int count, size_t bounds[])
 {
-  struct dirent *dp;
-  char filePath[MAX_JOB_FILE_NAME_SIZE];
+  int fd = open(filePath, O_RDONLY);
+  if (fd == -1)
+    return 0;
+
+  TouchedKeys touched;
+  if (allocTouched(&touched, 1024))
+  {
+    close(fd);
+    return 0;
+  }
+  if (parser_set_range(fd, 0, size) != 0)
+  {
+    free(touched.slots);
+    parser_release(fd);
+    close(fd);
+    return 0;
+  }
 
-  while (1)
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  unsigned int ttl_ms;
+  // cuts[i] is where chunk i + 1 starts, SIZE_MAX while it must move past
+  // the command just parsed
+  size_t cuts[JOB_MAX_CHUNKS];
+  unsigned int num_cuts = 0;
+  int splittable = 1;
+
+  while (splittable)
   {
+    size_t offset = parser_offset(fd);
+    for (unsigned int i = 0; i < num_cuts; i++)
+    {
+      if (cuts[i] == SIZE_MAX)
+        cuts[i] = offset;
+    }
+    if (num_cuts + 1 < count && offset >= (num_cuts + 1) * (size / count))
+      cuts[num_cuts++] = offset;
+
+    size_t num_keys = 0;
+    enum Command command = get_next(fd);
+    if (command == EOC)
+      break;
+
+    switch (command)
+    {
+    case CMD_WRITE:
+      num_keys = parse_write(fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE, &ttl_ms);
+      break;
+
+    case CMD_READ:
+    case CMD_DELETE:
+      num_keys = parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      break;
+
+    case CMD_SHOW:
+    case CMD_SCAN:
+    case CMD_STATS:
+    case CMD_WAIT:
+    case CMD_BACKUP:
+      splittable = 0;
+      break;
+
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+      break;
+    }
+
+    for (size_t i = 0; i < num_keys; i++)
+    {
+      size_t previous;
+      if (touchKey(&touched, keys[i], offset, &previous))
+      {
+        splittable = 0;
+        break;
+      }
+
+      for (unsigned int j = 0; j < num_cuts && previous != SIZE_MAX; j++)
+      {
+        if (cuts[j] > previous && cuts[j] <= offset)
+          cuts[j] = SIZE_MAX;
+      }
+    }
+  }
+
+  free(touched.slots);
+  parser_release(fd);
+  close(fd);
+
+  if (!splittable)
+    return 0;
+
+  // Cuts pushed onto each other, or to the end, are dropped
+  unsigned int chunks = 1;
+  bounds[0] = 0;
+  for (unsigned int i = 0; i < num_cuts; i++)
+  {
+    if (cuts[i] != SIZE_MAX && cuts[i] < size && cuts[i] > bounds[chunks - 1])
+      bounds[chunks++] = cuts[i];
+  }
+  bounds[chunks] = size;
+  return chunks;
+}
+
+// Called as each chunk of a split job completes. The last one assembles
+// the output of the job.
+static void finishChunk(SplitJob *split)
+{
+  pthread_mutex_lock(&split->mutex);
+  int last = --split->remaining == 0;
+  pthread_mutex_unlock(&split->mutex);
+  if (!last)
+    return;
+
+  char *buffer = malloc(OUTPUT_BUFFER_SIZE);
+  for (unsigned int i = 1; i < split->count; i++)
+  {
+    int fdPart = fileno(split->parts[i]);
+    ssize_t bytes = lseek(fdPart, 0, SEEK_SET) == 0 && buffer != NULL ? 1 : -1;
+    while (bytes > 0 && (bytes = read(fdPart, buffer, OUTPUT_BUFFER_SIZE)) > 0)
+    {
+      if (output_write_all(split->fdOut, OUTPUT_JOB, buffer, (size_t)bytes))
+        bytes = -1;
+    }
+    if (bytes < 0)
+      fprintf(stderr, "Failed to assemble the output of a split job\n");
+    fclose(split->parts[i]);
+  }
+  free(buffer);
+
+  close(split->fdOut);
+  pthread_mutex_destroy(&split->mutex);
+  free(split);
+}
+
+static void runChunk(void *arg)
+{
+  JobFile *chunk = arg;
+  SplitJob *split = chunk->split;
+
+  runCommands(chunk->path, fileno(split->parts[chunk->chunk]), chunk->start, chunk->end);
+  finishChunk(split);
+  free(chunk);
+}
+
+// Splits a large job in chunks queued for other threads to steal, and
+// runs the first one.
+// @return 0 if the job was split and run, 1 if it must run as a whole.
+static int splitJob(JobFile *job, unsigned int count)
+{
+  size_t bounds[JOB_MAX_CHUNKS + 1];
+  count = findChunks(job->path, job->size, count, bounds);
+  if (count < 2)
+    return 1;
+
+  SplitJob *split = malloc(sizeof(SplitJob));
+  if (split == NULL)
+    return 1;
+
+  size_t len = strlen(job->path);
+  char outFilename[len + 1];
+  generateOutFilename(job->path, outFilename);
 
-    pthread_mutex_lock(&thread_mutex);
-    dp = readdir(dirp);
-    pthread_mutex_unlock(&thread_mutex);
+  split->fdOut = open(outFilename, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (split->fdOut == -1)
+  {
+    printf("Error creating file %s\n", outFilename);
+    free(split);
+    return 1;
+  }
 
-    if (dp == NULL)
+  // Output of the later chunks is held in temporary files until the
+  // chunks before them are done
+  unsigned int parts;
+  for (parts = 1; parts < count; parts++)
+  {
+    split->parts[parts] = tmpfile();
+    if (split->parts[parts] == NULL)
       break;
+  }
+  if (parts < count)
+  {
+    while (--parts > 0)
+      fclose(split->parts[parts]);
+    close(split->fdOut);
+    free(split);
+    return 1;
+  }
 
+  pthread_mutex_init(&split->mutex, NULL);
+  split->count = count;
+  split->remaining = count;
+  TRACE_INSTANT("split job", job->path);
+
+  for (unsigned int i = 1; i < count; i++)
+  {
+    JobFile *chunk = newJobFile(job->path, bounds[i + 1] - bounds[i]);
+    if (chunk == NULL)
+    {
+      // Runs the chunk here instead
+      runCommands(job->path, fileno(split->parts[i]), bounds[i], bounds[i + 1]);
+      finishChunk(split);
+      continue;
+    }
+
+    chunk->start = bounds[i];
+    chunk->end = bounds[i + 1];
+    chunk->split = split;
+    chunk->chunk = i;
+    if (scheduler_submit(chunk->size, runChunk, chunk))
+      runChunk(chunk);
+  }
+
+  runCommands(job->path, split->fdOut, 0, bounds[1]);
+  finishChunk(split);
+  return 0;
+}
+
+static void runJob(void *arg)
+{
+  JobFile *job = arg;
+
+  TRACE_BEGIN("job", job->path);
+
+  unsigned int count = (unsigned int)(job->size / JOB_CHUNK_SIZE);
+  if (count > (unsigned int)MAX_CONCURRENT_THREADS)
+    count = (unsigned int)MAX_CONCURRENT_THREADS;
+  if (count > JOB_MAX_CHUNKS)
+    count = JOB_MAX_CHUNKS;
+
+  if (count < 2 || splitJob(job, count) != 0)
+    readLine(job->path);
+  TRACE_END("job");
+  free(job);
+}
+
+static int compareJobSizes(const void *a, const void *b)
+{
+  const JobFile *jobA = *(JobFile *const *)a;
+  const JobFile *jobB = *(JobFile *const *)b;
+  return (jobA->size < jobB->size) - (jobA->size > jobB->size);
+}
+
+// Lists the job files and queues them, largest first, so that the longest
+// jobs start early and the smaller ones fill in around them.
+int scheduleJobs()
+{
+  DIR *dirp = opendir(folderName);
+  if (dirp == NULL)
+  {
+    perror("Error opening job directory");
+    return 1;
+  }
+
+  JobFile **jobs = NULL;
+  size_t num_jobs = 0;
+  size_t capacity = 0;
+  struct dirent *dp;
+  char filePath[MAX_JOB_FILE_NAME_SIZE];
+
+  while ((dp = readdir(dirp)) != NULL)
+  {
     if (strcmp(dp->d_name, ".") == 0 ||
         strcmp(dp->d_name, "..") == 0 ||
         strstr(dp->d_name, ".out") != NULL ||
-        strstr(dp->d_name, ".bck") != NULL)
+        strstr(dp->d_name, ".bck") != NULL ||
+        strstr(dp->d_name, ".delta") != NULL ||
+        strstr(dp->d_name, ".snap") != NULL ||
+        strstr(dp->d_name, ".wal") != NULL)
       continue;
 
     snprintf(filePath, sizeof(filePath), "%s/%s", folderName, dp->d_name);
 
-    printf("Reading file: %s\n", filePath);
+    struct stat st;
+    size_t size = stat(filePath, &st) == 0 ? (size_t)st.st_size : 0;
+
+    if (num_jobs == capacity)
+    {
+      capacity = capacity == 0 ? 16 : capacity * 2;
+      JobFile **grown = realloc(jobs, capacity * sizeof(JobFile *));
+      if (grown == NULL)
+        break;
+      jobs = grown;
+    }
+
+    jobs[num_jobs] = newJobFile(filePath, size);
+    if (jobs[num_jobs] == NULL)
+      break;
+    num_jobs++;
+  }
+  closedir(dirp);
 
-    readLine(filePath);
+  if (num_jobs > 0)
+    qsort(jobs, num_jobs, sizeof(JobFile *), compareJobSizes);
+  for (size_t i = 0; i < num_jobs; i++)
+  {
+    if (scheduler_submit(jobs[i]->size, runJob, jobs[i]))
+      free(jobs[i]);
   }
+  free(jobs);
 
-  pthread_exit(EXIT_SUCCESS);
+  return 0;
+}
+
+// Parses a number of bytes, optionally followed by K, M or G.
+// @return 0 if the number was parsed, 1 otherwise.
+static int parseBytes(const char *text, size_t *bytes)
+{
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (errno != 0 || end == text || *text == '-')
+    return 1;
+
+  unsigned int shift = 0;
+  switch (*end)
+  {
+  case 'K':
+    shift = 10;
+    break;
+  case 'M':
+    shift = 20;
+    break;
+  case 'G':
+    shift = 30;
+    break;
+  case '\0':
+    break;
+  default:
+    return 1;
+  }
+  if (shift > 0 && *++end != '\0')
+    return 1;
+  if (value > (SIZE_MAX >> shift))
+    return 1;
+
+  *bytes = (size_t)value << shift;
+  return 0;
+}
+
+// Parses a whole decimal number within a range.
+// @return 0 if the number was parsed, 1 otherwise.
+static int parseUnsigned(const char *text, long min, long max, unsigned int *value)
+{
+  char *end;
+  errno = 0;
+  long number = strtol(text, &end, 10);
+  if (errno != 0 || end == text || *end != '\0' || number < min || number > max)
+    return 1;
+
+  *value = (unsigned int)number;
+  return 0;
+}
+
+// Parses the optional arguments that follow the mandatory ones.
+int parseOptions(int argc, char *argv[], KvsOptions *options)
+{
+  for (int i = 0; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--delta-backups") == 0)
+    {
+      options->delta_backups = 1;
+    }
+    else if (strcmp(argv[i], "--binary-snapshots") == 0)
+    {
+      options->binary_snapshots = 1;
+    }
+    else if (strncmp(argv[i], "--restore=", 10) == 0)
+    {
+      options->restore_path = argv[i] + 10;
+    }
+    else if (strcmp(argv[i], "--pipeline") == 0)
+    {
+      PIPELINE_JOBS = 1;
+    }
+    else if (strcmp(argv[i], "--stats") == 0)
+    {
+      PRINT_STATS = 1;
+    }
+    else if (strncmp(argv[i], "--serve=", 8) == 0)
+    {
+      SERVER_PATH = argv[i] + 8;
+    }
+    else if (strcmp(argv[i], "--no-uring") == 0)
+    {
+      uring_disable();
+    }
+    else if (strncmp(argv[i], "--trace=", 8) == 0)
+    {
+#ifdef KVS_TRACE
+      TRACE_PATH = argv[i] + 8;
+#else
+      fprintf(stderr, "Tracing is not built in; rebuild with make TRACE=1\n");
+      return 1;
+#endif
+    }
+    else if (strncmp(argv[i], "--memory=", 9) == 0)
+    {
+      if (parseBytes(argv[i] + 9, &options->memory_budget))
+      {
+        fprintf(stderr, "Invalid memory budget %s\n", argv[i] + 9);
+        return 1;
+      }
+    }
+    else if (strncmp(argv[i], "--shards=", 9) == 0)
+    {
+      if (parseUnsigned(argv[i] + 9, 1, SHARD_MAX, &options->shards))
+      {
+        fprintf(stderr, "Invalid number of shards %s (1 to %d)\n", argv[i] + 9, SHARD_MAX);
+        return 1;
+      }
+    }
+    else if (strncmp(argv[i], "--wal=", 6) == 0)
+    {
+      options->wal_path = argv[i] + 6;
+    }
+    else if (strcmp(argv[i], "--wal-sync=always") == 0)
+    {
+      options->wal_sync = WAL_SYNC_ALWAYS;
+    }
+    else if (strcmp(argv[i], "--wal-sync=never") == 0)
+    {
+      options->wal_sync = WAL_SYNC_NEVER;
+    }
+    else if (strncmp(argv[i], "--wal-sync=", 11) == 0)
+    {
+      if (parseUnsigned(argv[i] + 11, 1, INT_MAX, &options->wal_sync_interval_ms))
+      {
+        fprintf(stderr, "Invalid log sync policy %s\n", argv[i] + 11);
+        return 1;
+      }
+      options->wal_sync = WAL_SYNC_INTERVAL;
+    }
+    else
+    {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  return 0;
 }
 
 int main(int argc, char *argv[])
 {
 
-  if (argc != 4)
+  if (argc < 4)
   {
-    fprintf(stderr, "Usage: %s [job_directory] [concurrent_backups] [concurrent_backups]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [job_directory] [concurrent_backups] [concurrent_threads] [options]\n"
+                    "Options:\n"
+                    "  --delta-backups     Write only the changes since the previous backup\n"
+                    "  --binary-snapshots  Also write full backups as binary .snap files\n"
+                    "  --restore=PATH      Load a .snap file (or the latest one in a directory)\n"
+                    "  --wal=PATH          Log every write and delete, replaying the log at startup\n"
+                    "  --wal-sync=POLICY   Sync the log on every commit (always, the default),\n"
+                    "                      every POLICY milliseconds, or never\n"
+                    "  --memory=BYTES      Evict pairs not used recently to keep them within BYTES\n"
+                    "                      (K, M or G suffixes allowed; no --delta-backups)\n"
+                    "  --shards=N          Split the pairs between N tables, each owned by a thread\n"
+                    "                      pinned to a core (no --restore, --wal or --delta-backups)\n"
+                    "  --pipeline          Parse each job in a separate thread, ahead of execution\n"
+                    "  --serve=SOCKET      Once the jobs are done, serve clients on a UNIX socket\n"
+                    "                      until SIGINT or SIGTERM (see kvs-client)\n"
+                    "  --no-uring          Write output and backups synchronously, without io_uring\n"
+                    "  --stats             Write latency, wait and output statistics to stderr at exit\n"
+                    "  --trace=PATH        Write a timeline of locks, commands and backups to PATH\n"
+                    "                      at exit (needs a build with make TRACE=1)\n",
+            argv[0]);
     return 1;
   }
 
-  if (kvs_init())
+  KvsOptions options = {0};
+  if (parseOptions(argc - 4, argv + 4, &options))
   {
-    printf("Failed to initialize KVS\n");
     return 1;
   }
 
@@ -274,29 +1028,54 @@ int main(int argc, char *argv[])
   MAX_CONCURRENT_THREADS = atoi(argv[3]);
   printf("Max Concurrent threads: %d\n\n", MAX_CONCURRENT_THREADS);
 
-  pthread_t threads[MAX_CONCURRENT_THREADS];
+  if (MAX_CONCURRENT_BACKUPS <= 0 || MAX_CONCURRENT_THREADS <= 0)
+  {
+    fprintf(stderr, "The number of backups and threads must be positive\n");
+    return 1;
+  }
 
-  dirp = opendir(argv[1]);
-  if (dirp == NULL)
+  options.max_backups = (unsigned int)MAX_CONCURRENT_BACKUPS;
+  if (kvs_init(&options))
   {
-    perror("Error opening job directory");
+    printf("Failed to initialize KVS\n");
     return 1;
   }
 
-  for (int i = 0; i < MAX_CONCURRENT_THREADS; i++)
+  if (scheduler_init((unsigned int)MAX_CONCURRENT_THREADS) || scheduleJobs())
   {
-    if (pthread_create(&threads[i], NULL, read_line_thread, NULL) != 0)
+    kvs_terminate();
+    return 1;
+  }
+
+  scheduler_run();
+
+  if (SERVER_PATH != NULL)
+  {
+    printf("Serving on %s\n", SERVER_PATH);
+    fflush(stdout);
+    if (server_run(SERVER_PATH, folderName, (unsigned int)MAX_CONCURRENT_THREADS, serveCommand))
     {
-      perror("Failed to create thread");
-      break;
+      kvs_terminate();
+      return 1;
     }
   }
 
-  for (int i = 0; i < MAX_CONCURRENT_THREADS; i++)
+  // Waits for the backups still being written
+  kvs_wait_backup();
+
+  OutputBuffer *out = PRINT_STATS ? malloc(sizeof(OutputBuffer)) : NULL;
+  if (out != NULL)
   {
-    pthread_join(threads[i], NULL);
+    output_init(out, STDERR_FILENO, OUTPUT_REPORT);
+    kvs_stats(out);
+    output_flush(out);
+    free(out);
   }
 
-  closedir(dirp);
+  kvs_terminate();
+  if (TRACE_PATH != NULL && trace_dump(TRACE_PATH))
+  {
+    return 1;
+  }
   return 0;
 }
@@ -0,0 +1,56 @@
+#include "mpsc.h"
+
+#include <stddef.h>
+
+void mpsc_init(MpscQueue *queue)
+{
+  atomic_init(&queue->stub.next, NULL);
+  atomic_init(&queue->tail, &queue->stub);
+  queue->head = &queue->stub;
+}
+
+void mpsc_push(MpscQueue *queue, MpscNode *node)
+{
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  // The node is the new tail from here on, but only reachable from the
+  // head once linked to the previous one
+  MpscNode *prev = atomic_exchange_explicit(&queue->tail, node, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+MpscNode *mpsc_pop(MpscQueue *queue)
+{
+  MpscNode *head = queue->head;
+  MpscNode *next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+  if (head == &queue->stub)
+  {
+    if (next == NULL)
+      return NULL;
+    // Skip the stub
+    queue->head = next;
+    head = next;
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+  }
+
+  if (next != NULL)
+  {
+    queue->head = next;
+    return head;
+  }
+
+  // head is the last node linked: unless a push is in progress, put the
+  // stub back behind it, so that head can be taken without emptying the
+  // queue of nodes
+  if (head != atomic_load_explicit(&queue->tail, memory_order_acquire))
+    return NULL;
+  mpsc_push(queue, &queue->stub);
+
+  next = atomic_load_explicit(&head->next, memory_order_acquire);
+  if (next != NULL)
+  {
+    queue->head = next;
+    return head;
+  }
+  return NULL;
+}
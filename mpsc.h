@@ -0,0 +1,40 @@
+#ifndef KVS_MPSC_H
+#define KVS_MPSC_H
+
+#include <stdatomic.h>
+
+// Lock-free intrusive queue between any number of producer threads and a
+// single consumer thread. Producers link nodes they own at the tail with
+// a single exchange; the consumer unlinks them at the head. Nodes must
+// stay valid until the consumer is done with them.
+typedef struct MpscNode
+{
+  _Atomic(struct MpscNode *) next;
+} MpscNode;
+
+typedef struct MpscQueue
+{
+  // Last node pushed, changed by the producers.
+  _Alignas(64) _Atomic(MpscNode *) tail;
+  // Next node to pop, changed by the consumer only.
+  _Alignas(64) MpscNode *head;
+  // Placeholder that keeps the queue from ever being empty of nodes.
+  MpscNode stub;
+} MpscQueue;
+
+/// Initializes an empty queue.
+/// @param queue Queue to initialize.
+void mpsc_init(MpscQueue *queue);
+
+/// Adds a node at the tail of the queue. Any thread.
+/// @param queue Queue to add to.
+/// @param node Node to be added.
+void mpsc_push(MpscQueue *queue, MpscNode *node);
+
+/// Takes the node at the head of the queue. Consumer only.
+/// @param queue Queue to take from.
+/// @return Node taken, NULL if the queue is empty, or if the next node is
+/// still being pushed (it is then taken by a later call).
+MpscNode *mpsc_pop(MpscQueue *queue);
+
+#endif // KVS_MPSC_H
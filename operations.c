@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,118 +12,495 @@
 
 #include "kvs.h"
 #include "constants.h"
+#include "output.h"
+#include "operations.h"
+#include "backup.h"
+#include "epoch.h"
+#include "expiry.h"
+#include "shard.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
 
 static struct HashTable *kvs_table = NULL;
-
-pthread_rwlock_t kvs_lock = PTHREAD_RWLOCK_INITIALIZER;
+// Whether the pairs are split between shards (see shard.h) instead of
+// held in kvs_table.
+static int sharded = 0;
+static int delta_backups = 0;
+static int binary_snapshots = 0;
+
+// Gets the set of stripes guarding a batch of keys.
+static StripeMask stripes_of(size_t num_pairs, char keys[][MAX_STRING_SIZE])
+{
+  StripeMask stripes = 0;
+  for (size_t i = 0; i < num_pairs; i++)
+  {
+    stripes |= (StripeMask)1 << key_stripe(keys[i]);
+  }
+  return stripes;
+}
 
 static struct timespec delay_to_timespec(unsigned int delay_ms)
 {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
-int kvs_init()
+// Finds the snapshot to restore: path itself if it is a file, or the most
+// recently modified .snap file if it is a directory.
+// @return Newly allocated path, NULL if there is no snapshot.
+static char *latest_snapshot(const char *path)
 {
-  if (kvs_table != NULL)
+  struct stat st;
+  if (stat(path, &st) != 0)
   {
-    fprintf(stderr, "KVS state has already been initialized\n");
+    return NULL;
+  }
+  if (!S_ISDIR(st.st_mode))
+  {
+    return strdup(path);
+  }
+
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+  {
+    return NULL;
+  }
+
+  char *latest = NULL;
+  struct timespec latestTime = {0, 0};
+  struct dirent *dp;
+  while ((dp = readdir(dir)) != NULL)
+  {
+    size_t len = strlen(dp->d_name);
+    if (len < 5 || strcmp(dp->d_name + len - 5, ".snap") != 0)
+      continue;
+
+    size_t pathLen = strlen(path) + len + 2;
+    char *candidate = malloc(pathLen);
+    if (candidate == NULL)
+      break;
+    snprintf(candidate, pathLen, "%s/%s", path, dp->d_name);
+
+    if (stat(candidate, &st) == 0 &&
+        (latest == NULL || st.st_mtim.tv_sec > latestTime.tv_sec ||
+         (st.st_mtim.tv_sec == latestTime.tv_sec && st.st_mtim.tv_nsec > latestTime.tv_nsec)))
+    {
+      free(latest);
+      latest = candidate;
+      latestTime = st.st_mtim;
+    }
+    else
+    {
+      free(candidate);
+    }
+  }
+
+  closedir(dir);
+  return latest;
+}
+
+// Whether the KVS state has been initialized, in either mode.
+static int initialized()
+{
+  return kvs_table != NULL || sharded;
+}
+
+// Removes a pair if it has expired, holding only what guards its key.
+static void expire_key(const char *key)
+{
+  if (sharded)
+  {
+    shard_expire(key);
+    return;
+  }
+
+  StripeMask stripe = (StripeMask)1 << key_stripe(key);
+  lock_stripes(kvs_table, stripe, 1);
+  expire_pair(kvs_table, key);
+  unlock_stripes(kvs_table, stripe);
+}
+
+// Schedules the removal of the pairs of a restored snapshot that expire.
+// @return 0 if every removal was scheduled, 1 otherwise.
+static int schedule_restored()
+{
+  // Nothing else uses the table yet
+  Snapshot *snapshot = snapshot_table(kvs_table);
+  if (snapshot == NULL)
     return 1;
+
+  int failed = 0;
+  for (size_t i = 0; i < snapshot->count && !failed; i++)
+  {
+    if (snapshot->pairs[i].expires != 0)
+      failed = expiry_schedule(snapshot->pairs[i].key, snapshot->pairs[i].expires);
   }
+  free(snapshot);
+  return failed;
+}
+
+// Initializes the KVS state split between shards.
+static int init_shards(const KvsOptions *options)
+{
+  // Every one of these works on a single table
+  if (options->restore_path != NULL || options->wal_path != NULL || options->delta_backups)
+  {
+    fprintf(stderr, "Shards support neither restoring, logging nor delta backups\n");
+    return 1;
+  }
+
+  if (shard_start(options->shards, options->memory_budget))
+  {
+    fprintf(stderr, "Failed to start the shards\n");
+    return 1;
+  }
+  sharded = 1;
 
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  binary_snapshots = options->binary_snapshots;
+  if (expiry_start(expire_key) || backup_pool_start(options->max_backups))
+  {
+    expiry_stop();
+    shard_stop();
+    sharded = 0;
+    return 1;
+  }
+
+  return 0;
 }
 
-int kvs_terminate()
+int kvs_init(const KvsOptions *options)
 {
+  if (initialized())
+  {
+    fprintf(stderr, "KVS state has already been initialized\n");
+    return 1;
+  }
+
+  // Evictions would be recorded in the deltas as deletes
+  if (options->memory_budget != 0 && options->delta_backups)
+  {
+    fprintf(stderr, "A memory budget cannot be combined with delta backups\n");
+    return 1;
+  }
+
+  if (options->shards > 0)
+  {
+    return init_shards(options);
+  }
+
+  // Kept until the log is opened, which must follow the snapshot
+  char *snapshotPath = NULL;
+  if (options->restore_path != NULL)
+  {
+    snapshotPath = latest_snapshot(options->restore_path);
+    if (snapshotPath == NULL)
+    {
+      fprintf(stderr, "No snapshot found in %s\n", options->restore_path);
+      return 1;
+    }
+
+    printf("Restoring snapshot %s\n", snapshotPath);
+    kvs_table = load_binary_snapshot(snapshotPath);
+  }
+  else
+  {
+    kvs_table = create_hash_table(0);
+  }
+
   if (kvs_table == NULL)
   {
-    fprintf(stderr, "KVS state must be initialized\n");
+    free(snapshotPath);
+    return 1;
+  }
+
+  // Set before the log is replayed, so that replaying stays within it
+  set_memory_budget(kvs_table, options->memory_budget);
+
+  // Started first too, as replayed writes may expire
+  if (expiry_start(expire_key) || (options->restore_path != NULL && schedule_restored()))
+  {
+    expiry_stop();
+    free_table(kvs_table);
+    kvs_table = NULL;
+    free(snapshotPath);
+    return 1;
+  }
+
+  // The log holds every change since the latest snapshot taken with it
+  // (see wal_checkpoint), or since it was created
+  int failed = options->wal_path != NULL && wal_open(options->wal_path, options->wal_sync,
+                                                     options->wal_sync_interval_ms, kvs_table, snapshotPath);
+  free(snapshotPath);
+  if (failed)
+  {
+    expiry_stop();
+    free_table(kvs_table);
+    kvs_table = NULL;
+    return 1;
+  }
+
+  delta_backups = options->delta_backups;
+  binary_snapshots = options->binary_snapshots;
+  if (delta_backups)
+  {
+    track_changes(kvs_table);
+  }
+
+  if (backup_pool_start(options->max_backups))
+  {
+    wal_close();
+    expiry_stop();
+    free_table(kvs_table);
+    kvs_table = NULL;
     return 1;
   }
 
-  free_table(kvs_table);
   return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE])
+int kvs_terminate()
 {
-  if (kvs_table == NULL)
+  if (!initialized())
   {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_lock);
-  printf("Locked with write in kvs_write\n");
+  // Backups still hold snapshots, not the table, but must be written out
+  backup_pool_stop();
+  wal_close();
+  expiry_stop();
+
+  if (sharded)
+  {
+    shard_stop();
+    sharded = 0;
+    return 0;
+  }
 
+  free_table(kvs_table);
+  kvs_table = NULL;
+  return 0;
+}
+
+// Schedules the removal of a batch of pairs with a time to live.
+static void schedule_expiry(size_t num_pairs, char keys[][MAX_STRING_SIZE], uint64_t expires)
+{
   for (size_t i = 0; i < num_pairs; i++)
   {
+    if (expiry_schedule(keys[i], expires))
+    {
+      fprintf(stderr, "Failed to schedule the expiry of %s\n", keys[i]);
+    }
+  }
+}
 
-    if (write_pair(kvs_table, keys[i], values[i]) != 0)
+// Writes a batch of pairs to the shards owning their keys.
+static int write_shards(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+                        uint64_t expires)
+{
+  int status[MAX_WRITE_SIZE];
+  TRACE_BEGIN("shards", "write");
+  shard_write(num_pairs, keys, values, expires, status);
+  TRACE_END("shards");
+
+  for (size_t i = 0; i < num_pairs; i++)
+  {
+    if (status[i] != 0)
     {
       fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
     }
   }
 
-  printf("Unlocked in kvs_write\n");
-  pthread_rwlock_unlock(&kvs_lock);
-
+  if (expires > 0)
+  {
+    schedule_expiry(num_pairs, keys, expires);
+  }
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fdOut)
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], unsigned int ttl_ms)
 {
-  if (kvs_table == NULL)
+  if (!initialized())
   {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  write(fdOut, "[", 1);
+  // The table runs on the monotonic clock, the log on the wall clock,
+  // which is what survives a restart
+  uint64_t expires = 0;
+  uint64_t expires_at = 0;
+  if (ttl_ms > 0)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    expires = stats_now() + (uint64_t)ttl_ms * 1000000;
+    expires_at = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000 + ttl_ms;
+  }
+
+  if (sharded)
+  {
+    return write_shards(num_pairs, keys, values, expires);
+  }
 
-  pthread_rwlock_rdlock(&kvs_lock);
-  printf("Locked with read in kvs_read\n");
+  StripeMask stripes = stripes_of(num_pairs, keys);
+  TRACE_BEGIN("acquire stripes", "write");
+  lock_stripes(kvs_table, stripes, 1);
+  TRACE_END("acquire stripes");
+  TRACE_BEGIN("hold stripes", "write");
+
+  // Logged while the stripes are held, so that the log orders batches on
+  // the same keys as the table does
+  uint64_t position = wal_append(ttl_ms > 0 ? WAL_WRITE_EXPIRING : WAL_WRITE, num_pairs, keys, values, expires_at);
 
   for (size_t i = 0; i < num_pairs; i++)
   {
-    char *result = read_pair(kvs_table, keys[i]);
-    if (result == NULL)
+
+    if (write_pair(kvs_table, keys[i], values[i], expires) != 0)
     {
-      write(fdOut, "(", 1);
-      write(fdOut, keys[i], strlen(keys[i]));
-      write(fdOut, ",KVSERROR)", 10);
+      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
     }
-    else
+  }
+
+  unlock_stripes(kvs_table, stripes);
+  TRACE_END("hold stripes");
+
+  // Scheduled once the pairs are in, so that the removal finds them
+  if (ttl_ms > 0)
+  {
+    schedule_expiry(num_pairs, keys, expires);
+  }
+
+  // Waiting without the stripes lets other jobs join the same group commit
+  TRACE_BEGIN("wal commit", NULL);
+  int failed = wal_commit(position);
+  TRACE_END("wal commit");
+  if (failed)
+  {
+    fprintf(stderr, "Failed to log write\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// Writes the result of reading a key.
+// @param value Value read, NULL if the key was not found.
+static void write_read_result(const char *key, const char *value, OutputBuffer *out)
+{
+  output_append(out, "(", 1);
+  output_puts(out, key);
+  if (value == NULL)
+  {
+    output_append(out, ",KVSERROR)", 10);
+  }
+  else
+  {
+    output_append(out, ",", 1);
+    output_puts(out, value);
+    output_append(out, ")", 1);
+  }
+}
+
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out)
+{
+  if (!initialized())
+  {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  int status[MAX_WRITE_SIZE];
+  if (sharded)
+  {
+    TRACE_BEGIN("shards", "read");
+    shard_read(num_pairs, keys, values, status);
+    TRACE_END("shards");
+  }
+  else
+  {
+    // Reads take no locks: inside the section, nodes unlinked by concurrent
+    // writes are not freed. Each key is read atomically, the batch is not.
+    epoch_enter();
+
+    for (size_t i = 0; i < num_pairs; i++)
     {
-      write(fdOut, "(", 1);
-      write(fdOut, keys[i], strlen(keys[i]));
-      write(fdOut, ",", 1);
-      write(fdOut, result, strlen(result));
-      write(fdOut, ")", 1);
+      // Copied, as writing the output may block, and resizing the table
+      // waits for the section to end
+      const char *value = read_pair(kvs_table, keys[i]);
+      if (value != NULL)
+        strcpy(values[i], value);
+      status[i] = value == NULL;
     }
-    free(result);
+
+    epoch_exit();
+  }
+
+  // In the order of the batch, whichever shard answered first
+  output_append(out, "[", 1);
+  for (size_t i = 0; i < num_pairs; i++)
+  {
+    write_read_result(keys[i], status[i] == 0 ? values[i] : NULL, out);
   }
+  output_append(out, "]\n", 2);
+
+  return 0;
+}
+
+// Deletes a batch of keys from the shards owning them.
+static int delete_shards(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out)
+{
+  int status[MAX_WRITE_SIZE];
+  TRACE_BEGIN("shards", "delete");
+  shard_delete(num_pairs, keys, status);
+  TRACE_END("shards");
 
-  printf("Unlocked\n");
-  pthread_rwlock_unlock(&kvs_lock);
+  int aux = 0;
+  for (size_t i = 0; i < num_pairs; i++)
+  {
+    if (status[i] != 0)
+    {
+      if (!aux)
+      {
+        output_append(out, "[", 1);
+        aux = 1;
+      }
 
-  write(fdOut, "]\n", 2);
+      output_append(out, "(", 1);
+      output_puts(out, keys[i]);
+      output_append(out, ",KVSMISSING)", 12);
+    }
+  }
+  if (aux)
+  {
+    output_append(out, "]\n", 2);
+  }
 
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fdOut)
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out)
 {
-  if (kvs_table == NULL)
+  if (!initialized())
   {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  if (sharded)
+  {
+    return delete_shards(num_pairs, keys, out);
+  }
   int aux = 0;
 
-  pthread_rwlock_wrlock(&kvs_lock);
-  printf("Locked with write in kvs_delete\n");
+  StripeMask stripes = stripes_of(num_pairs, keys);
+  TRACE_BEGIN("acquire stripes", "delete");
+  lock_stripes(kvs_table, stripes, 1);
+  TRACE_END("acquire stripes");
+  TRACE_BEGIN("hold stripes", "delete");
+
+  uint64_t position = wal_append(WAL_DELETE, num_pairs, keys, NULL, 0);
 
   for (size_t i = 0; i < num_pairs; i++)
   {
@@ -131,108 +509,434 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fdOut)
       if (!aux)
       {
 
-        write(fdOut, "[", 1);
+        output_append(out, "[", 1);
         aux = 1;
       }
 
-      write(fdOut, "(", 1);
-      write(fdOut, keys[i], strlen(keys[i]));
-      write(fdOut, ",KVSMISSING)", 12);
+      output_append(out, "(", 1);
+      output_puts(out, keys[i]);
+      output_append(out, ",KVSMISSING)", 12);
     }
   }
 
-  printf("Unlocked\n");
-  pthread_rwlock_unlock(&kvs_lock);
+  unlock_stripes(kvs_table, stripes);
+  TRACE_END("hold stripes");
   if (aux)
   {
 
-    write(fdOut, "]\n", 2);
+    output_append(out, "]\n", 2);
+  }
+
+  TRACE_BEGIN("wal commit", NULL);
+  int failed = wal_commit(position);
+  TRACE_END("wal commit");
+  if (failed)
+  {
+    fprintf(stderr, "Failed to log delete\n");
+    return 1;
   }
 
   return 0;
 }
 
-void kvs_show(int fdOut)
+// Captures a point-in-time view of the whole table. The stripes are held
+// only while the pairs are copied, not while they are written.
+static Snapshot *capture_table()
 {
+  if (sharded)
+  {
+    return shard_snapshot(NULL, NULL);
+  }
+
+  // Holding every stripe gives a consistent view of the whole table
+  TRACE_BEGIN("acquire stripes", "show");
+  lock_stripes(kvs_table, ALL_STRIPES, 0);
+  TRACE_END("acquire stripes");
+  TRACE_BEGIN("hold stripes", "show");
+
+  Snapshot *snapshot = snapshot_table(kvs_table);
+
+  unlock_stripes(kvs_table, ALL_STRIPES);
+  TRACE_END("hold stripes");
+
+  return snapshot;
+}
 
-  pthread_rwlock_rdlock(&kvs_lock);
-  printf("Locked with read in kvs_show\n");
-  for (int i = 0; i < TABLE_SIZE; i++)
+// Writes a pair as "(key, value)". In backups, pairs that expire are
+// followed by " EXPIRES <ms>", the wall-clock milliseconds since the epoch
+// they expire at.
+// @param deadline Whether to write when the pair expires.
+static void write_pair_line(KeyValue *pair, int deadline, OutputBuffer *out)
+{
+  output_append(out, "(", 1);
+  output_puts(out, pair->key);
+  output_append(out, ", ", 2);
+  output_puts(out, pair->value);
+  output_append(out, ")", 1);
+  if (deadline && pair->expires != 0)
   {
-    KeyNode *keyNode = kvs_table->table[i];
-    while (keyNode != NULL)
-    {
+    char suffix[32];
+    int len = snprintf(suffix, sizeof(suffix), " EXPIRES %" PRIu64, stats_wall_ms(pair->expires));
+    output_append(out, suffix, (size_t)len);
+  }
+  output_append(out, "\n", 1);
+}
 
-      write(fdOut, "(", 1);
-      write(fdOut, keyNode->key, strlen(keyNode->key));
-      write(fdOut, ", ", 2);
-      write(fdOut, keyNode->value, strlen(keyNode->value));
-      write(fdOut, ")\n", 2);
-      keyNode = keyNode->next;
-    }
+static void write_snapshot(Snapshot *snapshot, int deadlines, OutputBuffer *out)
+{
+  for (size_t i = 0; i < snapshot->count; i++)
+  {
+    write_pair_line(&snapshot->pairs[i], deadlines, out);
+  }
+}
+
+void kvs_stats(OutputBuffer *out)
+{
+  stats_report(out);
+  if (!initialized())
+    return;
+
+  MemoryUsage usage;
+  if (sharded)
+    shard_memory_usage(&usage);
+  else
+    memory_usage(kvs_table, &usage);
+  char line[256];
+  int len = snprintf(line, sizeof(line),
+                     "(memory, used=%zu, budget=%zu, nodes=%zu, index=%zu, keys=%zu, values=%zu, evictions=%zu)\n",
+                     usage.node_bytes + usage.index_bytes, usage.budget, usage.node_bytes, usage.index_bytes,
+                     usage.key_bytes, usage.value_bytes, usage.evictions);
+  output_append(out, line, (size_t)len);
+}
 
-    printf("Unlocked\n");
+void kvs_show(OutputBuffer *out)
+{
+  // Entries are copied in key order from the ordered index
+  Snapshot *snapshot = capture_table();
+  if (snapshot == NULL)
+  {
+    fprintf(stderr, "Failed to capture the KVS state\n");
+    return;
   }
-  pthread_rwlock_unlock(&kvs_lock);
+
+  write_snapshot(snapshot, 0, out);
+  free(snapshot);
 }
 
-void generateBackup(char *bckFilename)
+int kvs_scan(size_t num_keys, char keys[][MAX_STRING_SIZE], OutputBuffer *out)
 {
-  int fdOutput = open(bckFilename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (!initialized())
+  {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  const char *last = keys[1];
+  char prefixEnd[MAX_STRING_SIZE];
+  if (num_keys == 1)
+  {
+    // Every key starting with the prefix sorts between the prefix and the
+    // prefix padded with the highest character, and no other key does
+    size_t len = strlen(keys[0]);
+    memcpy(prefixEnd, keys[0], len);
+    memset(prefixEnd + len, 0xFF, MAX_STRING_SIZE - 1 - len);
+    prefixEnd[MAX_STRING_SIZE - 1] = '\0';
+    last = prefixEnd;
+  }
+
+  Snapshot *snapshot;
+  if (sharded)
+  {
+    snapshot = shard_snapshot(keys[0], last);
+  }
+  else
+  {
+    TRACE_BEGIN("acquire stripes", "scan");
+    lock_stripes(kvs_table, ALL_STRIPES, 0);
+    TRACE_END("acquire stripes");
+    TRACE_BEGIN("hold stripes", "scan");
+
+    snapshot = snapshot_range(kvs_table, keys[0], last);
+
+    unlock_stripes(kvs_table, ALL_STRIPES);
+    TRACE_END("hold stripes");
+  }
+
+  if (snapshot == NULL)
+  {
+    return 1;
+  }
+
+  output_append(out, "[", 1);
+  for (size_t i = 0; i < snapshot->count; i++)
+  {
+    output_append(out, "(", 1);
+    output_puts(out, snapshot->pairs[i].key);
+    output_append(out, ",", 1);
+    output_puts(out, snapshot->pairs[i].value);
+    output_append(out, ")", 1);
+  }
+  output_append(out, "]\n", 2);
+
+  free(snapshot);
+  return 0;
+}
+
+typedef struct BackupFile
+{
+  Snapshot *snapshot;
+  // Keys deleted since the previous backup, NULL for a full backup.
+  Snapshot *deleted;
+  // Wall-clock time the snapshot was captured at, and where it stands in
+  // the log (0 without a log).
+  struct timespec captured;
+  uint64_t wal_position;
+  char filename[];
+} BackupFile;
+
+// Writes the changes since the previous backup: deleted keys as "-(key)"
+// lines, then written pairs as "+(key, value)" lines.
+static void write_delta(BackupFile *backup, OutputBuffer *out)
+{
+  for (size_t i = 0; i < backup->deleted->count; i++)
+  {
+    output_append(out, "-(", 2);
+    output_puts(out, backup->deleted->pairs[i].key);
+    output_append(out, ")\n", 2);
+  }
+
+  for (size_t i = 0; i < backup->snapshot->count; i++)
+  {
+    output_append(out, "+", 1);
+    write_pair_line(&backup->snapshot->pairs[i], 1, out);
+  }
+}
+
+// Writes a full backup in the binary format too, as <job>-<n>.snap, so
+// that it can be restored at startup.
+static void generateBinarySnapshot(BackupFile *backup, OutputBuffer *out)
+{
+  char snapFilename[strlen(backup->filename) + 2];
+  strcpy(snapFilename, backup->filename);
+  strcpy(snapFilename + strlen(snapFilename) - 4, ".snap"); // Replace ".bck"
+
+  // Written aside and renamed over the snapshot once durable: restoring
+  // picks the newest snapshot, which must never be a partial one
+  char tmpFilename[sizeof(snapFilename) + 4];
+  snprintf(tmpFilename, sizeof(tmpFilename), "%s.tmp", snapFilename);
+
+  int fdOutput = open(tmpFilename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
   if (fdOutput < 0)
   {
-    perror("Failed to create backup file");
+    perror("Failed to create snapshot file");
     return;
   }
 
-  kvs_show(fdOutput);
+  // Dated when captured, not when written: snapshots written out of order
+  // must still be restored in the order of the log
+  struct timespec times[2] = {backup->captured, backup->captured};
+  output_init(out, fdOutput, OUTPUT_BACKUP);
+  int failed = write_binary_snapshot(backup->snapshot, out) || output_flush(out) || futimens(fdOutput, times) != 0 ||
+               fsync(fdOutput) != 0;
   close(fdOutput);
+  if (failed || rename(tmpFilename, snapFilename) != 0)
+  {
+    perror("Failed to write snapshot file");
+    unlink(tmpFilename);
+    return;
+  }
+  if (output_sync_directory(snapFilename))
+  {
+    perror("Failed to sync snapshot directory");
+    return;
+  }
+
+  // The snapshot holds every change logged before it was captured
+  wal_checkpoint(backup->wal_position, snapFilename, backup->captured);
 }
-int kvs_backup(char *input_filename)
+
+// Writes a captured snapshot to its backup file. Runs in a backup thread.
+static void generateBackup(void *arg)
 {
+  BackupFile *backup = arg;
+  TRACE_BEGIN("write backup", backup->filename);
 
-  pthread_rwlock_wrlock(&kvs_lock);
-  printf("Locked with read in kvs_backup\n");
+  int fdOutput = open(backup->filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fdOutput < 0)
+  {
+    perror("Failed to create backup file");
+  }
+  else
+  {
+    OutputBuffer *out = malloc(sizeof(OutputBuffer));
+    if (out != NULL)
+    {
+      output_init(out, fdOutput, OUTPUT_BACKUP);
+      if (backup->deleted == NULL)
+        write_snapshot(backup->snapshot, 1, out);
+      else
+        write_delta(backup, out);
+      output_flush(out);
+
+      if (binary_snapshots && backup->deleted == NULL)
+        generateBinarySnapshot(backup, out);
+      free(out);
+    }
+    close(fdOutput);
+  }
 
-  size_t len = strlen(input_filename);
-  char bckFilename[len + MAX_STRING_SIZE];
+  TRACE_END("write backup");
+  free(backup->snapshot);
+  free(backup->deleted);
+  free(backup);
+}
 
-  // * Generate backup filename
-  int counter = 1;
-  char temp_bckFilename[len + MAX_STRING_SIZE];
-  strcpy(temp_bckFilename, input_filename);
-  temp_bckFilename[strlen(temp_bckFilename) - 4] = '\0'; // Remove file extension
+// Backup states of the jobs taking delta backups. Deleted keys must be
+// remembered until every one of them has backed up past the deletion.
+static BackupState *delta_jobs = NULL;
+static pthread_mutex_t delta_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-  // Read all files in the directory
-  // struct dirent *entry;
+// Lets the table discard the tombstones no job needs anymore.
+// delta_jobs_mutex must be held.
+static void update_tombstone_floor()
+{
+  // With no job waiting for deltas, nothing recorded so far is needed
+  uint64_t floor = table_version(kvs_table);
+  for (BackupState *state = delta_jobs; state != NULL; state = state->next)
+  {
+    if (state->version < floor)
+      floor = state->version;
+  }
+  set_tombstone_floor(kvs_table, floor);
+}
+
+void kvs_backup_begin(BackupState *state)
+{
+  state->count = 0;
+  state->version = 0;
+  state->next = NULL;
+}
+
+void kvs_backup_end(BackupState *state)
+{
+  if (!delta_backups || state->count == 0)
+    return;
 
-  // quantity of files in the directory
-  while (1)
+  pthread_mutex_lock(&delta_jobs_mutex);
+  for (BackupState **link = &delta_jobs; *link != NULL; link = &(*link)->next)
   {
-    sprintf(bckFilename, "%s-%d.bck", temp_bckFilename, counter);
-    if (access(bckFilename, F_OK) == 0)
-    {
-      counter++;
-    }
-    else
+    if (*link == state)
     {
+      *link = state->next;
       break;
     }
   }
+  update_tombstone_floor();
+  pthread_mutex_unlock(&delta_jobs_mutex);
+}
+
+int kvs_backup(const char *inputFilename, BackupState *state)
+{
+  if (!initialized())
+  {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
 
-  // Generate backup filename
-  sprintf(bckFilename, "%s-%d.bck", temp_bckFilename, counter);
-  printf("Backup filename: %s\n", bckFilename);
+  // Every DELTA_CHAIN_LENGTH backups a full one is taken again, so a
+  // restore never needs more than that many files
+  unsigned int number = ++state->count;
+  int full = !delta_backups || (number - 1) % DELTA_CHAIN_LENGTH == 0;
 
-  // * Generate backup file
-  generateBackup(bckFilename);
+  // * Generate backup filename: <job name>-<backup number>.bck, or .delta
+  size_t len = strlen(inputFilename);
+  BackupFile *backup = malloc(sizeof(BackupFile) + len + MAX_STRING_SIZE);
+  if (backup == NULL)
+  {
+    return 1;
+  }
+  strcpy(backup->filename, inputFilename);
+  backup->filename[len - 4] = '\0'; // Remove file extension
+  sprintf(backup->filename + len - 4, "-%u.%s", number, full ? "bck" : "delta");
 
-  printf("Unlocked in Backup\n");
-  pthread_rwlock_unlock(&kvs_lock);
+  if (delta_backups && number == 1)
+  {
+    // Registered before the capture, so that no tombstone this job needs
+    // is discarded meanwhile
+    pthread_mutex_lock(&delta_jobs_mutex);
+    state->next = delta_jobs;
+    delta_jobs = state;
+    update_tombstone_floor();
+    pthread_mutex_unlock(&delta_jobs_mutex);
+  }
+
+  // The state is captured now, in the order of the job's commands, and
+  // written out by a backup thread
+  uint64_t version = 0;
+  backup->deleted = NULL;
+  clock_gettime(CLOCK_REALTIME, &backup->captured);
+  backup->wal_position = 0;
+  if (sharded)
+  {
+    // Shards only take full backups
+    backup->snapshot = shard_snapshot(NULL, NULL);
+  }
+  else
+  {
+    TRACE_BEGIN("acquire stripes", "backup");
+    lock_stripes(kvs_table, ALL_STRIPES, 0);
+    TRACE_END("acquire stripes");
+    TRACE_BEGIN("hold stripes", "backup");
+
+    version = table_version(kvs_table);
+    clock_gettime(CLOCK_REALTIME, &backup->captured);
+    backup->wal_position = wal_position();
+    if (full)
+      backup->snapshot = snapshot_table(kvs_table);
+    else
+      backup->snapshot = snapshot_changes(kvs_table, state->version, &backup->deleted);
+
+    unlock_stripes(kvs_table, ALL_STRIPES);
+    TRACE_END("hold stripes");
+  }
+
+  if (backup->snapshot == NULL)
+  {
+    free(backup);
+    return 1;
+  }
+  // Full snapshots are taken in key order, changes are not
+  if (backup->deleted != NULL)
+  {
+    sort_snapshot(backup->snapshot);
+    sort_snapshot(backup->deleted);
+  }
+
+  if (delta_backups)
+  {
+    pthread_mutex_lock(&delta_jobs_mutex);
+    state->version = version;
+    update_tombstone_floor();
+    pthread_mutex_unlock(&delta_jobs_mutex);
+  }
+
+  TRACE_INSTANT("queue backup", backup->filename);
+  if (backup_pool_submit(generateBackup, backup))
+  {
+    free(backup->snapshot);
+    free(backup->deleted);
+    free(backup);
+    return 1;
+  }
 
   return 0;
 }
 
+void kvs_wait_backup()
+{
+  backup_pool_wait();
+}
+
 void kvs_wait(unsigned int delay_ms)
 {
   struct timespec delay = delay_to_timespec(delay_ms);
@@ -2,47 +2,117 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "output.h"
+#include "wal.h"
+
+typedef struct KvsOptions
+{
+  // Maximum number of backups in progress at the same time.
+  unsigned int max_backups;
+  // Whether backups after the first of a job only hold the changes since
+  // the previous one.
+  int delta_backups;
+  // Whether full backups are also written in the binary snapshot format.
+  int binary_snapshots;
+  // Snapshot file, or directory whose latest snapshot is loaded at
+  // startup. NULL to start with an empty KVS.
+  const char *restore_path;
+  // Write-ahead log replayed at startup and appended to by every WRITE and
+  // DELETE. NULL to keep no log.
+  const char *wal_path;
+  WalSyncPolicy wal_sync;
+  // Milliseconds between syncs of the log with WAL_SYNC_INTERVAL.
+  unsigned int wal_sync_interval_ms;
+  // Bytes the pairs may hold before those not used recently are evicted,
+  // 0 for no limit.
+  size_t memory_budget;
+  // Number of shards the pairs are split between, each owned by a thread
+  // of its own (see shard.h); 0 to hold them in a single shared table.
+  unsigned int shards;
+} KvsOptions;
+
+// Backups taken by a job so far.
+typedef struct BackupState
+{
+  unsigned int count;
+  // Version of the table captured by the last backup.
+  uint64_t version;
+  struct BackupState *next;
+} BackupState;
 
 /// Initializes the KVS state.
+/// @param options Settings of the KVS.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
-int kvs_init();
+int kvs_init(const KvsOptions *options);
 
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
 
 /// Writes a key value pair to the KVS. If key already exists it is updated.
+/// With a log, returns once the batch is durable as set by its sync policy.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
 /// @param values Array of values' strings.
+/// @param ttl_ms Milliseconds the pairs live for, after which they read as
+/// missing and are removed; 0 for pairs that never expire.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], unsigned int ttl_ms);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param out Output buffer to write the (successful) output.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fdOut);
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param out Output buffer to write the (successful) output.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fdOut);
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out);
+
+/// Reads the pairs whose keys are within a range, in key order.
+/// @param num_keys 1 to read the keys starting with keys[0], 2 to read the
+/// keys from keys[0] to keys[1], both included.
+/// @param keys Prefix, or first and last keys of the range.
+/// @param out Output buffer to write the pairs to.
+/// @return 0 if the pairs were read successfully, 1 otherwise.
+int kvs_scan(size_t num_keys, char keys[][MAX_STRING_SIZE], OutputBuffer *out);
 
 /// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int fdOut);
+/// @param out Output buffer to write the output.
+void kvs_show(OutputBuffer *out);
+
+/// Writes the statistics of the KVS: those recorded by every thread (see
+/// stats.h), then the memory held by the pairs and the evictions so far.
+/// @param out Output buffer to write the report to.
+void kvs_stats(OutputBuffer *out);
+
+/// Initializes the backup state of a job.
+/// @param state Backup state to initialize.
+void kvs_backup_begin(BackupState *state);
+
+/// Releases the backup state of a finished job.
+/// @param state Backup state of the job.
+void kvs_backup_end(BackupState *state);
 
-/// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
+/// Captures the KVS state and queues it to be stored in the correspondent
+/// backup file by a backup thread. Blocks while the maximum number of
+/// backups is in progress.
+/// With delta backups, only the first of every DELTA_CHAIN_LENGTH backups
+/// of a job is full (<job>-<n>.bck); the others hold the changes since the
+/// previous one (<job>-<n>.delta). With binary snapshots, full backups are
+/// also written as <job>-<n>.snap.
 /// @param inputFilename Name of the input file.
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(const char *inputFilename);
+/// @param state Backup state of the job.
+/// @return 0 if the backup was queued successfully, 1 otherwise.
+int kvs_backup(const char *inputFilename, BackupState *state);
 
-/// Waits for the last backup to be called.
+/// Waits until every backup requested so far has been written.
 void kvs_wait_backup();
 
 /// Waits for a given amount of time.
@@ -0,0 +1,242 @@
+#include "output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trace.h"
+
+void output_init(OutputBuffer *out, int fd, OutputKind kind)
+{
+  out->fd = fd;
+  out->kind = kind;
+  out->used = 0;
+  out->current = 0;
+  out->pending = 0;
+  out->nonblocking = 0;
+  out->backlog = NULL;
+  out->backlog_used = 0;
+  out->backlog_size = 0;
+}
+
+void output_init_socket(OutputBuffer *out, int fd)
+{
+  output_init(out, fd, OUTPUT_SESSION);
+  out->nonblocking = 1;
+}
+
+void output_release(OutputBuffer *out)
+{
+  free(out->backlog);
+  out->backlog = NULL;
+  out->backlog_used = 0;
+  out->backlog_size = 0;
+}
+
+int output_write_all(int fd, OutputKind kind, const char *data, size_t len)
+{
+  uint64_t start = stats_now();
+  size_t remaining = len;
+  int result = 0;
+  while (remaining > 0)
+  {
+    ssize_t written = write(fd, data, remaining);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      result = 1;
+      break;
+    }
+
+    data += written;
+    remaining -= (size_t)written;
+  }
+
+  stats_output(kind, len - remaining, stats_now() - start);
+  return result;
+}
+
+int output_sync_directory(const char *path)
+{
+  char dirname[strlen(path) + 2];
+  strcpy(dirname, path);
+  char *slash = strrchr(dirname, '/');
+  if (slash == NULL)
+    strcpy(dirname, ".");
+  else if (slash == dirname)
+    dirname[1] = '\0';
+  else
+    *slash = '\0';
+
+  int fd = open(dirname, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return 1;
+  int error = fsync(fd);
+  close(fd);
+  return error != 0;
+}
+
+// Writes bytes to a non-blocking socket, as many as it takes.
+// @return Number of bytes written, or SIZE_MAX if the socket failed.
+static size_t send_available(int fd, const char *data, size_t len)
+{
+  uint64_t start = stats_now();
+  size_t sent = 0;
+  while (sent < len)
+  {
+    ssize_t written = write(fd, data + sent, len - sent);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        sent = SIZE_MAX;
+      break;
+    }
+    sent += (size_t)written;
+  }
+
+  stats_output(OUTPUT_SESSION, sent == SIZE_MAX ? 0 : sent, stats_now() - start);
+  return sent;
+}
+
+// Sends bytes to a socket after its backlog, keeping what it does not take.
+// @return 0 if the bytes were sent or kept, 1 otherwise.
+static int output_send(OutputBuffer *out, const char *data, size_t len)
+{
+  size_t sent = 0;
+  if (out->backlog_used == 0)
+  {
+    sent = send_available(out->fd, data, len);
+    if (sent == SIZE_MAX)
+      return 1;
+    if (sent == len)
+      return 0;
+  }
+
+  size_t needed = out->backlog_used + len - sent;
+  if (needed > out->backlog_size)
+  {
+    size_t size = out->backlog_size > 0 ? out->backlog_size : OUTPUT_BUFFER_SIZE;
+    while (size < needed)
+      size *= 2;
+    char *backlog = realloc(out->backlog, size);
+    if (backlog == NULL)
+      return 1;
+    out->backlog = backlog;
+    out->backlog_size = size;
+  }
+
+  memcpy(out->backlog + out->backlog_used, data + sent, len - sent);
+  out->backlog_used = needed;
+  return 0;
+}
+
+int output_drain(OutputBuffer *out)
+{
+  size_t sent = send_available(out->fd, out->backlog, out->backlog_used);
+  if (sent == SIZE_MAX)
+    return 1;
+
+  memmove(out->backlog, out->backlog + sent, out->backlog_used - sent);
+  out->backlog_used -= sent;
+  return 0;
+}
+
+size_t output_backlog(const OutputBuffer *out)
+{
+  return out->backlog_used;
+}
+
+// Writes bytes that are not buffered, without waiting for a socket.
+// @return 0 if the bytes were written (or kept), 1 otherwise.
+static int output_write(OutputBuffer *out, const char *data, size_t len)
+{
+  if (out->nonblocking)
+    return output_send(out, data, len);
+  return output_write_all(out->fd, out->kind, data, len);
+}
+
+// Waits for the other half to be written, if it is being written.
+// @return 0 if it was written successfully, 1 otherwise.
+static int output_wait(OutputBuffer *out)
+{
+  if (out->pending == 0)
+    return 0;
+
+  TRACE_BEGIN("output wait", NULL);
+  uint64_t start = stats_now();
+  int result = uring_wait(&out->request);
+  size_t written = result > 0 ? (size_t)result : 0;
+  stats_output(out->kind, written, stats_now() - start);
+  TRACE_END("output wait");
+
+  // The write completed either way, so the half can be reused
+  size_t len = out->pending;
+  out->pending = 0;
+  if (result < 0)
+  {
+    errno = -result;
+    return 1;
+  }
+
+  // Short writes are finished synchronously
+  if (written < len)
+    return output_write_all(out->fd, out->kind, out->data[1 - out->current] + written, len - written);
+  return 0;
+}
+
+// Starts writing the half being filled, and switches to the other one once
+// it is written. Without io_uring, or to a socket, the half is written
+// synchronously.
+// @return 0 if the bytes are being written or were written successfully,
+// 1 otherwise.
+static int output_submit(OutputBuffer *out)
+{
+  int result = output_wait(out);
+  if (out->used == 0)
+    return result;
+
+  const char *data = out->data[out->current];
+  size_t len = out->used;
+  out->used = 0;
+  if (out->nonblocking || uring_write(out->fd, data, len, &out->request) != 0)
+    return output_write(out, data, len) || result;
+
+  out->pending = len;
+  out->current = 1 - out->current;
+  return result;
+}
+
+int output_flush(OutputBuffer *out)
+{
+  int result = output_submit(out);
+  return output_wait(out) || result;
+}
+
+int output_append(OutputBuffer *out, const char *data, size_t len)
+{
+  if (out->used + len > OUTPUT_BUFFER_SIZE)
+  {
+    if (output_submit(out))
+      return 1;
+
+    // Too large to be buffered at all
+    if (len > OUTPUT_BUFFER_SIZE)
+      return output_wait(out) || output_write(out, data, len);
+  }
+
+  memcpy(out->data[out->current] + out->used, data, len);
+  out->used += len;
+  return 0;
+}
+
+int output_puts(OutputBuffer *out, const char *str)
+{
+  return output_append(out, str, strlen(str));
+}
@@ -0,0 +1,111 @@
+#ifndef KVS_OUTPUT_H
+#define KVS_OUTPUT_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "uring.h"
+
+// What an output goes to; writes are accounted by it.
+typedef enum OutputKind
+{
+  // .out files of jobs
+  OUTPUT_JOB,
+  // .bck, .delta and .snap files
+  OUTPUT_BACKUP,
+  // The write-ahead log
+  OUTPUT_WAL,
+  // Sockets of the clients of a server
+  OUTPUT_SESSION,
+  // Reports written to stderr
+  OUTPUT_REPORT,
+  OUTPUT_KINDS
+} OutputKind;
+
+// Output of a job (or backup) is collected here and written to the file
+// descriptor in chunks of up to OUTPUT_BUFFER_SIZE bytes.
+//
+// The buffer has two halves: once one is full it is written through
+// io_uring while the other is filled, so the thread only blocks on a write
+// if it fills the other half before the first one is written. A buffer
+// must be used by a single thread until it is flushed.
+//
+// A buffer for a non-blocking socket never waits for it instead: bytes it
+// does not take yet are kept in a backlog, sent with output_drain.
+typedef struct OutputBuffer
+{
+  int fd;
+  OutputKind kind;
+  size_t used;
+  // Half being filled.
+  unsigned int current;
+  // Bytes of the other half being written, 0 if none.
+  size_t pending;
+  UringRequest request;
+  int nonblocking;
+  // Bytes the socket did not take yet, sent before anything else.
+  char *backlog;
+  size_t backlog_used;
+  size_t backlog_size;
+  char data[2][OUTPUT_BUFFER_SIZE];
+} OutputBuffer;
+
+/// Initializes an empty output buffer.
+/// @param out Buffer to initialize.
+/// @param fd File descriptor the buffer is flushed to.
+/// @param kind What the descriptor is.
+void output_init(OutputBuffer *out, int fd, OutputKind kind);
+
+/// Initializes an empty output buffer for a non-blocking socket.
+/// @param out Buffer to initialize.
+/// @param fd Socket the buffer is flushed to, with O_NONBLOCK set.
+void output_init_socket(OutputBuffer *out, int fd);
+
+/// Frees the backlog of a buffer; the file descriptor is left open.
+/// @param out Buffer to release.
+void output_release(OutputBuffer *out);
+
+/// Appends bytes to the buffer, flushing it first if they do not fit.
+/// @param out Buffer to append to.
+/// @param data Bytes to append.
+/// @param len Number of bytes to append.
+/// @return 0 if the bytes were appended successfully, 1 otherwise.
+int output_append(OutputBuffer *out, const char *data, size_t len);
+
+/// Appends a null-terminated string to the buffer.
+/// @param out Buffer to append to.
+/// @param str String to append.
+/// @return 0 if the string was appended successfully, 1 otherwise.
+int output_puts(OutputBuffer *out, const char *str);
+
+/// Writes everything buffered so far to the file descriptor, returning once
+/// it is written (or, for a socket, moved to the backlog).
+/// @param out Buffer to flush.
+/// @return 0 if the buffer was flushed successfully, 1 otherwise.
+int output_flush(OutputBuffer *out);
+
+/// Sends as much of the backlog of a socket as it takes without blocking.
+/// @param out Buffer to drain.
+/// @return 0 unless the socket failed, 1 otherwise.
+int output_drain(OutputBuffer *out);
+
+/// @param out Buffer to check.
+/// @return Number of bytes in the backlog, left to send.
+size_t output_backlog(const OutputBuffer *out);
+
+/// Writes bytes straight to a file descriptor, retrying on partial writes
+/// and interruptions.
+/// @param fd File descriptor to write to.
+/// @param kind What the descriptor is.
+/// @param data Bytes to write.
+/// @param len Number of bytes to write.
+/// @return 0 if every byte was written, 1 otherwise.
+int output_write_all(int fd, OutputKind kind, const char *data, size_t len);
+
+/// Syncs the directory of a file, so that creating or renaming the file
+/// is durable.
+/// @param path Path of the file.
+/// @return 0 if the directory was synced, 1 otherwise.
+int output_sync_directory(const char *path);
+
+#endif // KVS_OUTPUT_H
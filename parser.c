@@ -4,9 +4,325 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "constants.h"
 
+// Input of a job file. Regular files are mapped in memory as a whole;
+// anything else is read in blocks of PARSER_BUFFER_SIZE bytes, unless the
+// bytes are handed over with parser_set_buffer.
+typedef struct ParserInput {
+  int fd;
+  const char *data;  // Mapped file or buffer contents
+  size_t len;        // Bytes available in data
+  size_t mapped;     // Size of the mapping, 0 when the file is buffered
+  size_t pos;        // Next byte to be consumed
+  char *buffer;      // NULL when the file is mapped
+  int eof;
+  struct ParserInput *next;
+} ParserInput;
+
+// Each job file is parsed by a single thread, so inputs are kept per thread.
+static _Thread_local ParserInput *inputs = NULL;
+
+static ParserInput *open_input(int fd) {
+  ParserInput *in = calloc(1, sizeof(ParserInput));
+  if (in == NULL) {
+    return NULL;
+  }
+  in->fd = fd;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+      in->data = map;
+      in->len = in->mapped = (size_t)st.st_size;
+      in->eof = 1;
+    }
+  }
+
+  if (in->data == NULL) {
+    in->buffer = malloc(PARSER_BUFFER_SIZE);
+    if (in->buffer == NULL) {
+      free(in);
+      return NULL;
+    }
+    in->data = in->buffer;
+  }
+
+  in->next = inputs;
+  inputs = in;
+  return in;
+}
+
+static ParserInput *input_of(int fd) {
+  for (ParserInput *in = inputs; in != NULL; in = in->next) {
+    if (in->fd == fd) {
+      return in;
+    }
+  }
+  return open_input(fd);
+}
+
+// Reads more of the file into the buffer, keeping the unconsumed bytes.
+// @return Number of bytes added, 0 at the end of the file or if full.
+static size_t refill(ParserInput *in) {
+  if (in->eof) {
+    return 0;
+  }
+
+  if (in->pos > 0) {
+    memmove(in->buffer, in->buffer + in->pos, in->len - in->pos);
+    in->len -= in->pos;
+    in->pos = 0;
+  }
+
+  ssize_t bytes_read = read(in->fd, in->buffer + in->len, PARSER_BUFFER_SIZE - in->len);
+  if (bytes_read <= 0) {
+    if (in->len < PARSER_BUFFER_SIZE) {
+      in->eof = 1;
+    }
+    return 0;
+  }
+
+  in->len += (size_t)bytes_read;
+  return (size_t)bytes_read;
+}
+
+// Same contract as read(2), served from the mapped file or the buffer.
+static ssize_t input_read(int fd, void *buf, size_t count) {
+  ParserInput *in = input_of(fd);
+  if (in == NULL) {
+    return -1;
+  }
+
+  char *out = buf;
+  size_t copied = 0;
+  while (copied < count) {
+    if (in->pos == in->len && refill(in) == 0) {
+      break;
+    }
+
+    size_t chunk = in->len - in->pos;
+    if (chunk > count - copied) {
+      chunk = count - copied;
+    }
+    memcpy(out + copied, in->data + in->pos, chunk);
+    in->pos += chunk;
+    copied += chunk;
+  }
+
+  return (ssize_t)copied;
+}
+
+// Gets the rest of the current line, up to and excluding '\n', reading
+// the whole line into the buffer if needed.
+// @return Start of the line, NULL if the line is not complete in memory.
+static const char *peek_line(ParserInput *in, size_t *len) {
+  size_t scanned = 0;
+  while (1) {
+    const char *start = in->data + in->pos;
+    const char *newline = memchr(start + scanned, '\n', in->len - in->pos - scanned);
+    if (newline != NULL) {
+      *len = (size_t)(newline - start);
+      return start;
+    }
+
+    scanned = in->len - in->pos;
+    if (refill(in) == 0) {
+      return NULL;
+    }
+  }
+}
+
+// Delimiters that end a key or a value.
+static int is_delimiter(char ch) {
+  return ch == ',' || ch == ')' || ch == ']' || ch == ' ';
+}
+
+// Scans a key or value, as read_string would.
+// @return Pointer to the delimiter, NULL if the string is too long.
+static const char *scan_string(const char *p, const char *end, size_t max) {
+  const char *limit = end - p >= (ptrdiff_t)max ? p + max - 1 : end;
+  while (p < limit && !is_delimiter(*p)) {
+    p++;
+  }
+  return p < end && is_delimiter(*p) ? p : NULL;
+}
+
+static void copy_string(char *dest, const char *start, const char *end) {
+  memcpy(dest, start, (size_t)(end - start));
+  dest[end - start] = '\0';
+}
+
+// Scans the " TTL <ms>" that may follow the pairs of a WRITE.
+// @return 0 if the clause is well formed, with a positive time to live,
+// 1 otherwise.
+static int scan_ttl(const char *p, const char *end, unsigned int *ttl_ms) {
+  if (end - p < 6 || memcmp(p, " TTL ", 5) != 0) {
+    return 1;
+  }
+
+  unsigned long value = 0;
+  for (p += 5; p < end; p++) {
+    if (*p < '0' || *p > '9') {
+      return 1;
+    }
+    value = value * 10 + (unsigned long)(*p - '0');
+    if (value > UINT_MAX) {
+      return 1;
+    }
+  }
+  *ttl_ms = (unsigned int)value;
+  return value == 0;
+}
+
+// Parses "[(key,value)...][ TTL <ms>]" when it is well formed and fully
+// in memory. Anything else is left for the byte-by-byte parser, which
+// consumes invalid input exactly as before.
+// @return Number of pairs parsed, 0 if the fast path does not apply.
+static size_t fast_parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs,
+                               unsigned int *ttl_ms) {
+  ParserInput *in = input_of(fd);
+  size_t len;
+  const char *line = in == NULL ? NULL : peek_line(in, &len);
+  if (line == NULL || len < 2 || line[0] != '[' || line[1] != '(') {
+    return 0;
+  }
+
+  // The bracket must end the line, or be followed by the time to live
+  const char *end = memchr(line, ']', len);
+  unsigned int ttl = 0;
+  if (end == NULL || (end != line + len - 1 && scan_ttl(end + 1, line + len, &ttl))) {
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  const char *p = line + 2;
+  while (num_pairs < max_pairs) {
+    const char *comma = scan_string(p, end, MAX_STRING_SIZE);
+    if (comma == NULL || *comma != ',') {
+      return 0;
+    }
+    const char *close = scan_string(comma + 1, end, MAX_STRING_SIZE);
+    if (close == NULL || *close != ')') {
+      return 0;
+    }
+
+    copy_string(keys[num_pairs], p, comma);
+    copy_string(values[num_pairs++], comma + 1, close);
+
+    p = close + 1;
+    if (p == end) {
+      break;
+    }
+    if (*p != '(') {
+      return 0;
+    }
+    p++;
+  }
+
+  if (num_pairs == max_pairs) {
+    return 0;
+  }
+
+  in->pos += len + 1;
+  *ttl_ms = ttl;
+  return num_pairs;
+}
+
+// Parses "[key,...]" when it is well formed and fully in memory.
+// @return Number of keys parsed, 0 if the fast path does not apply.
+static size_t fast_parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+  ParserInput *in = input_of(fd);
+  size_t len;
+  const char *line = in == NULL ? NULL : peek_line(in, &len);
+  if (line == NULL || len < 1 || line[0] != '[') {
+    return 0;
+  }
+
+  const char *end = memchr(line, ']', len);
+  if (end == NULL || end != line + len - 1) {
+    return 0;
+  }
+
+  size_t num_keys = 0;
+  const char *p = line + 1;
+  while (num_keys < max_keys) {
+    const char *delimiter = scan_string(p, end + 1, max_string_size);
+    if (delimiter == NULL || (*delimiter != ',' && *delimiter != ']')) {
+      return 0;
+    }
+
+    copy_string(keys[num_keys++], p, delimiter);
+
+    if (delimiter == end) {
+      break;
+    }
+    p = delimiter + 1;
+  }
+
+  if (num_keys == max_keys) {
+    return 0;
+  }
+
+  in->pos += len + 1;
+  return num_keys;
+}
+
+int parser_set_range(int fd, size_t start, size_t end) {
+  ParserInput *in = input_of(fd);
+  if (in == NULL || in->mapped == 0 || start > end || end > in->mapped) {
+    return 1;
+  }
+
+  in->pos = start;
+  in->len = end;
+  return 0;
+}
+
+int parser_set_buffer(int fd, const char *data, size_t len) {
+  ParserInput *in = calloc(1, sizeof(ParserInput));
+  if (in == NULL) {
+    return 1;
+  }
+
+  // Neither mapped nor buffered: the bytes belong to the caller
+  in->fd = fd;
+  in->data = data;
+  in->len = len;
+  in->eof = 1;
+  in->next = inputs;
+  inputs = in;
+  return 0;
+}
+
+size_t parser_offset(int fd) {
+  ParserInput *in = input_of(fd);
+  return in == NULL || in->mapped == 0 ? 0 : in->pos;
+}
+
+void parser_release(int fd) {
+  for (ParserInput **link = &inputs; *link != NULL; link = &(*link)->next) {
+    ParserInput *in = *link;
+    if (in->fd != fd) {
+      continue;
+    }
+
+    *link = in->next;
+    if (in->buffer != NULL) {
+      free(in->buffer);
+    } else if (in->mapped > 0) {
+      munmap((void *)in->data, in->mapped);
+    }
+    free(in);
+    return;
+  }
+}
+
 static int read_string(int fd, char *buffer, size_t max) {
   ssize_t bytes_read;
   char ch;
@@ -14,7 +330,7 @@ static int read_string(int fd, char *buffer, size_t max) {
   int value = -1;
 
   while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+    bytes_read = input_read(fd, &ch, 1);
 
     if (bytes_read <= 0) {
         return -1;
@@ -40,6 +356,10 @@ static int read_string(int fd, char *buffer, size_t max) {
     buffer[i++] = ch;
   }
 
+  if (i == max) {
+    return -1;  // Too long, there is no room for the terminator
+  }
+
   buffer[i] = '\0';
 
   return value;
@@ -50,8 +370,9 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (input_read(fd, buf + i, 1) == 0) {
       *next = '\0';
+      buf[i] = '\0';
       break;
     }
 
@@ -62,7 +383,10 @@ static int read_uint(int fd, unsigned int *value, char *next) {
       break;
     }
 
-    i++;
+    // Too many digits for an unsigned int anyway
+    if (++i == (int)sizeof(buf) - 1) {
+      return 1;
+    }
   }
 
   unsigned long ul = strtoul(buf, NULL, 10);
@@ -78,20 +402,46 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 
 static void cleanup(int fd) {
   char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
+  while (input_read(fd, &ch, 1) == 1 && ch != '\n')
     ;
 }
 
+int parse_tag(int fd, unsigned int *seq) {
+  ParserInput *in = input_of(fd);
+  if (in == NULL || (in->pos == in->len && refill(in) == 0) || in->data[in->pos] != '#') {
+    return 0;
+  }
+
+  // Without a digit after it, '#' starts a comment, as in job files
+  if (in->pos + 1 == in->len) {
+    refill(in);
+  }
+  if (in->pos + 1 == in->len || in->data[in->pos + 1] < '0' || in->data[in->pos + 1] > '9') {
+    return 0;
+  }
+  in->pos++;
+
+  char next;
+  if (read_uint(fd, seq, &next) != 0 || next != ' ') {
+    if (next != '\n' && next != '\0') {
+      cleanup(fd);
+    }
+    return -1;
+  }
+
+  return 1;
+}
+
 enum Command get_next(int fd) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (input_read(fd, buf, 1) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+      if (input_read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        if (input_read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
           cleanup(fd);
           return CMD_INVALID;
         }
@@ -101,7 +451,7 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+      if (input_read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -109,7 +459,7 @@ enum Command get_next(int fd) {
       return CMD_READ;
 
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+      if (input_read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -117,12 +467,40 @@ enum Command get_next(int fd) {
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+      if (input_read(fd, buf + 1, 3) != 3) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (strncmp(buf, "SCAN", 4) == 0) {
+        if (input_read(fd, buf + 4, 1) != 1 || buf[4] != ' ') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_SCAN;
+      }
+
+      if (strncmp(buf, "STAT", 4) == 0) {
+        if (input_read(fd, buf + 4, 1) != 1 || buf[4] != 'S') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        if (input_read(fd, buf + 5, 1) != 0 && buf[5] != '\n') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_STATS;
+      }
+
+      if (strncmp(buf, "SHOW", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (input_read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -130,12 +508,12 @@ enum Command get_next(int fd) {
       return CMD_SHOW;
 
     case 'B':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+      if (input_read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
+      if (input_read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -143,12 +521,12 @@ enum Command get_next(int fd) {
       return CMD_BACKUP;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+      if (input_read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (input_read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -182,15 +560,22 @@ int parse_pair(int fd, char *key, char *value) {
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size,
+                   unsigned int *ttl_ms) {
   char ch;
+  *ttl_ms = 0;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  size_t fast_pairs = fast_parse_write(fd, keys, values, max_pairs, ttl_ms);
+  if (fast_pairs > 0) {
+    return fast_pairs;
+  }
+
+  if (input_read(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
+  if (input_read(fd, &ch, 1) != 1 || ch != '(') {
     cleanup(fd);
     return 0;
   }
@@ -207,7 +592,7 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
     strcpy(keys[num_pairs], key);
     strcpy(values[num_pairs++], value);
 
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+    if (input_read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
       cleanup(fd);
       return 0;
     }
@@ -222,7 +607,27 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (input_read(fd, &ch, 1) != 1) {
+    return 0;
+  }
+
+  if (ch == ' ') {
+    for (const char *clause = "TTL "; *clause != '\0'; clause++) {
+      if (input_read(fd, &ch, 1) != 1 || ch != *clause) {
+        if (ch != '\n') {
+          cleanup(fd);
+        }
+        return 0;
+      }
+    }
+    if (read_uint(fd, ttl_ms, &ch) != 0 || *ttl_ms == 0 || (ch != '\n' && ch != '\0')) {
+      if (ch != '\n' && ch != '\0') {
+        cleanup(fd);
+      }
+      *ttl_ms = 0;
+      return 0;
+    }
+  } else if (ch != '\n' && ch != '\0') {
     cleanup(fd);
     return 0;
   }
@@ -233,7 +638,12 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  size_t fast_keys = fast_parse_read_delete(fd, keys, max_keys, max_string_size);
+  if (fast_keys > 0) {
+    return fast_keys;
+  }
+
+  if (input_read(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
@@ -259,7 +669,7 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (input_read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
@@ -267,6 +677,18 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   return num_keys;
 }
 
+size_t parse_scan(int fd, char keys[][MAX_STRING_SIZE]) {
+  // Room for one key more than allowed, so that a third one is rejected
+  // by parse_read_delete rather than overwritten
+  char bounds[3][MAX_STRING_SIZE];
+  size_t num_keys = parse_read_delete(fd, bounds, 3, MAX_STRING_SIZE);
+
+  for (size_t i = 0; i < num_keys; i++) {
+    strcpy(keys[i], bounds[i]);
+  }
+  return num_keys;
+}
+
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
@@ -294,3 +716,39 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
     return -1;
   }
 }
+
+void parse_command(int fd, ParsedCommand *cmd) {
+  cmd->command = get_next(fd);
+  cmd->num_pairs = 0;
+  cmd->wait_result = 0;
+  cmd->delay = 0;
+  cmd->ttl_ms = 0;
+
+  switch (cmd->command) {
+    case CMD_WRITE:
+      cmd->num_pairs = parse_write(fd, cmd->keys, cmd->values, MAX_WRITE_SIZE, MAX_STRING_SIZE, &cmd->ttl_ms);
+      break;
+
+    case CMD_READ:
+    case CMD_DELETE:
+      cmd->num_pairs = parse_read_delete(fd, cmd->keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      break;
+
+    case CMD_SCAN:
+      cmd->num_pairs = parse_scan(fd, cmd->keys);
+      break;
+
+    case CMD_WAIT:
+      cmd->wait_result = parse_wait(fd, &cmd->delay, NULL);
+      break;
+
+    case CMD_SHOW:
+    case CMD_STATS:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+      break;
+  }
+}
@@ -9,6 +9,8 @@ enum Command {
   CMD_READ,
   CMD_DELETE,
   CMD_SHOW,
+  CMD_SCAN,
+  CMD_STATS,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -17,19 +19,50 @@ enum Command {
   EOC  // End of commands
 };
 
+// A command with its arguments, parsed ahead of its execution.
+typedef struct ParsedCommand {
+  enum Command command;
+  // Pairs (or keys) of a WRITE, READ, DELETE or SCAN, 0 if they are
+  // invalid.
+  size_t num_pairs;
+  // Result of parse_wait for a WAIT.
+  int wait_result;
+  unsigned int delay;
+  // Milliseconds the pairs of a WRITE live for, 0 if they never expire.
+  unsigned int ttl_ms;
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+} ParsedCommand;
+
+/// Reads the next command and its arguments.
+/// @param fd File descriptor to read from.
+/// @param cmd Command to fill; command is EOC at the end of the file.
+void parse_command(int fd, ParsedCommand *cmd);
+
 /// Reads a line and returns the corresponding command.
 /// @param fd File descriptor to read from.
 /// @return The command read.
 enum Command get_next(int fd);
 
-/// Parses a WRITE command.
+/// Parses the sequence number a command may be tagged with, "#<seq> ".
+/// A '#' without a digit after it starts a comment instead, left to
+/// get_next.
+/// @param fd File descriptor to read from.
+/// @param seq Pointer to the variable to store the sequence number in.
+/// @return 1 if the command is tagged, 0 if it is not, -1 if the tag is
+/// malformed (the rest of its line is then skipped).
+int parse_tag(int fd, unsigned int *seq);
+
+/// Parses a WRITE command, whose pairs may be followed by " TTL <ms>".
 /// @param fd File descriptor to read from.
 /// @param keys Array of keys to be written.
 /// @param values Array of values to be written.
 /// @param max_pairs number of pairs to be written.
 /// @param max_string_size maximum size for keys and values.
+/// @param ttl_ms Pointer to store the time to live in, 0 if there is none.
 /// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size,
+                   unsigned int *ttl_ms);
 
 /// Parses a READ or DELETE command.
 /// @param fd File descriptor to read from.
@@ -39,6 +72,12 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
 /// @return Number of keys read or deleted. 0 on failure.
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
 
+/// Parses a SCAN command: [prefix] or [first,last].
+/// @param fd File descriptor to read from.
+/// @param keys Array to store the prefix, or the first and last keys in.
+/// @return Number of keys parsed (1 or 2). 0 on failure.
+size_t parse_scan(int fd, char keys[][MAX_STRING_SIZE]);
+
 /// Parses a WAIT command.
 /// @param fd File descriptor to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
@@ -46,4 +85,31 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on error.
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
 
+/// Restricts parsing of a regular file to a range of bytes, so that parts
+/// of it can be parsed separately. The range must start at a line.
+/// @param fd File descriptor to read from.
+/// @param start Offset of the first byte to parse.
+/// @param end Offset past the last byte to parse.
+/// @return 0 if the range was set, 1 if the file is not mapped in memory.
+int parser_set_range(int fd, size_t start, size_t end);
+
+/// Makes the calling thread parse commands from bytes in memory rather than
+/// from a file descriptor, until parser_release. The end of the bytes is
+/// the end of the commands.
+/// @param fd File descriptor the bytes were read from, to parse them as.
+/// @param data Bytes to parse; they must stay untouched until released.
+/// @param len Number of bytes.
+/// @return 0 if the bytes are ready to be parsed, 1 otherwise.
+int parser_set_buffer(int fd, const char *data, size_t len);
+
+/// Gets the offset of the next byte to be parsed in a regular file.
+/// @param fd File descriptor being parsed.
+/// @return Offset in the file, 0 if the file is not mapped in memory.
+size_t parser_offset(int fd);
+
+/// Releases the input state the calling thread keeps for a file
+/// descriptor. Must be called before the descriptor is closed.
+/// @param fd File descriptor that was being parsed.
+void parser_release(int fd);
+
 #endif  // KVS_PARSER_H
@@ -0,0 +1,62 @@
+#ifndef KVS_PROTOCOL_H
+#define KVS_PROTOCOL_H
+
+#include "constants.h"
+
+// Protocol between kvs --serve and its clients. Clients may send any
+// number of commands without waiting for answers; the commands of a
+// connection run, and are answered, in the order they were sent, and the
+// answers to every command that arrived together are written at once.
+//
+// A connection speaks text, unless its first byte is PROTOCOL_MAGIC.
+//
+// Text: commands in the job file grammar, one per line. A command may be
+// tagged with a sequence number, "#<seq> READ [a,b]"; its output is then
+// followed by the line "#<seq>". No output line starts with '#', so the
+// output of each tagged command can be told apart. A '#' without a digit
+// after it starts a comment, as in job files.
+//
+// Binary: after PROTOCOL_MAGIC, every request is a frame of
+//   u32 length of the rest of the frame | u32 sequence | u8 opcode | args
+// with integers in little endian and strings as a u8 length followed by
+// the characters, which the text grammar must allow in a key or value:
+//   WRITE: u16 count, then count pairs of key and value strings, then
+//          optionally a u32 time to live in milliseconds, not 0
+//   READ, DELETE: u16 count, then count key strings
+//   SCAN: u16 count (1 for a prefix, 2 for a range), then the key strings
+//   WAIT: u32 delay in milliseconds
+//   SHOW, STATS, BACKUP: no arguments
+// and is answered by
+//   u32 sequence | u8 status | output | '\0'
+// where output is what the command writes to a job's .out file, which
+// never holds a '\0'. A request with a malformed frame length closes the
+// connection.
+
+#define PROTOCOL_MAGIC 0xB1
+// Bytes of a request frame before its arguments.
+#define PROTOCOL_REQUEST_HEADER 9
+// Bytes of an answer before its output.
+#define PROTOCOL_ANSWER_HEADER 5
+// Largest frame length, so that a whole request fits in the input buffer.
+#define PROTOCOL_MAX_FRAME (PARSER_BUFFER_SIZE - 4)
+
+typedef enum ProtocolOpcode
+{
+  OP_WRITE = 1,
+  OP_READ,
+  OP_DELETE,
+  OP_SCAN,
+  OP_SHOW,
+  OP_STATS,
+  OP_WAIT,
+  OP_BACKUP
+} ProtocolOpcode;
+
+typedef enum ProtocolStatus
+{
+  PROTOCOL_OK,
+  // The request was malformed and did not run.
+  PROTOCOL_INVALID
+} ProtocolStatus;
+
+#endif // KVS_PROTOCOL_H
@@ -0,0 +1,27 @@
+#include "registry.h"
+
+#include <stdlib.h>
+
+void *thread_registry_get(ThreadRegistry *registry, ThreadRecord **local, size_t size)
+{
+  if (*local != NULL)
+    return *local;
+
+  ThreadRecord *record = calloc(1, size);
+  if (record == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&registry->mutex);
+  record->id = ++registry->count;
+  record->next = atomic_load(&registry->records);
+  atomic_store(&registry->records, record);
+  pthread_mutex_unlock(&registry->mutex);
+
+  *local = record;
+  return record;
+}
+
+ThreadRecord *thread_registry_first(ThreadRegistry *registry)
+{
+  return atomic_load(&registry->records);
+}
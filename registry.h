@@ -0,0 +1,42 @@
+#ifndef KVS_REGISTRY_H
+#define KVS_REGISTRY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Header of a per-thread record; it must be the first member of the
+// record, so the two pointers convert into each other.
+typedef struct ThreadRecord
+{
+  struct ThreadRecord *next;
+  // Order in which the threads registered, counting from 1.
+  unsigned int id;
+} ThreadRecord;
+
+// Records of every thread that registered. They are kept after the
+// thread exits, so nothing they hold is lost; records are only ever
+// added, so they can be walked without the mutex.
+typedef struct ThreadRegistry
+{
+  _Atomic(ThreadRecord *) records;
+  pthread_mutex_t mutex;
+  unsigned int count;
+} ThreadRegistry;
+
+#define THREAD_REGISTRY_INITIALIZER {NULL, PTHREAD_MUTEX_INITIALIZER, 0}
+
+/// Gets the record of the calling thread, registering a zeroed one the
+/// first time.
+/// @param registry Registry to add the record to.
+/// @param local Thread-local pointer caching the record of the thread.
+/// @param size Size of the record, header included.
+/// @return Record of the thread, NULL if it cannot be allocated.
+void *thread_registry_get(ThreadRegistry *registry, ThreadRecord **local, size_t size);
+
+/// @param registry Registry to walk.
+/// @return Most recently registered record, NULL if there is none; the
+/// others follow through next.
+ThreadRecord *thread_registry_first(ThreadRegistry *registry);
+
+#endif // KVS_REGISTRY_H
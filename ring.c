@@ -0,0 +1,111 @@
+#include "ring.h"
+
+#include <stdlib.h>
+
+// Times a side checks the ring again before going to sleep.
+#define RING_SPINS 64
+
+SpscRing *ring_create(size_t capacity, size_t slot_size)
+{
+  SpscRing *ring = malloc(sizeof(SpscRing));
+  if (ring == NULL)
+    return NULL;
+
+  ring->slots = malloc(capacity * slot_size);
+  if (ring->slots == NULL)
+  {
+    free(ring);
+    return NULL;
+  }
+
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->capacity = capacity;
+  ring->slot_size = slot_size;
+  atomic_init(&ring->producer.sleeping, 0);
+  atomic_init(&ring->consumer.sleeping, 0);
+  sem_init(&ring->producer.wake, 0, 0);
+  sem_init(&ring->consumer.wake, 0, 0);
+  return ring;
+}
+
+static int ring_full(SpscRing *ring, size_t tail)
+{
+  return tail - atomic_load_explicit(&ring->head, memory_order_acquire) == ring->capacity;
+}
+
+static int ring_empty(SpscRing *ring, size_t head)
+{
+  return atomic_load_explicit(&ring->tail, memory_order_acquire) == head;
+}
+
+// Waits while a condition on the ring holds, spinning and then sleeping.
+// @param index The caller's own position, which only it changes.
+static void ring_wait(SpscRing *ring, RingSleeper *self, int (*blocked)(SpscRing *, size_t), size_t index)
+{
+  unsigned int spins = 0;
+  while (blocked(ring, index))
+  {
+    if (++spins < RING_SPINS)
+      continue;
+    spins = 0;
+
+    // Checked again once the flag is set, so that a move of the other
+    // side meanwhile either is seen or finds the flag set
+    atomic_store(&self->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!blocked(ring, index))
+    {
+      // A post may still come, and only makes a later wait check again
+      atomic_store(&self->sleeping, 0);
+      break;
+    }
+    sem_wait(&self->wake);
+  }
+}
+
+// Wakes the other side if it is sleeping, after the caller moved.
+static void ring_wake(RingSleeper *other)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&other->sleeping, memory_order_relaxed) && atomic_exchange(&other->sleeping, 0))
+    sem_post(&other->wake);
+}
+
+void *ring_claim(SpscRing *ring)
+{
+  // Only the producer changes tail
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  ring_wait(ring, &ring->producer, ring_full, tail);
+  return ring->slots + (tail % ring->capacity) * ring->slot_size;
+}
+
+void ring_publish(SpscRing *ring)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  ring_wake(&ring->consumer);
+}
+
+void *ring_peek(SpscRing *ring)
+{
+  // Only the consumer changes head
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  ring_wait(ring, &ring->consumer, ring_empty, head);
+  return ring->slots + (head % ring->capacity) * ring->slot_size;
+}
+
+void ring_release(SpscRing *ring)
+{
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  ring_wake(&ring->producer);
+}
+
+void ring_destroy(SpscRing *ring)
+{
+  sem_destroy(&ring->producer.wake);
+  sem_destroy(&ring->consumer.wake);
+  free(ring->slots);
+  free(ring);
+}
@@ -0,0 +1,67 @@
+#ifndef KVS_RING_H
+#define KVS_RING_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Side of a ring sleeping until the other one moves.
+typedef struct RingSleeper
+{
+  // Set by the side before it sleeps on wake, cleared by the other side,
+  // which then posts wake.
+  _Alignas(64) atomic_int sleeping;
+  sem_t wake;
+} RingSleeper;
+
+// Lock-free ring of fixed-size slots between one producer thread and one
+// consumer thread. Slots are filled and read in place: the producer claims
+// a free slot, fills it and publishes it; the consumer peeks at the oldest
+// published slot and releases it once done. Either side waits while the
+// ring is full or empty, spinning for a while and then sleeping until the
+// other side wakes it.
+typedef struct SpscRing
+{
+  // Number of slots released by the consumer.
+  _Alignas(64) atomic_size_t head;
+  // Number of slots published by the producer.
+  _Alignas(64) atomic_size_t tail;
+  _Alignas(64) size_t capacity;
+  size_t slot_size;
+  char *slots;
+  // Producer waiting for a free slot, consumer waiting for a published one.
+  RingSleeper producer;
+  RingSleeper consumer;
+} SpscRing;
+
+/// Creates an empty ring.
+/// @param capacity Number of slots.
+/// @param slot_size Size of each slot, in bytes.
+/// @return Newly created ring, NULL on failure.
+SpscRing *ring_create(size_t capacity, size_t slot_size);
+
+/// Gets the next slot to fill, waiting while the ring is full.
+/// Producer only.
+/// @param ring Ring to write to.
+/// @return Slot to be filled and then published.
+void *ring_claim(SpscRing *ring);
+
+/// Makes the claimed slot visible to the consumer. Producer only.
+/// @param ring Ring to write to.
+void ring_publish(SpscRing *ring);
+
+/// Gets the oldest published slot, waiting while the ring is empty.
+/// Consumer only.
+/// @param ring Ring to read from.
+/// @return Slot to be read and then released.
+void *ring_peek(SpscRing *ring);
+
+/// Hands the slot last peeked at back to the producer. Consumer only.
+/// @param ring Ring to read from.
+void ring_release(SpscRing *ring);
+
+/// Frees a ring no thread uses anymore.
+/// @param ring Ring to be freed.
+void ring_destroy(SpscRing *ring);
+
+#endif // KVS_RING_H
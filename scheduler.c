@@ -0,0 +1,202 @@
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct Task
+{
+  size_t size;
+  void (*run)(void *);
+  void *arg;
+  struct Task *next;
+} Task;
+
+typedef struct WorkQueue
+{
+  pthread_mutex_t mutex;
+  // Sorted by decreasing size.
+  Task *head;
+  // Sum of the sizes of the queued tasks. Read without the mutex to pick
+  // a queue, so it is only a hint.
+  atomic_size_t pending;
+  // Number of queued tasks, as tasks of size 0 add nothing to pending.
+  atomic_size_t tasks;
+} WorkQueue;
+
+static WorkQueue *queues = NULL;
+static unsigned int num_queues = 0;
+
+// Index of the queue of the calling worker, -1 outside the workers.
+static _Thread_local int current_worker = -1;
+
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signaled when a task is queued or the last task completes.
+static pthread_cond_t work_changed = PTHREAD_COND_INITIALIZER;
+// Tasks waiting in some queue.
+static size_t queued_tasks = 0;
+// Tasks queued or running; a running task may still submit more.
+static size_t unfinished_tasks = 0;
+
+int scheduler_init(unsigned int workers)
+{
+  queues = calloc(workers, sizeof(WorkQueue));
+  if (queues == NULL)
+    return 1;
+
+  for (unsigned int i = 0; i < workers; i++)
+  {
+    pthread_mutex_init(&queues[i].mutex, NULL);
+  }
+  num_queues = workers;
+  return 0;
+}
+
+static WorkQueue *least_loaded_queue()
+{
+  WorkQueue *best = &queues[0];
+  for (unsigned int i = 1; i < num_queues; i++)
+  {
+    if (queues[i].pending < best->pending)
+      best = &queues[i];
+  }
+  return best;
+}
+
+int scheduler_submit(size_t size, void (*run)(void *), void *arg)
+{
+  Task *task = malloc(sizeof(Task));
+  if (task == NULL)
+    return 1;
+
+  task->size = size;
+  task->run = run;
+  task->arg = arg;
+
+  WorkQueue *queue = current_worker >= 0 ? &queues[current_worker] : least_loaded_queue();
+  pthread_mutex_lock(&queue->mutex);
+  Task **link = &queue->head;
+  while (*link != NULL && (*link)->size >= size)
+  {
+    link = &(*link)->next;
+  }
+  task->next = *link;
+  *link = task;
+  queue->pending += size;
+  queue->tasks++;
+  pthread_mutex_unlock(&queue->mutex);
+
+  pthread_mutex_lock(&idle_mutex);
+  queued_tasks++;
+  unfinished_tasks++;
+  pthread_cond_signal(&work_changed);
+  pthread_mutex_unlock(&idle_mutex);
+  return 0;
+}
+
+static Task *pop_task(WorkQueue *queue)
+{
+  pthread_mutex_lock(&queue->mutex);
+  Task *task = queue->head;
+  if (task != NULL)
+  {
+    queue->head = task->next;
+    queue->pending -= task->size;
+    queue->tasks--;
+  }
+  pthread_mutex_unlock(&queue->mutex);
+
+  if (task != NULL)
+  {
+    pthread_mutex_lock(&idle_mutex);
+    queued_tasks--;
+    pthread_mutex_unlock(&idle_mutex);
+  }
+  return task;
+}
+
+// Takes the largest task of the most loaded queue, which keeps the
+// largest-first order across workers. Any queue holding a task is a
+// victim, even if its tasks have no size.
+static Task *steal_task()
+{
+  WorkQueue *victim = NULL;
+  for (unsigned int i = 0; i < num_queues; i++)
+  {
+    if (queues[i].tasks > 0 && (victim == NULL || queues[i].pending > victim->pending))
+      victim = &queues[i];
+  }
+  return victim == NULL ? NULL : pop_task(victim);
+}
+
+static void *worker(void *arg)
+{
+  current_worker = (int)(size_t)arg;
+  WorkQueue *own = &queues[current_worker];
+
+  while (1)
+  {
+    Task *task = pop_task(own);
+    if (task == NULL)
+      task = steal_task();
+
+    if (task != NULL)
+    {
+      task->run(task->arg);
+      free(task);
+
+      pthread_mutex_lock(&idle_mutex);
+      if (--unfinished_tasks == 0)
+        pthread_cond_broadcast(&work_changed);
+      pthread_mutex_unlock(&idle_mutex);
+      continue;
+    }
+
+    // Nothing queued: wait for running tasks to submit more, or to finish
+    pthread_mutex_lock(&idle_mutex);
+    while (queued_tasks == 0 && unfinished_tasks > 0)
+    {
+      pthread_cond_wait(&work_changed, &idle_mutex);
+    }
+    int done = unfinished_tasks == 0;
+    pthread_mutex_unlock(&idle_mutex);
+
+    if (done)
+      break;
+  }
+
+  return NULL;
+}
+
+int scheduler_run()
+{
+  pthread_t threads[num_queues];
+  unsigned int started;
+  int result = 0;
+
+  for (started = 0; started < num_queues; started++)
+  {
+    if (pthread_create(&threads[started], NULL, worker, (void *)(size_t)started) != 0)
+    {
+      perror("Failed to create thread");
+      result = 1;
+      break;
+    }
+  }
+
+  // The queues of workers that could not be started are stolen from
+  for (unsigned int i = 0; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (unsigned int i = 0; i < num_queues; i++)
+  {
+    pthread_mutex_destroy(&queues[i].mutex);
+  }
+  free(queues);
+  queues = NULL;
+  num_queues = 0;
+  return result;
+}
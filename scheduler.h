@@ -0,0 +1,29 @@
+#ifndef KVS_SCHEDULER_H
+#define KVS_SCHEDULER_H
+
+#include <stddef.h>
+
+// Work-stealing scheduler of the job threads. Every worker has its own
+// queue of tasks, kept largest first; a worker whose queue is empty takes
+// the largest task of the most loaded queue instead of sitting idle.
+
+/// Sets up the queues of the workers.
+/// @param workers Number of worker threads.
+/// @return 0 if the scheduler was set up successfully, 1 otherwise.
+int scheduler_init(unsigned int workers);
+
+/// Queues a task. Called from a worker, the task goes to the worker's own
+/// queue; otherwise to the queue with the least work, so tasks submitted
+/// largest first are spread evenly.
+/// @param size Estimated amount of work of the task, e.g. its file size.
+/// @param run Function that performs the task.
+/// @param arg Argument passed to run.
+/// @return 0 if the task was queued successfully, 1 otherwise.
+int scheduler_submit(size_t size, void (*run)(void *), void *arg);
+
+/// Runs the workers until every task has completed, including those
+/// submitted by other tasks meanwhile, then releases the queues.
+/// @return 0 if every worker could be started, 1 otherwise.
+int scheduler_run();
+
+#endif // KVS_SCHEDULER_H
@@ -0,0 +1,616 @@
+// accept4()
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "parser.h"
+#include "protocol.h"
+#include "stats.h"
+#include "trace.h"
+
+// Events taken from epoll at once.
+#define SERVER_EVENTS 64
+
+typedef struct Connection
+{
+  int fd;
+  // Whether the first byte arrived, and so the protocol is known.
+  int started;
+  int binary;
+  // Whether the connection waits for room to send its backlog, instead
+  // of for input; closing once it is sent if the client is done.
+  int writing;
+  int closing;
+  // Bytes received that were not run yet.
+  size_t used;
+  BackupState backups;
+  // Next connection waiting for a worker.
+  struct Connection *next_ready;
+  // Open connections, to close those left when the server stops.
+  struct Connection *prev;
+  struct Connection *next;
+  OutputBuffer out;
+  char input[PARSER_BUFFER_SIZE];
+  char sessionName[];
+} Connection;
+
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signaled when a connection is ready or the server is stopping.
+static pthread_cond_t connection_ready = PTHREAD_COND_INITIALIZER;
+static Connection *ready_head = NULL;
+static Connection *ready_tail = NULL;
+static Connection *open_connections = NULL;
+static int stopping = 0;
+
+static int epoll_fd = -1;
+static ServerHandler batch_handler = NULL;
+// Written to by the signal handler, to wake the event loop up.
+static int signal_pipe[2] = {-1, -1};
+
+// Told apart from connections in the epoll events.
+static char listener_tag;
+static char signal_tag;
+
+static void on_signal(int sig)
+{
+  (void)sig;
+  int saved = errno;
+  char byte = 0;
+  if (write(signal_pipe[1], &byte, 1) < 0)
+  {
+    // The loop is woken up already if the pipe is full
+  }
+  errno = saved;
+}
+
+// Waits for more input from a connection, or for room to send its
+// backlog, in a single worker at a time.
+static void watch_connection(Connection *conn, int op)
+{
+  uint32_t events = (conn->writing ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+  struct epoll_event event = {.events = events, .data.ptr = conn};
+  if (epoll_ctl(epoll_fd, op, conn->fd, &event) != 0)
+    perror("Failed to watch a connection");
+}
+
+static void close_connection(Connection *conn)
+{
+  kvs_backup_end(&conn->backups);
+
+  pthread_mutex_lock(&server_mutex);
+  if (conn->prev != NULL)
+    conn->prev->next = conn->next;
+  else
+    open_connections = conn->next;
+  if (conn->next != NULL)
+    conn->next->prev = conn->prev;
+  pthread_mutex_unlock(&server_mutex);
+
+  output_release(&conn->out);
+  close(conn->fd);
+  free(conn);
+}
+
+// Runs the commands in the first len bytes received, which end a line.
+static void run_text(Connection *conn, size_t len, ParsedCommand *cmd)
+{
+  if (parser_set_buffer(conn->fd, conn->input, len) != 0)
+    return;
+
+  while (1)
+  {
+    uint64_t start = stats_now();
+    unsigned int seq = 0;
+    int tagged = parse_tag(conn->fd, &seq);
+    if (tagged < 0)
+      cmd->command = CMD_INVALID;
+    else
+      parse_command(conn->fd, cmd);
+    stats_parse(stats_now() - start);
+
+    if (cmd->command == EOC)
+      break;
+
+    batch_handler(cmd, &conn->out, conn->sessionName, &conn->backups);
+    if (tagged > 0)
+    {
+      char trailer[16];
+      int trailerLen = snprintf(trailer, sizeof(trailer), "#%u\n", seq);
+      output_append(&conn->out, trailer, (size_t)trailerLen);
+    }
+  }
+
+  parser_release(conn->fd);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Copies a string of a binary frame, which must be a valid key or value.
+// @return Bytes consumed, 0 if the string is malformed.
+static size_t get_string(const unsigned char *p, const unsigned char *end, char *dest)
+{
+  if (p >= end || *p >= MAX_STRING_SIZE || *p > end - p - 1)
+    return 0;
+
+  size_t len = *p++;
+  for (size_t i = 0; i < len; i++)
+  {
+    char ch = (char)p[i];
+    if (ch == ',' || ch == ')' || ch == ']' || ch == ' ' || ch == '\n' || ch == '\0')
+      return 0;
+    dest[i] = ch;
+  }
+  dest[len] = '\0';
+  return len + 1;
+}
+
+// Fills a command from the opcode and arguments of a binary frame.
+// @return 0 if the frame is well formed, 1 otherwise.
+static int decode_frame(unsigned char opcode, const unsigned char *p, const unsigned char *end, ParsedCommand *cmd)
+{
+  cmd->num_pairs = 0;
+  cmd->wait_result = 0;
+  cmd->delay = 0;
+  cmd->ttl_ms = 0;
+
+  switch (opcode)
+  {
+  case OP_SHOW:
+    cmd->command = CMD_SHOW;
+    return p != end;
+  case OP_STATS:
+    cmd->command = CMD_STATS;
+    return p != end;
+  case OP_BACKUP:
+    cmd->command = CMD_BACKUP;
+    return p != end;
+  case OP_WAIT:
+    cmd->command = CMD_WAIT;
+    if (end - p != 4)
+      return 1;
+    cmd->delay = get_u32(p);
+    return 0;
+  case OP_WRITE:
+    cmd->command = CMD_WRITE;
+    break;
+  case OP_READ:
+    cmd->command = CMD_READ;
+    break;
+  case OP_DELETE:
+    cmd->command = CMD_DELETE;
+    break;
+  case OP_SCAN:
+    cmd->command = CMD_SCAN;
+    break;
+  default:
+    return 1;
+  }
+
+  if (end - p < 2)
+    return 1;
+  size_t count = (size_t)p[0] | (size_t)p[1] << 8;
+  p += 2;
+  size_t max = cmd->command == CMD_SCAN ? 3 : MAX_WRITE_SIZE;
+  if (count == 0 || count >= max)
+    return 1;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    size_t used = get_string(p, end, cmd->keys[i]);
+    if (used == 0)
+      return 1;
+    p += used;
+
+    if (cmd->command == CMD_WRITE)
+    {
+      used = get_string(p, end, cmd->values[i]);
+      if (used == 0)
+        return 1;
+      p += used;
+    }
+  }
+
+  cmd->num_pairs = count;
+  if (cmd->command == CMD_WRITE && end - p == 4)
+  {
+    cmd->ttl_ms = get_u32(p);
+    return cmd->ttl_ms == 0;
+  }
+  return p != end;
+}
+
+// Runs the commands of the binary frames received complete.
+// @return Bytes of input consumed, or SIZE_MAX if a frame is malformed.
+static size_t run_binary(Connection *conn, ParsedCommand *cmd)
+{
+  const unsigned char *input = (const unsigned char *)conn->input;
+  size_t pos = 0;
+  while (conn->used - pos >= 4)
+  {
+    uint32_t length = get_u32(input + pos);
+    if (length < PROTOCOL_REQUEST_HEADER - 4 || length > PROTOCOL_MAX_FRAME)
+      return SIZE_MAX;
+    if (conn->used - pos - 4 < length)
+      break;
+
+    const unsigned char *frame = input + pos + 4;
+    uint64_t start = stats_now();
+    int invalid = decode_frame(frame[4], frame + 5, frame + length, cmd);
+    stats_parse(stats_now() - start);
+
+    // The sequence number is echoed as it came
+    char header[PROTOCOL_ANSWER_HEADER];
+    memcpy(header, frame, 4);
+    header[4] = (char)(invalid ? PROTOCOL_INVALID : PROTOCOL_OK);
+    output_append(&conn->out, header, sizeof(header));
+    if (!invalid)
+      batch_handler(cmd, &conn->out, conn->sessionName, &conn->backups);
+    output_append(&conn->out, "", 1);
+
+    pos += 4 + length;
+  }
+
+  return pos;
+}
+
+// Sends what is left of the output of a connection. Input is only read
+// again once everything is sent, so a client that does not read cannot
+// make the server hold more than the output of one batch.
+static void send_backlog(Connection *conn)
+{
+  if (output_drain(&conn->out) != 0)
+  {
+    close_connection(conn);
+    return;
+  }
+
+  if (output_backlog(&conn->out) == 0)
+  {
+    conn->writing = 0;
+    if (conn->closing)
+    {
+      close_connection(conn);
+      return;
+    }
+  }
+  watch_connection(conn, EPOLL_CTL_MOD);
+}
+
+// Reads what a connection sent and runs the commands that are complete.
+static void serve_connection(Connection *conn, ParsedCommand *cmd)
+{
+  if (conn->writing)
+  {
+    send_backlog(conn);
+    return;
+  }
+
+  ssize_t bytes = read(conn->fd, conn->input + conn->used, PARSER_BUFFER_SIZE - conn->used);
+  if (bytes < 0 && (errno == EINTR || errno == EAGAIN))
+  {
+    watch_connection(conn, EPOLL_CTL_MOD);
+    return;
+  }
+
+  int closed = bytes <= 0;
+  if (!closed)
+    conn->used += (size_t)bytes;
+
+  if (!conn->started && conn->used > 0)
+  {
+    conn->started = 1;
+    if ((unsigned char)conn->input[0] == PROTOCOL_MAGIC)
+    {
+      conn->binary = 1;
+      memmove(conn->input, conn->input + 1, --conn->used);
+    }
+  }
+
+  TRACE_BEGIN("session batch", conn->sessionName);
+  size_t consumed;
+  if (conn->binary)
+  {
+    consumed = run_binary(conn, cmd);
+  }
+  else
+  {
+    // Once the client is done, an unterminated last line runs too
+    consumed = conn->used;
+    if (!closed)
+    {
+      while (consumed > 0 && conn->input[consumed - 1] != '\n')
+        consumed--;
+    }
+    if (consumed > 0)
+      run_text(conn, consumed, cmd);
+  }
+  int failed = output_flush(&conn->out);
+  TRACE_END("session batch");
+
+  if (consumed == SIZE_MAX)
+  {
+    fprintf(stderr, "Malformed frame in %s\n", conn->sessionName);
+    closed = 1;
+  }
+  else
+  {
+    memmove(conn->input, conn->input + consumed, conn->used - consumed);
+    conn->used -= consumed;
+    if (consumed == 0 && conn->used == PARSER_BUFFER_SIZE)
+    {
+      fprintf(stderr, "Line too long in %s\n", conn->sessionName);
+      closed = 1;
+    }
+  }
+
+  // The client may still read what is left after it stopped sending
+  if (!failed && output_backlog(&conn->out) > 0)
+  {
+    conn->writing = 1;
+    conn->closing = closed;
+    watch_connection(conn, EPOLL_CTL_MOD);
+  }
+  else if (closed || failed)
+    close_connection(conn);
+  else
+    watch_connection(conn, EPOLL_CTL_MOD);
+}
+
+static void *server_worker()
+{
+  // Too large for the stack of a thread
+  ParsedCommand *cmd = malloc(sizeof(ParsedCommand));
+  if (cmd == NULL)
+  {
+    fprintf(stderr, "Failed to allocate a server thread\n");
+    return NULL;
+  }
+
+  while (1)
+  {
+    pthread_mutex_lock(&server_mutex);
+    while (ready_head == NULL && !stopping)
+    {
+      pthread_cond_wait(&connection_ready, &server_mutex);
+    }
+
+    Connection *conn = ready_head;
+    if (conn == NULL)
+    {
+      // Stopping and nothing left to do
+      pthread_mutex_unlock(&server_mutex);
+      break;
+    }
+
+    ready_head = conn->next_ready;
+    if (ready_head == NULL)
+      ready_tail = NULL;
+    pthread_mutex_unlock(&server_mutex);
+
+    serve_connection(conn, cmd);
+  }
+
+  free(cmd);
+  return NULL;
+}
+
+static void queue_connection(Connection *conn)
+{
+  conn->next_ready = NULL;
+
+  pthread_mutex_lock(&server_mutex);
+  if (ready_tail == NULL)
+    ready_head = conn;
+  else
+    ready_tail->next_ready = conn;
+  ready_tail = conn;
+  pthread_cond_signal(&connection_ready);
+  pthread_mutex_unlock(&server_mutex);
+}
+
+static void accept_connections(int listen_fd, const char *directory)
+{
+  static unsigned int sessions = 0;
+
+  while (1)
+  {
+    // A client that stops reading must not block the worker writing to it
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Failed to accept a connection");
+      return;
+    }
+
+    size_t nameSize = strlen(directory) + 32;
+    Connection *conn = malloc(sizeof(Connection) + nameSize);
+    if (conn == NULL)
+    {
+      close(fd);
+      continue;
+    }
+
+    conn->fd = fd;
+    conn->started = 0;
+    conn->binary = 0;
+    conn->writing = 0;
+    conn->closing = 0;
+    conn->used = 0;
+    output_init_socket(&conn->out, fd);
+    snprintf(conn->sessionName, nameSize, "%s/session-%u.job", directory, ++sessions);
+    kvs_backup_begin(&conn->backups);
+
+    pthread_mutex_lock(&server_mutex);
+    conn->prev = NULL;
+    conn->next = open_connections;
+    if (open_connections != NULL)
+      open_connections->prev = conn;
+    open_connections = conn;
+    pthread_mutex_unlock(&server_mutex);
+
+    watch_connection(conn, EPOLL_CTL_ADD);
+  }
+}
+
+static int open_socket(const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  // Only a socket left by an earlier server is replaced
+  struct stat st;
+  if (stat(path, &st) == 0)
+  {
+    if (!S_ISSOCK(st.st_mode))
+    {
+      fprintf(stderr, "%s exists and is not a socket\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+  {
+    perror("Failed to create the socket");
+    return -1;
+  }
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+  {
+    perror("Failed to listen on the socket");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int add_watch(int fd, void *tag)
+{
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = tag};
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int server_run(const char *path, const char *directory, unsigned int workers, ServerHandler handler)
+{
+  batch_handler = handler;
+  int listen_fd = open_socket(path);
+  if (listen_fd < 0)
+    return 1;
+
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0 || pipe(signal_pipe) != 0 || add_watch(listen_fd, &listener_tag) != 0 ||
+      add_watch(signal_pipe[0], &signal_tag) != 0)
+  {
+    perror("Failed to set up the event loop");
+    close(listen_fd);
+    unlink(path);
+    return 1;
+  }
+
+  struct sigaction action, old_int, old_term, old_pipe;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, &old_int);
+  sigaction(SIGTERM, &action, &old_term);
+  // A client that goes away must not take the server with it
+  action.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &action, &old_pipe);
+
+  pthread_t *threads = malloc(workers * sizeof(pthread_t));
+  unsigned int started = 0;
+  stopping = 0;
+  while (threads != NULL && started < workers && pthread_create(&threads[started], NULL, server_worker, NULL) == 0)
+  {
+    started++;
+  }
+
+  int result = 0;
+  if (started == 0)
+  {
+    fprintf(stderr, "Failed to create server threads\n");
+    result = 1;
+  }
+
+  struct epoll_event events[SERVER_EVENTS];
+  int running = started > 0;
+  while (running)
+  {
+    int count = epoll_wait(epoll_fd, events, SERVER_EVENTS, -1);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("Failed to wait for connections");
+      break;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+      void *tag = events[i].data.ptr;
+      if (tag == &listener_tag)
+        accept_connections(listen_fd, directory);
+      else if (tag == &signal_tag)
+        running = 0;
+      else
+        queue_connection(tag);
+    }
+  }
+
+  // Connections being served finish their batch; the others are closed
+  pthread_mutex_lock(&server_mutex);
+  stopping = 1;
+  pthread_cond_broadcast(&connection_ready);
+  pthread_mutex_unlock(&server_mutex);
+  for (unsigned int i = 0; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  while (open_connections != NULL)
+  {
+    close_connection(open_connections);
+  }
+
+  sigaction(SIGINT, &old_int, NULL);
+  sigaction(SIGTERM, &old_term, NULL);
+  sigaction(SIGPIPE, &old_pipe, NULL);
+  close(signal_pipe[0]);
+  close(signal_pipe[1]);
+  close(epoll_fd);
+  close(listen_fd);
+  unlink(path);
+  return result;
+}
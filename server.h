@@ -0,0 +1,28 @@
+#ifndef KVS_SERVER_H
+#define KVS_SERVER_H
+
+#include "operations.h"
+#include "output.h"
+#include "parser.h"
+
+// Runs a command a client sent, writing its output to out.
+typedef void (*ServerHandler)(ParsedCommand *cmd, OutputBuffer *out, char *sessionName, BackupState *backups);
+
+/// Serves clients on a UNIX domain socket until SIGINT or SIGTERM. Every
+/// connection is a session that sends commands, as text or binary frames
+/// (see protocol.h), and reads back what a job would write to its .out
+/// file. An epoll loop waits on every connection; once a connection has
+/// complete commands, a worker runs them, one batch per connection at a
+/// time so that commands run in the order they were sent, and the output
+/// of the whole batch is buffered into as few writes as possible. A client
+/// that stops reading holds up only its own connection: what its socket
+/// does not take is kept until it does, and no more of its commands run.
+/// BACKUP in a session writes <directory>/session-<n>-<backup>.bck.
+/// @param path Path of the socket, replaced if it exists.
+/// @param directory Directory the backups of the sessions are written to.
+/// @param workers Number of worker threads running commands.
+/// @param handler Runs each command.
+/// @return 0 once the server stopped, 1 if it could not be started.
+int server_run(const char *path, const char *directory, unsigned int workers, ServerHandler handler);
+
+#endif // KVS_SERVER_H
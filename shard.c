@@ -0,0 +1,410 @@
+// pthread_setaffinity_np() and the CPU_* macros
+#define _GNU_SOURCE
+
+#include "shard.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mpsc.h"
+
+// Times a queue is checked again before its shard goes to sleep.
+#define SHARD_SPINS 64
+
+typedef enum ShardOp
+{
+  SHARD_WRITE,
+  SHARD_READ,
+  SHARD_DELETE,
+  SHARD_EXPIRE,
+  SHARD_SNAPSHOT,
+  // Ends the shard thread.
+  SHARD_STOP
+} ShardOp;
+
+// Batch of a job, split into a sub-request per shard. Each shard only
+// touches the entries of its own keys.
+typedef struct ShardBatch
+{
+  ShardOp op;
+  char (*keys)[MAX_STRING_SIZE];
+  char (*values)[MAX_STRING_SIZE];
+  uint64_t expires;
+  int *status;
+  // Range of a SHARD_SNAPSHOT.
+  const char *first;
+  const char *last;
+  // Sub-requests not answered yet.
+  atomic_size_t pending;
+  // Posted by the shard answering the last sub-request.
+  sem_t done;
+} ShardBatch;
+
+typedef struct ShardRequest
+{
+  MpscNode node;
+  ShardBatch *batch;
+  // Positions in the batch of the keys of the shard.
+  const uint16_t *order;
+  size_t count;
+  // Reply to a SHARD_SNAPSHOT.
+  Snapshot *snapshot;
+} ShardRequest;
+
+typedef struct Shard
+{
+  MpscQueue queue;
+  // Set by the shard thread before it sleeps on wake, cleared by the
+  // first job to queue a request meanwhile, which posts wake.
+  _Alignas(64) atomic_int sleeping;
+  sem_t wake;
+  HashTable *table;
+  unsigned int cpu;
+  pthread_t thread;
+  ShardRequest stop;
+} Shard;
+
+static Shard *shards = NULL;
+static unsigned int shard_count = 0;
+static size_t shard_budget = 0;
+// Shards wait on it until every table is created.
+static pthread_barrier_t shards_started;
+
+static unsigned int shard_of(const char *key)
+{
+  // The table uses the low bits of the hash
+  return (unsigned int)((key_hash(key) >> 32) % shard_count);
+}
+
+static StripeMask stripes_of(ShardRequest *request)
+{
+  StripeMask stripes = 0;
+  for (size_t i = 0; i < request->count; i++)
+  {
+    stripes |= (StripeMask)1 << key_stripe(request->batch->keys[request->order[i]]);
+  }
+  return stripes;
+}
+
+// Runs a sub-request on the table of the shard. Only the shard thread uses
+// the table, so its stripes are never contended; they are still taken, as
+// the table only grows when they are released.
+static void serve(Shard *shard, ShardRequest *request)
+{
+  ShardBatch *batch = request->batch;
+  HashTable *table = shard->table;
+  StripeMask stripes = batch->op == SHARD_SNAPSHOT ? ALL_STRIPES : stripes_of(request);
+  lock_stripes(table, stripes, batch->op != SHARD_READ && batch->op != SHARD_SNAPSHOT);
+
+  for (size_t i = 0; i < request->count; i++)
+  {
+    size_t key = request->order[i];
+    const char *value;
+    switch (batch->op)
+    {
+    case SHARD_WRITE:
+      batch->status[key] = write_pair(table, batch->keys[key], batch->values[key], batch->expires);
+      break;
+    case SHARD_READ:
+      // Copied, as the job must not touch the table
+      value = read_pair(table, batch->keys[key]);
+      if (value != NULL)
+        strcpy(batch->values[key], value);
+      batch->status[key] = value == NULL;
+      break;
+    case SHARD_DELETE:
+      batch->status[key] = delete_pair(table, batch->keys[key]);
+      break;
+    case SHARD_EXPIRE:
+      expire_pair(table, batch->keys[key]);
+      break;
+    case SHARD_SNAPSHOT:
+    case SHARD_STOP:
+      break;
+    }
+  }
+  if (batch->op == SHARD_SNAPSHOT)
+    request->snapshot = snapshot_range(table, batch->first, batch->last);
+
+  unlock_stripes(table, stripes);
+}
+
+// Takes the next request of a shard, sleeping while there is none.
+static ShardRequest *next_request(Shard *shard)
+{
+  while (1)
+  {
+    for (unsigned int spins = 0; spins < SHARD_SPINS; spins++)
+    {
+      MpscNode *node = mpsc_pop(&shard->queue);
+      if (node != NULL)
+        return (ShardRequest *)node;
+    }
+
+    // Checked again once asleep, so that a request queued meanwhile
+    // either is found or finds the flag set
+    atomic_store(&shard->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    MpscNode *node = mpsc_pop(&shard->queue);
+    if (node != NULL)
+    {
+      atomic_store(&shard->sleeping, 0);
+      return (ShardRequest *)node;
+    }
+    sem_wait(&shard->wake);
+  }
+}
+
+static void *shard_worker(void *arg)
+{
+  Shard *shard = arg;
+
+  // Unpinned, the shard still works, only without the locality
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(shard->cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  // Created here, so that its memory is first touched by its own core
+  shard->table = create_hash_table(0);
+  if (shard->table != NULL)
+    set_memory_budget(shard->table, shard_budget);
+  pthread_barrier_wait(&shards_started);
+  if (shard->table == NULL)
+    return NULL;
+
+  ShardRequest *request;
+  while ((request = next_request(shard))->batch->op != SHARD_STOP)
+  {
+    serve(shard, request);
+    // The request, and the batch once every request is answered, belongs
+    // to the job again
+    ShardBatch *batch = request->batch;
+    if (atomic_fetch_sub_explicit(&batch->pending, 1, memory_order_acq_rel) == 1)
+      sem_post(&batch->done);
+  }
+  return NULL;
+}
+
+static void send_request(Shard *shard, ShardRequest *request)
+{
+  mpsc_push(&shard->queue, &request->node);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_exchange(&shard->sleeping, 0))
+    sem_post(&shard->wake);
+}
+
+// Sends the keys of a batch to their shards, or a request to every shard
+// if there are no keys, and waits for every reply.
+// @param requests Array of SHARD_MAX requests, to send and get replies in.
+static void run_batch(ShardBatch *batch, size_t num_keys, ShardRequest requests[])
+{
+  // Keys grouped by shard, in the order of the batch within each shard
+  unsigned int owner[MAX_WRITE_SIZE];
+  size_t start[SHARD_MAX + 1] = {0};
+  for (size_t i = 0; i < num_keys; i++)
+  {
+    owner[i] = shard_of(batch->keys[i]);
+    start[owner[i] + 1]++;
+  }
+  for (unsigned int s = 0; s < shard_count; s++)
+  {
+    start[s + 1] += start[s];
+  }
+  uint16_t order[MAX_WRITE_SIZE];
+  size_t filled[SHARD_MAX];
+  memcpy(filled, start, sizeof(filled));
+  for (size_t i = 0; i < num_keys; i++)
+  {
+    order[filled[owner[i]]++] = (uint16_t)i;
+  }
+
+  size_t pending = 0;
+  for (unsigned int s = 0; s < shard_count; s++)
+  {
+    requests[s].count = start[s + 1] - start[s];
+    pending += num_keys == 0 || requests[s].count > 0;
+  }
+  atomic_init(&batch->pending, pending);
+  sem_init(&batch->done, 0, 0);
+
+  for (unsigned int s = 0; s < shard_count; s++)
+  {
+    if (num_keys > 0 && requests[s].count == 0)
+      continue;
+    requests[s].batch = batch;
+    requests[s].order = order + start[s];
+    requests[s].snapshot = NULL;
+    send_request(&shards[s], &requests[s]);
+  }
+
+  // Sleeping leaves the cores to the shards
+  while (sem_wait(&batch->done) != 0 && errno == EINTR)
+    continue;
+  sem_destroy(&batch->done);
+}
+
+int shard_start(unsigned int count, size_t memory_budget)
+{
+  if (count == 0 || count > SHARD_MAX)
+    return 1;
+
+  shards = calloc(count, sizeof(Shard));
+  if (shards == NULL)
+    return 1;
+  shard_budget = memory_budget / count;
+  if (memory_budget > 0 && shard_budget == 0)
+    shard_budget = 1;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_barrier_init(&shards_started, NULL, count + 1);
+  unsigned int started;
+  for (started = 0; started < count; started++)
+  {
+    Shard *shard = &shards[started];
+    mpsc_init(&shard->queue);
+    atomic_init(&shard->sleeping, 0);
+    sem_init(&shard->wake, 0, 0);
+    shard->cpu = cpus > 0 ? started % (unsigned int)cpus : 0;
+    if (pthread_create(&shard->thread, NULL, shard_worker, shard) != 0)
+    {
+      perror("Failed to create shard thread");
+      sem_destroy(&shard->wake);
+      break;
+    }
+  }
+
+  if (started < count)
+  {
+    // The barrier cannot be released without every thread: the ones
+    // started are left waiting until the process exits
+    return 1;
+  }
+  pthread_barrier_wait(&shards_started);
+  pthread_barrier_destroy(&shards_started);
+
+  shard_count = count;
+  for (unsigned int s = 0; s < count; s++)
+  {
+    if (shards[s].table == NULL)
+    {
+      shard_stop();
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void shard_stop()
+{
+  for (unsigned int s = 0; s < shard_count; s++)
+  {
+    Shard *shard = &shards[s];
+    // Threads without a table have already ended
+    if (shard->table != NULL)
+    {
+      static ShardBatch stop = {.op = SHARD_STOP};
+      shard->stop.batch = &stop;
+      send_request(shard, &shard->stop);
+    }
+    pthread_join(shard->thread, NULL);
+    if (shard->table != NULL)
+      free_table(shard->table);
+    sem_destroy(&shard->wake);
+  }
+  free(shards);
+  shards = NULL;
+  shard_count = 0;
+}
+
+void shard_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], uint64_t expires,
+                 int status[])
+{
+  ShardRequest requests[SHARD_MAX];
+  ShardBatch batch = {.op = SHARD_WRITE, .keys = keys, .values = values, .expires = expires, .status = status};
+  run_batch(&batch, num_pairs, requests);
+}
+
+void shard_read(size_t num_keys, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int status[])
+{
+  ShardRequest requests[SHARD_MAX];
+  ShardBatch batch = {.op = SHARD_READ, .keys = keys, .values = values, .status = status};
+  run_batch(&batch, num_keys, requests);
+}
+
+void shard_delete(size_t num_keys, char keys[][MAX_STRING_SIZE], int status[])
+{
+  ShardRequest requests[SHARD_MAX];
+  ShardBatch batch = {.op = SHARD_DELETE, .keys = keys, .status = status};
+  run_batch(&batch, num_keys, requests);
+}
+
+void shard_expire(const char *key)
+{
+  char keys[1][MAX_STRING_SIZE];
+  strcpy(keys[0], key);
+  ShardRequest requests[SHARD_MAX];
+  ShardBatch batch = {.op = SHARD_EXPIRE, .keys = keys};
+  run_batch(&batch, 1, requests);
+}
+
+Snapshot *shard_snapshot(const char *first, const char *last)
+{
+  ShardRequest requests[SHARD_MAX];
+  ShardBatch batch = {.op = SHARD_SNAPSHOT, .first = first, .last = last};
+  run_batch(&batch, 0, requests);
+
+  // No key is in two shards, so sorting the copies together is enough
+  size_t count = 0;
+  int failed = 0;
+  for (unsigned int s = 0; s < shard_count; s++)
+  {
+    if (requests[s].snapshot == NULL)
+      failed = 1;
+    else
+      count += requests[s].snapshot->count;
+  }
+
+  Snapshot *snapshot = failed ? NULL : malloc(sizeof(Snapshot) + count * sizeof(KeyValue));
+  if (snapshot != NULL)
+  {
+    snapshot->count = 0;
+    for (unsigned int s = 0; s < shard_count; s++)
+    {
+      memcpy(snapshot->pairs + snapshot->count, requests[s].snapshot->pairs,
+             requests[s].snapshot->count * sizeof(KeyValue));
+      snapshot->count += requests[s].snapshot->count;
+    }
+    sort_snapshot(snapshot);
+  }
+
+  for (unsigned int s = 0; s < shard_count; s++)
+  {
+    free(requests[s].snapshot);
+  }
+  return snapshot;
+}
+
+void shard_memory_usage(MemoryUsage *usage)
+{
+  // The counters are meant to be read without locks, from any thread
+  *usage = (MemoryUsage){0};
+  for (unsigned int s = 0; s < shard_count; s++)
+  {
+    MemoryUsage shardUsage;
+    memory_usage(shards[s].table, &shardUsage);
+    usage->node_bytes += shardUsage.node_bytes;
+    usage->index_bytes += shardUsage.index_bytes;
+    usage->key_bytes += shardUsage.key_bytes;
+    usage->value_bytes += shardUsage.value_bytes;
+    usage->budget += shardUsage.budget;
+    usage->evictions += shardUsage.evictions;
+  }
+}
@@ -0,0 +1,71 @@
+#ifndef KVS_SHARD_H
+#define KVS_SHARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "kvs.h"
+
+// Most shards, and so shard threads, there can be.
+#define SHARD_MAX 64
+
+// Shared-nothing execution. The keys are split by hash into shards, each
+// a table of its own, with its own allocator, owned by a thread pinned to
+// a core: only that thread ever touches the table. Job threads hand the
+// keys of a batch to the shards owning them over lock-free queues (see
+// mpsc.h), a single sub-request per shard, and wait for the replies, so no
+// lock nor table memory is shared between cores. A batch is atomic on
+// each shard, not across shards.
+
+/// Starts the shard threads, each creating its table.
+/// @param count Number of shards, up to SHARD_MAX.
+/// @param memory_budget Bytes the pairs of all the shards may hold, split
+/// evenly between them (see set_memory_budget), 0 for no limit.
+/// @return 0 if every shard was started successfully, 1 otherwise.
+int shard_start(unsigned int count, size_t memory_budget);
+
+/// Stops the shard threads and frees their tables. No batch may be in
+/// progress.
+void shard_stop();
+
+/// Writes a batch of pairs.
+/// @param num_pairs Number of pairs.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+/// @param expires Time the pairs expire at, as in write_pair.
+/// @param status Array to store the result of write_pair for each pair in.
+void shard_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], uint64_t expires,
+                 int status[]);
+
+/// Reads a batch of keys.
+/// @param num_keys Number of keys.
+/// @param keys Array of keys' strings.
+/// @param values Array to copy the values read in.
+/// @param status Array to store, for each key, 0 if it was found and 1 if
+/// it was not.
+void shard_read(size_t num_keys, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int status[]);
+
+/// Deletes a batch of keys.
+/// @param num_keys Number of keys.
+/// @param keys Array of keys' strings.
+/// @param status Array to store the result of delete_pair for each key in.
+void shard_delete(size_t num_keys, char keys[][MAX_STRING_SIZE], int status[]);
+
+/// Removes a pair if it has expired, as expire_pair.
+/// @param key Key of the pair.
+void shard_expire(const char *key);
+
+/// Copies the live pairs whose keys are within a range, in key order. Each
+/// shard is copied at a single point in time, but not all at the same one.
+/// @param first Lowest key of the range, NULL for no lower bound.
+/// @param last Highest key of the range, NULL for no upper bound.
+/// @return Newly allocated snapshot (to be freed by the caller), NULL on
+/// failure.
+Snapshot *shard_snapshot(const char *first, const char *last);
+
+/// Adds up the memory held by the pairs of every shard, as memory_usage.
+/// @param usage Pointer to store the usage in.
+void shard_memory_usage(MemoryUsage *usage);
+
+#endif // KVS_SHARD_H
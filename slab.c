@@ -0,0 +1,166 @@
+#include "slab.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Slabs are linked through their first bytes, followed by the objects,
+// which start on a cache line.
+typedef struct Slab
+{
+  struct Slab *next;
+  _Alignas(SLAB_ALIGN) char objects[];
+} Slab;
+
+// Free objects are linked through their first bytes.
+typedef struct FreeObject
+{
+  struct FreeObject *next;
+} FreeObject;
+
+static atomic_size_t next_cache = 0;
+static _Thread_local size_t cache_index = SIZE_MAX;
+
+static SlabCache *cache_of(SlabPool *pool)
+{
+  if (cache_index == SIZE_MAX)
+    cache_index = atomic_fetch_add(&next_cache, 1) % SLAB_CACHES;
+
+  return &pool->caches[cache_index];
+}
+
+void slab_init(SlabPool *pool, size_t object_size)
+{
+  // Keep every object aligned to a pointer
+  pool->object_size = (object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->slabs = NULL;
+  pool->free_list = NULL;
+
+  for (size_t i = 0; i < SLAB_CACHES; i++)
+  {
+    pthread_mutex_init(&pool->caches[i].lock, NULL);
+    pool->caches[i].free_list = NULL;
+    pool->caches[i].free_count = 0;
+  }
+}
+
+// Refills an empty cache, with objects given back by other caches if
+// there are any, or with a new slab.
+// @return 0 if the cache was refilled, 1 otherwise.
+static int refill_cache(SlabPool *pool, SlabCache *cache)
+{
+  pthread_mutex_lock(&pool->lock);
+
+  if (pool->free_list != NULL)
+  {
+    // Take up to a slab worth of objects
+    FreeObject *first = pool->free_list;
+    FreeObject *last = first;
+    size_t count = 1;
+    while (last->next != NULL && count < SLAB_OBJECTS)
+    {
+      last = last->next;
+      count++;
+    }
+
+    pool->free_list = last->next;
+    pthread_mutex_unlock(&pool->lock);
+
+    last->next = NULL;
+    cache->free_list = first;
+    cache->free_count = count;
+    return 0;
+  }
+
+  // aligned_alloc wants a multiple of the alignment
+  size_t size = (sizeof(Slab) + pool->object_size * SLAB_OBJECTS + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+  Slab *slab = aligned_alloc(SLAB_ALIGN, size);
+  if (slab == NULL)
+  {
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+  }
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+  pthread_mutex_unlock(&pool->lock);
+
+  FreeObject *free_list = NULL;
+  for (size_t i = SLAB_OBJECTS; i-- > 0;)
+  {
+    FreeObject *object = (FreeObject *)(void *)(slab->objects + i * pool->object_size);
+    object->next = free_list;
+    free_list = object;
+  }
+  cache->free_list = free_list;
+  cache->free_count = SLAB_OBJECTS;
+  return 0;
+}
+
+void *slab_alloc(SlabPool *pool)
+{
+  SlabCache *cache = cache_of(pool);
+  pthread_mutex_lock(&cache->lock);
+
+  if (cache->free_list == NULL && refill_cache(pool, cache))
+  {
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+  }
+
+  FreeObject *object = cache->free_list;
+  cache->free_list = object->next;
+  cache->free_count--;
+
+  pthread_mutex_unlock(&cache->lock);
+  return object;
+}
+
+void slab_free(SlabPool *pool, void *object)
+{
+  SlabCache *cache = cache_of(pool);
+  pthread_mutex_lock(&cache->lock);
+
+  FreeObject *freed = object;
+  freed->next = cache->free_list;
+  cache->free_list = freed;
+  cache->free_count++;
+
+  // A thread that mostly deletes gives objects back for others to reuse
+  if (cache->free_count >= 2 * SLAB_OBJECTS)
+  {
+    FreeObject *first = cache->free_list;
+    FreeObject *last = first;
+    for (size_t i = 1; i < SLAB_OBJECTS; i++)
+      last = last->next;
+
+    cache->free_list = last->next;
+    cache->free_count -= SLAB_OBJECTS;
+
+    pthread_mutex_lock(&pool->lock);
+    last->next = pool->free_list;
+    pool->free_list = first;
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void slab_destroy(SlabPool *pool)
+{
+  Slab *slab = pool->slabs;
+  while (slab != NULL)
+  {
+    Slab *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  pool->slabs = NULL;
+  pool->free_list = NULL;
+
+  for (size_t i = 0; i < SLAB_CACHES; i++)
+  {
+    pthread_mutex_destroy(&pool->caches[i].lock);
+  }
+  pthread_mutex_destroy(&pool->lock);
+}
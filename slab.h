@@ -0,0 +1,55 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Number of per-thread caches in a pool. Threads are spread over them, so
+// unless there are more threads than caches each one has its own.
+#define SLAB_CACHES 64
+// Number of objects allocated at once when a cache runs dry.
+#define SLAB_OBJECTS 256
+// Alignment of the slabs: a cache line.
+#define SLAB_ALIGN 64
+
+typedef struct SlabCache
+{
+  _Alignas(64) pthread_mutex_t lock;
+  void *free_list;
+  size_t free_count;
+} SlabCache;
+
+// Allocator of fixed-size objects, carved from large slabs. Freed objects
+// go to the cache of the freeing thread and are reused before new slabs
+// are allocated. All the memory is released at once by slab_destroy.
+typedef struct SlabPool
+{
+  size_t object_size;
+  pthread_mutex_t lock;
+  void *slabs;     // Every slab allocated, to be released by slab_destroy
+  void *free_list; // Objects given back by caches holding too many
+  SlabCache caches[SLAB_CACHES];
+} SlabPool;
+
+/// Initializes an empty pool.
+/// @param pool Pool to initialize.
+/// @param object_size Size of the objects, at least the size of a pointer.
+/// Objects whose size is a multiple of SLAB_ALIGN, such as those of types
+/// aligned to it, start on a cache line; the others on a pointer.
+void slab_init(SlabPool *pool, size_t object_size);
+
+/// Allocates an object from the pool.
+/// @param pool Pool to allocate from.
+/// @return Uninitialized object, NULL on failure.
+void *slab_alloc(SlabPool *pool);
+
+/// Gives an object back to the pool.
+/// @param pool Pool the object was allocated from.
+/// @param object Object to be freed.
+void slab_free(SlabPool *pool, void *object);
+
+/// Frees every slab of the pool, including objects still in use.
+/// @param pool Pool to be destroyed.
+void slab_destroy(SlabPool *pool);
+
+#endif // KVS_SLAB_H
@@ -0,0 +1,156 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+static int write_string(OutputBuffer *out, const char *str)
+{
+  size_t len = strlen(str);
+  uint8_t len8 = (uint8_t)len;
+  return output_append(out, (const char *)&len8, 1) || output_append(out, str, len);
+}
+
+int write_binary_snapshot(const Snapshot *snapshot, OutputBuffer *out)
+{
+  uint64_t count = snapshot->count;
+  if (output_append(out, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) ||
+      output_append(out, (const char *)&count, sizeof(count)))
+    return 1;
+
+  for (size_t i = 0; i < snapshot->count; i++)
+  {
+    const KeyValue *pair = &snapshot->pairs[i];
+    // The wall clock, as the clock of the table restarts with the process
+    uint64_t expires_at = pair->expires != 0 ? stats_wall_ms(pair->expires) : 0;
+    if (write_string(out, pair->key) || write_string(out, pair->value) ||
+        output_append(out, (const char *)&expires_at, sizeof(expires_at)))
+      return 1;
+  }
+
+  return 0;
+}
+
+// Reads a length-prefixed string from the mapped file.
+// @return 0 if the string was read successfully, 1 if it is truncated or
+// does not fit in MAX_STRING_SIZE.
+static int read_string(const char **p, const char *end, char *dest)
+{
+  if (*p >= end)
+    return 1;
+
+  size_t len = (uint8_t)**p;
+  (*p)++;
+  if (len >= MAX_STRING_SIZE || (size_t)(end - *p) < len)
+    return 1;
+
+  memcpy(dest, *p, len);
+  dest[len] = '\0';
+  *p += len;
+  return 0;
+}
+
+// Inserts every pair of a mapped snapshot into a new table.
+static HashTable *load_pairs(const char *data, size_t size)
+{
+  uint64_t count;
+  if (size < SNAPSHOT_MAGIC_SIZE + sizeof(count) ||
+      (memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0 &&
+       memcmp(data, SNAPSHOT_MAGIC_V1, SNAPSHOT_MAGIC_SIZE) != 0))
+  {
+    fprintf(stderr, "Not a KVS snapshot\n");
+    return NULL;
+  }
+  int deadlines = memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) == 0;
+  memcpy(&count, data + SNAPSHOT_MAGIC_SIZE, sizeof(count));
+
+  // Each pair takes at least its two length bytes, and its deadline
+  const char *p = data + SNAPSHOT_MAGIC_SIZE + sizeof(count);
+  const char *end = data + size;
+  size_t min_pair = 2 + (deadlines ? sizeof(uint64_t) : 0);
+  if (count > (uint64_t)(end - p) / min_pair)
+  {
+    fprintf(stderr, "Corrupted KVS snapshot\n");
+    return NULL;
+  }
+
+  HashTable *ht = create_hash_table((size_t)count);
+  if (ht == NULL)
+    return NULL;
+
+  // Nothing else can see the table yet
+  lock_stripes(ht, ALL_STRIPES, 1);
+  for (uint64_t i = 0; i < count; i++)
+  {
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+    uint64_t expires_at = 0;
+    int failed = read_string(&p, end, key) || read_string(&p, end, value);
+    if (!failed && deadlines)
+    {
+      failed = (size_t)(end - p) < sizeof(expires_at);
+      if (!failed)
+      {
+        memcpy(&expires_at, p, sizeof(expires_at));
+        p += sizeof(expires_at);
+      }
+    }
+
+    uint64_t expires = 0;
+    if (!failed && expires_at != 0)
+    {
+      expires = stats_from_wall_ms(expires_at);
+      if (expires == 0)
+        continue; // Expired since the snapshot was taken
+    }
+
+    if (failed || write_pair(ht, key, value, expires))
+    {
+      fprintf(stderr, "Corrupted KVS snapshot\n");
+      unlock_stripes(ht, ALL_STRIPES);
+      free_table(ht);
+      return NULL;
+    }
+  }
+  unlock_stripes(ht, ALL_STRIPES);
+
+  return ht;
+}
+
+HashTable *load_binary_snapshot(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    perror(path);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0)
+  {
+    fprintf(stderr, "Empty KVS snapshot %s\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    perror(path);
+    return NULL;
+  }
+  posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+
+  HashTable *ht = load_pairs(data, size);
+  munmap(data, size);
+  return ht;
+}
@@ -0,0 +1,34 @@
+#ifndef KVS_SNAPSHOT_H
+#define KVS_SNAPSHOT_H
+
+#include "kvs.h"
+#include "output.h"
+
+// Binary snapshot format, in host byte order:
+//   "KVSSNAP2"              8-byte magic
+//   uint64_t count          number of pairs
+//   count times:
+//     uint8_t key_len, key bytes, uint8_t value_len, value bytes,
+//     uint64_t expires_at   wall-clock milliseconds since the epoch the
+//                           pair expires at, 0 if it never does
+// Keys and values are not null-terminated in the file. Snapshots with the
+// "KVSSNAP1" magic lack expires_at, and are still loaded.
+#define SNAPSHOT_MAGIC "KVSSNAP2"
+#define SNAPSHOT_MAGIC_V1 "KVSSNAP1"
+#define SNAPSHOT_MAGIC_SIZE 8
+
+/// Writes a snapshot in the binary format.
+/// @param snapshot Snapshot to be written.
+/// @param out Output buffer to write to.
+/// @return 0 if the snapshot was written successfully, 1 otherwise.
+int write_binary_snapshot(const Snapshot *snapshot, OutputBuffer *out);
+
+/// Maps a binary snapshot file and loads it into a new table, sized to
+/// hold every pair without growing. Pairs that have expired since are left
+/// out; the others keep their deadline, but are not scheduled for removal
+/// (see expiry_schedule).
+/// @param path Path of the snapshot file.
+/// @return Newly created hash table, NULL on failure.
+HashTable *load_binary_snapshot(const char *path);
+
+#endif // KVS_SNAPSHOT_H
@@ -0,0 +1,190 @@
+#include "stats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "histogram.h"
+#include "registry.h"
+
+typedef struct TimeCounter
+{
+  _Atomic uint64_t count;
+  _Atomic uint64_t total_ns;
+} TimeCounter;
+
+typedef struct ThreadStats
+{
+  ThreadRecord record;
+  Histogram commands[STATS_COMMANDS];
+  TimeCounter parse;
+  TimeCounter lock_wait;
+  TimeCounter backup_wait;
+} ThreadStats;
+
+static const char *const command_names[STATS_COMMANDS] = {
+    "WRITE", "READ", "DELETE", "SHOW", "SCAN", "BACKUP"};
+
+static const char *const output_names[OUTPUT_KINDS] = {"job", "backup", "wal", "session", "report"};
+
+// Counters of every thread that recorded anything.
+static ThreadRegistry threads = THREAD_REGISTRY_INITIALIZER;
+static _Thread_local ThreadRecord *local_stats = NULL;
+
+// Writes go through system calls anyway, so these are shared.
+static _Atomic uint64_t output_bytes[OUTPUT_KINDS];
+static _Atomic uint64_t output_ns[OUTPUT_KINDS];
+
+// @return Counters of the calling thread, NULL if they cannot be
+// allocated (and nothing is recorded).
+static ThreadStats *thread_stats()
+{
+  return thread_registry_get(&threads, &local_stats, sizeof(ThreadStats));
+}
+
+static uint64_t load(const _Atomic uint64_t *counter)
+{
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Only the owning thread updates its counters.
+static void add(_Atomic uint64_t *counter, uint64_t value)
+{
+  atomic_store_explicit(counter, load(counter) + value, memory_order_relaxed);
+}
+
+static void record_time(TimeCounter *counter, uint64_t ns)
+{
+  add(&counter->count, 1);
+  add(&counter->total_ns, ns);
+}
+
+uint64_t stats_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Milliseconds since the epoch.
+static uint64_t wall_now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+uint64_t stats_wall_ms(uint64_t time)
+{
+  uint64_t now = stats_now();
+  uint64_t left_ns = time > now ? time - now : 0;
+  return wall_now_ms() + (left_ns + 999999) / 1000000;
+}
+
+uint64_t stats_from_wall_ms(uint64_t wall_ms)
+{
+  uint64_t now_ms = wall_now_ms();
+  if (wall_ms <= now_ms)
+    return 0;
+  return stats_now() + (wall_ms - now_ms) * 1000000;
+}
+
+void stats_command(StatsCommand command, uint64_t ns)
+{
+  ThreadStats *stats = thread_stats();
+  if (stats != NULL)
+    histogram_record(&stats->commands[command], ns);
+}
+
+void stats_parse(uint64_t ns)
+{
+  ThreadStats *stats = thread_stats();
+  if (stats != NULL)
+    record_time(&stats->parse, ns);
+}
+
+void stats_lock_wait(uint64_t ns)
+{
+  ThreadStats *stats = thread_stats();
+  if (stats != NULL)
+    record_time(&stats->lock_wait, ns);
+}
+
+void stats_backup_wait(uint64_t ns)
+{
+  ThreadStats *stats = thread_stats();
+  if (stats != NULL)
+    record_time(&stats->backup_wait, ns);
+}
+
+void stats_output(OutputKind kind, size_t bytes, uint64_t ns)
+{
+  atomic_fetch_add_explicit(&output_bytes[kind], bytes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&output_ns[kind], ns, memory_order_relaxed);
+}
+
+static void report_time(OutputBuffer *out, const char *name, uint64_t count, uint64_t total_ns)
+{
+  char line[128];
+  int len = snprintf(line, sizeof(line), "(%s, count=%" PRIu64 ", total_ns=%" PRIu64 ")\n", name, count, total_ns);
+  output_append(out, line, (size_t)len);
+}
+
+void stats_report(OutputBuffer *out)
+{
+  // Added up into private copies first, so that the report is written
+  // from counters that no longer change
+  ThreadStats *total = calloc(1, sizeof(ThreadStats));
+  if (total == NULL)
+  {
+    fprintf(stderr, "Failed to allocate the statistics report\n");
+    return;
+  }
+
+  for (ThreadStats *stats = (ThreadStats *)thread_registry_first(&threads); stats != NULL;
+       stats = (ThreadStats *)stats->record.next)
+  {
+    for (int command = 0; command < STATS_COMMANDS; command++)
+    {
+      histogram_merge(&total->commands[command], &stats->commands[command]);
+    }
+    add(&total->parse.count, load(&stats->parse.count));
+    add(&total->parse.total_ns, load(&stats->parse.total_ns));
+    add(&total->lock_wait.count, load(&stats->lock_wait.count));
+    add(&total->lock_wait.total_ns, load(&stats->lock_wait.total_ns));
+    add(&total->backup_wait.count, load(&stats->backup_wait.count));
+    add(&total->backup_wait.total_ns, load(&stats->backup_wait.total_ns));
+  }
+
+  char line[256];
+  for (int command = 0; command < STATS_COMMANDS; command++)
+  {
+    Histogram *histogram = &total->commands[command];
+    int len = snprintf(line, sizeof(line),
+                       "(%s, count=%" PRIu64 ", p50_ns=%" PRIu64 ", p99_ns=%" PRIu64 ", p999_ns=%" PRIu64
+                       ", max_ns=%" PRIu64 ")\n",
+                       command_names[command], load(&histogram->count),
+                       histogram_percentile(histogram, 50), histogram_percentile(histogram, 99),
+                       histogram_percentile(histogram, 99.9), load(&histogram->max));
+    output_append(out, line, (size_t)len);
+  }
+
+  report_time(out, "parse", load(&total->parse.count), load(&total->parse.total_ns));
+  report_time(out, "lock_wait", load(&total->lock_wait.count), load(&total->lock_wait.total_ns));
+  report_time(out, "backup_wait", load(&total->backup_wait.count), load(&total->backup_wait.total_ns));
+  free(total);
+
+  for (int kind = 0; kind < OUTPUT_KINDS; kind++)
+  {
+    uint64_t bytes = load(&output_bytes[kind]);
+    if (bytes == 0)
+      continue;
+
+    int len = snprintf(line, sizeof(line), "(output=%s, bytes=%" PRIu64 ", write_ns=%" PRIu64 ")\n",
+                       output_names[kind], bytes, load(&output_ns[kind]));
+    output_append(out, line, (size_t)len);
+  }
+}
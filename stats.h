@@ -0,0 +1,68 @@
+#ifndef KVS_STATS_H
+#define KVS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "output.h"
+
+// Runtime instrumentation. Each thread records into counters of its own,
+// with plain stores, so recording never contends; reports add up the
+// counters of every thread that recorded anything.
+
+typedef enum StatsCommand
+{
+  STATS_WRITE,
+  STATS_READ,
+  STATS_DELETE,
+  STATS_SHOW,
+  STATS_SCAN,
+  STATS_BACKUP,
+  STATS_COMMANDS
+} StatsCommand;
+
+/// Gets a monotonic timestamp to measure durations with.
+/// @return Nanoseconds since an arbitrary point.
+uint64_t stats_now();
+
+/// Converts a timestamp of stats_now to the wall clock, which is what
+/// survives a restart.
+/// @param time Timestamp, as given by stats_now.
+/// @return Milliseconds since the epoch, rounded up.
+uint64_t stats_wall_ms(uint64_t time);
+
+/// Converts a time on the wall clock back to a timestamp of stats_now.
+/// @param wall_ms Milliseconds since the epoch.
+/// @return Timestamp, 0 if the time has already passed.
+uint64_t stats_from_wall_ms(uint64_t wall_ms);
+
+/// Records the latency of a command.
+/// @param command Type of the command.
+/// @param ns Nanoseconds the command took.
+void stats_command(StatsCommand command, uint64_t ns);
+
+/// Records the time spent parsing a command.
+/// @param ns Nanoseconds spent.
+void stats_parse(uint64_t ns);
+
+/// Records the time spent blocked on a stripe lock held by another thread.
+/// @param ns Nanoseconds spent.
+void stats_lock_wait(uint64_t ns);
+
+/// Records the time spent waiting for a backup slot.
+/// @param ns Nanoseconds spent.
+void stats_backup_wait(uint64_t ns);
+
+/// Records data written to an output.
+/// @param kind What was written to.
+/// @param bytes Number of bytes written.
+/// @param ns Nanoseconds spent writing.
+void stats_output(OutputKind kind, size_t bytes, uint64_t ns);
+
+/// Writes a report of everything recorded so far, one "(name, ...)" line
+/// per counter: a latency histogram per command, then the time spent
+/// parsing and waiting, then the bytes written per kind of output.
+/// @param out Output buffer to write the report to.
+void stats_report(OutputBuffer *out);
+
+#endif // KVS_STATS_H
@@ -0,0 +1,55 @@
+# Executable path
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable> [compact executable]"
+    exit 1
+fi
+executable=$1
+compact=${2:-kvs-compact}
+
+test_dir="tests-public/jobs3"
+results_dir="tests-public/results3"
+
+# Run each job with full and with delta backups, and check that every delta
+# chain compacts into the matching full backup
+for job_folder in "$test_dir"/*/; do
+    result=$(basename "$job_folder")
+    full_dir=$(mktemp -d)
+    delta_dir=$(mktemp -d)
+    cp "$job_folder"*.job "$full_dir"
+    cp "$job_folder"*.job "$delta_dir"
+
+    echo -e "\e[34mRunning executable: $executable $job_folder 1 1 [--delta-backups]\e[0m"
+    if ! ./"$executable" "$full_dir" 1 1 > /dev/null || ! ./"$executable" "$delta_dir" 1 1 --delta-backups > /dev/null; then
+        echo -e "\e[31mExecutable failed\e[0m"
+        exit 1
+    fi
+
+    for output_file in "$delta_dir"/*.out; do
+        filename=$(basename "$output_file" .out)
+        result_file="${results_dir}/${result}/${filename}.result"
+        if diff "$output_file" "$result_file"; then
+            echo -e "\e[32mTest passed for $filename in $job_folder\e[0m"
+        else
+            echo -e "\e[31mTest failed for $filename in $job_folder\e[0m"
+        fi
+
+        for full_file in "$full_dir/$filename"-*.bck; do
+            backup=$(basename "$full_file" .bck)
+            number=${backup##*-}
+            # Backups are full every 16, deltas in between
+            base=$(( (number - 1) / 16 * 16 + 1 ))
+            chain="$delta_dir/$filename-$base.bck"
+            for ((i = base + 1; i <= number; i++)); do
+                chain="$chain $delta_dir/$filename-$i.delta"
+            done
+
+            if ./"$compact" "$delta_dir/compacted.bck" $chain && diff "$delta_dir/compacted.bck" "$full_file"; then
+                echo -e "\e[32mTest passed for $backup compacted in $job_folder\e[0m"
+            else
+                echo -e "\e[31mTest failed for $backup compacted in $job_folder\e[0m"
+            fi
+        done
+    done
+
+    rm -rf "$full_dir" "$delta_dir"
+done
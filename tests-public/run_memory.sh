@@ -0,0 +1,60 @@
+# Executable path
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit 1
+fi
+executable=$1
+
+test_dir="tests-public/jobs"
+default_dir=$(mktemp -d)
+budget_dir=$(mktemp -d)
+tiny_dir=$(mktemp -d)
+evict_dir=$(mktemp -d)
+
+# Each pair is read right after it is written, so not even a budget too
+# small for more than a pair per stripe may evict it before the READ
+awk 'BEGIN {
+    for (i = 0; i < 4000; i++) {
+        printf "WRITE [(key%d,val%d)]\n", i, i % 101
+        printf "READ [key%d]\n", i
+    }
+}' > "$tiny_dir/evict.job"
+
+cp "$test_dir"/*.job "$default_dir"
+cp "$tiny_dir/evict.job" "$evict_dir"
+cp "$test_dir"/*.job "$budget_dir"
+
+echo -e "\e[34mRunning executable: $executable <dir> 1 1 [--memory=BYTES]\e[0m"
+# The jobs of a directory share the table, so the generated one runs apart
+if ! ./"$executable" "$default_dir" 1 1 &> /dev/null || ! ./"$executable" "$evict_dir" 1 1 &> /dev/null ||
+    ! ./"$executable" "$budget_dir" 1 1 --memory=64M &> /dev/null ||
+    ! ./"$executable" "$tiny_dir" 1 1 --memory=16K &> /dev/null; then
+    echo -e "\e[31mExecutable failed\e[0m"
+    rm -rf "$default_dir" "$budget_dir" "$tiny_dir" "$evict_dir"
+    exit 1
+fi
+
+# Nothing is evicted within a budget the jobs do not reach
+for output_file in "$budget_dir"/*.out; do
+    filename=$(basename "$output_file" .out)
+    if diff "$output_file" "$default_dir/$filename.out"; then
+        echo -e "\e[32mTest passed for $filename with --memory=64M\e[0m"
+    else
+        echo -e "\e[31mTest failed for $filename with --memory=64M\e[0m"
+    fi
+done
+
+if diff -q "$tiny_dir/evict.out" "$evict_dir/evict.out" > /dev/null; then
+    echo -e "\e[32mTest passed for evict with --memory=16K\e[0m"
+else
+    echo -e "\e[31mTest failed for evict with --memory=16K\e[0m"
+fi
+
+# Evictions would be recorded as deletes in delta backups
+if ./"$executable" "$tiny_dir" 1 1 --memory=16K --delta-backups > /dev/null 2>&1; then
+    echo -e "\e[31mTest failed for --memory with --delta-backups\e[0m"
+else
+    echo -e "\e[32mTest passed for --memory with --delta-backups\e[0m"
+fi
+
+rm -rf "$default_dir" "$budget_dir" "$tiny_dir" "$evict_dir"
@@ -0,0 +1,84 @@
+# Executable path
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable> [client executable]"
+    exit 1
+fi
+executable=$1
+client=${2:-kvs-client}
+
+test_dir="tests-public/jobs"
+
+passed() {
+    echo -e "\e[32mTest passed for $1\e[0m"
+}
+
+failed() {
+    echo -e "\e[31mTest failed for $1\e[0m"
+}
+
+# Runs a job through a server of its own, as a client sending it as text or
+# (with --binary) as binary frames
+serve() {
+    local job=$1 output=$2 work_dir
+    shift 2
+    work_dir=$(mktemp -d)
+    ./"$executable" "$work_dir" 1 1 --serve="$work_dir/socket" &> /dev/null &
+    local server=$!
+    for _ in $(seq 50); do
+        [ -S "$work_dir/socket" ] && break
+        sleep 0.1
+    done
+
+    # Errors are sent to the client, where a job writes them to stderr
+    ./"$client" "$@" "$work_dir/socket" "$job" 2> /dev/null | grep -v '^Invalid command. See HELP for usage$' > "$output"
+    kill -INT "$server"
+    wait "$server"
+    rm -rf "$work_dir"
+}
+
+# Each job runs alone, as the jobs of a directory share the table, in the
+# default sequential mode and then in each of the others
+for file in "$test_dir"/*.job; do
+    filename=$(basename "$file" .job)
+    expected_dir=$(mktemp -d)
+    shards_dir=$(mktemp -d)
+    pipeline_dir=$(mktemp -d)
+    cp "$file" "$expected_dir"
+    cp "$file" "$shards_dir"
+    cp "$file" "$pipeline_dir"
+
+    echo -e "\e[34mRunning executable: $executable <dir> 1 1 [--shards=4 | --pipeline | --serve=SOCKET] for $filename\e[0m"
+    if ! ./"$executable" "$expected_dir" 1 1 &> /dev/null; then
+        echo -e "\e[31mExecutable failed\e[0m"
+        exit 1
+    fi
+    expected="$expected_dir/$filename.out"
+
+    if ./"$executable" "$shards_dir" 1 1 --shards=4 &> /dev/null && diff "$shards_dir/$filename.out" "$expected"; then
+        passed "$filename with --shards=4"
+    else
+        failed "$filename with --shards=4"
+    fi
+
+    if ./"$executable" "$pipeline_dir" 1 1 --pipeline &> /dev/null && diff "$pipeline_dir/$filename.out" "$expected"; then
+        passed "$filename with --pipeline"
+    else
+        failed "$filename with --pipeline"
+    fi
+
+    serve "$file" "$expected_dir/text.out"
+    if diff "$expected_dir/text.out" "$expected"; then
+        passed "$filename with --serve (text)"
+    else
+        failed "$filename with --serve (text)"
+    fi
+
+    serve "$file" "$expected_dir/binary.out" --binary
+    if diff "$expected_dir/binary.out" "$expected"; then
+        passed "$filename with --serve (binary)"
+    else
+        failed "$filename with --serve (binary)"
+    fi
+
+    rm -rf "$expected_dir" "$shards_dir" "$pipeline_dir"
+done
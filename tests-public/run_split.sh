@@ -0,0 +1,39 @@
+# Executable path
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit 1
+fi
+executable=$1
+
+split_dir=$(mktemp -d)
+whole_dir=$(mktemp -d)
+
+# A job several times JOB_CHUNK_SIZE (256 KiB) long, so that it is split
+# with more than one thread. Each block touches keys of its own and of the
+# block two before it, so cuts are pushed past the blocks that share keys.
+awk 'BEGIN {
+    for (b = 0; b < 8000; b++) {
+        printf "WRITE [(key%dx0,val%d)(key%dx1,val%d)(key%dx2,val%d)]\n", b, b % 97, b, b % 89, b, b % 83
+        printf "READ [key%dx2,key%dx0,missing%d]\n", b, b, b
+        if (b % 5 == 0 && b >= 2)
+            printf "DELETE [key%dx1,gone%d]\n", b - 2, b
+        printf "READ [key%dx0,key%dx1,key%dx2]\n", b, b, b
+    }
+}' > "$split_dir/split.job"
+cp "$split_dir/split.job" "$whole_dir"
+
+echo -e "\e[34mRunning executable: $executable <dir> 1 4 and $executable <dir> 1 1\e[0m"
+if ! ./"$executable" "$split_dir" 1 4 > /dev/null || ! ./"$executable" "$whole_dir" 1 1 > /dev/null; then
+    echo -e "\e[31mExecutable failed\e[0m"
+    rm -rf "$split_dir" "$whole_dir"
+    exit 1
+fi
+
+# A single thread never splits a job
+if diff -q "$split_dir/split.out" "$whole_dir/split.out" > /dev/null; then
+    echo -e "\e[32mTest passed for split\e[0m"
+else
+    echo -e "\e[31mTest failed for split\e[0m"
+fi
+
+rm -rf "$split_dir" "$whole_dir"
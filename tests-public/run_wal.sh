@@ -0,0 +1,85 @@
+# Executable path
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit 1
+fi
+executable=$1
+
+work_dir=$(mktemp -d)
+mkdir "$work_dir/expected" "$work_dir/logged" "$work_dir/checkpointed" "$work_dir/show"
+
+# Writes, deletes and pairs with a time to live long enough to outlast the
+# test; with backup set, a BACKUP halfway checkpoints the log
+generate() {
+    awk -v backup="$1" 'BEGIN {
+        for (i = 0; i < 600; i++) {
+            printf "WRITE [(key%d,val%d)]\n", i % 150, i
+            if (i % 7 == 0)
+                printf "DELETE [key%d]\n", (i * 3) % 150
+            if (i % 50 == 0)
+                printf "WRITE [(ttl%d,val%d)] TTL 600000\n", i, i
+            if (backup && i == 300)
+                printf "BACKUP\n"
+        }
+    }'
+}
+
+generate 0 > "$work_dir/logged/changes.job"
+generate 1 > "$work_dir/checkpointed/changes.job"
+printf 'SHOW\n' > "$work_dir/show/show.job"
+# The default run sees the changes and the SHOW in a single job
+cat "$work_dir/logged/changes.job" "$work_dir/show/show.job" > "$work_dir/expected/all.job"
+
+passed() {
+    echo -e "\e[32mTest passed for $1\e[0m"
+}
+
+failed() {
+    echo -e "\e[31mTest failed for $1\e[0m"
+}
+
+# Runs the SHOW job on the given options, and checks what the changes and
+# the SHOW wrote against the default run
+check_show() {
+    local name=$1 changes=$2
+    shift 2
+    rm -f "$work_dir/show/show.out"
+    if ./"$executable" "$work_dir/show" 1 1 "$@" &> /dev/null &&
+        cat "$changes" "$work_dir/show/show.out" | diff -q - "$work_dir/expected/all.out" > /dev/null; then
+        passed "$name"
+    else
+        failed "$name"
+    fi
+}
+
+echo -e "\e[34mRunning executable: $executable <dir> 1 1 [--wal=PATH] [--restore=PATH]\e[0m"
+if ! ./"$executable" "$work_dir/expected" 1 1 &> /dev/null ||
+    ! ./"$executable" "$work_dir/logged" 1 1 --wal="$work_dir/logged.wal" &> /dev/null ||
+    ! ./"$executable" "$work_dir/checkpointed" 1 1 --binary-snapshots --wal="$work_dir/checkpointed.wal" &> /dev/null; then
+    echo -e "\e[31mExecutable failed\e[0m"
+    rm -rf "$work_dir"
+    exit 1
+fi
+
+# Every change is replayed from the log alone
+cp "$work_dir/logged.wal" "$work_dir/replayed.wal"
+check_show "replay" "$work_dir/logged/changes.out" --wal="$work_dir/replayed.wal"
+
+# A record cut short by a crash is discarded, and the ones before it kept
+cp "$work_dir/logged.wal" "$work_dir/truncated.wal"
+printf '\100\000\000\000\001\002\003\004W' >> "$work_dir/truncated.wal"
+check_show "replay with a truncated tail" "$work_dir/logged/changes.out" --wal="$work_dir/truncated.wal"
+
+# A checkpointed log only holds the changes since the snapshot
+cp "$work_dir/checkpointed.wal" "$work_dir/restored.wal"
+check_show "replay after a checkpoint" "$work_dir/checkpointed/changes.out" \
+    --restore="$work_dir/checkpointed" --wal="$work_dir/restored.wal"
+
+cp "$work_dir/checkpointed.wal" "$work_dir/alone.wal"
+if ./"$executable" "$work_dir/show" 1 1 --wal="$work_dir/alone.wal" &> /dev/null; then
+    failed "checkpointed log without its snapshot"
+else
+    passed "checkpointed log without its snapshot"
+fi
+
+rm -rf "$work_dir"
@@ -0,0 +1,162 @@
+#include "trace.h"
+
+#include <stdio.h>
+
+#ifdef KVS_TRACE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "registry.h"
+#include "stats.h"
+
+typedef struct TraceEvent
+{
+  uint64_t timestamp;
+  const char *name;
+  char phase;
+  char arg[TRACE_ARG_SIZE];
+} TraceEvent;
+
+typedef struct TraceBuffer
+{
+  ThreadRecord record;
+  // Number of events ever appended; only the owning thread changes it.
+  _Alignas(64) atomic_uint_fast64_t head;
+  TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+// Buffers of every thread that traced anything, kept after the thread
+// exits so its events can still be dumped.
+static ThreadRegistry buffers = THREAD_REGISTRY_INITIALIZER;
+static _Thread_local ThreadRecord *local_buffer = NULL;
+
+static TraceBuffer *thread_buffer()
+{
+  return thread_registry_get(&buffers, &local_buffer, sizeof(TraceBuffer));
+}
+
+void trace_record(char phase, const char *name, const char *arg)
+{
+  TraceBuffer *buffer = thread_buffer();
+  if (buffer == NULL)
+    return;
+
+  uint_fast64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+  TraceEvent *event = &buffer->events[head % TRACE_BUFFER_EVENTS];
+  event->timestamp = stats_now();
+  event->name = name;
+  event->phase = phase;
+  event->arg[0] = '\0';
+  if (arg != NULL)
+  {
+    strncpy(event->arg, arg, TRACE_ARG_SIZE - 1);
+    event->arg[TRACE_ARG_SIZE - 1] = '\0';
+  }
+
+  // Publishes the event to dumps
+  atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+static void write_string(FILE *file, const char *str)
+{
+  fputc('"', file);
+  for (const unsigned char *p = (const unsigned char *)str; *p != '\0'; p++)
+  {
+    if (*p == '"' || *p == '\\')
+      fprintf(file, "\\%c", *p);
+    else if (*p < 0x20)
+      fprintf(file, "\\u%04x", *p);
+    else
+      fputc(*p, file);
+  }
+  fputc('"', file);
+}
+
+// Copies the events of a buffer that its thread has not overwritten.
+// @return Number of events copied into events, oldest first.
+static size_t copy_events(TraceBuffer *buffer, TraceEvent *events)
+{
+  uint_fast64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+  uint_fast64_t first = head > TRACE_BUFFER_EVENTS ? head - TRACE_BUFFER_EVENTS : 0;
+  for (uint_fast64_t i = first; i < head; i++)
+  {
+    events[i - first] = buffer->events[i % TRACE_BUFFER_EVENTS];
+  }
+
+  // Events the thread appended meanwhile may have overwritten the oldest
+  // ones while they were being copied
+  atomic_thread_fence(memory_order_acquire);
+  uint_fast64_t now = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+  uint_fast64_t skip = now > TRACE_BUFFER_EVENTS && now - TRACE_BUFFER_EVENTS > first
+                           ? now - TRACE_BUFFER_EVENTS - first
+                           : 0;
+  if (skip > head - first)
+    skip = head - first;
+  memmove(events, events + skip, (size_t)(head - first - skip) * sizeof(TraceEvent));
+  return (size_t)(head - first - skip);
+}
+
+int trace_dump(const char *path)
+{
+  TraceEvent *events = malloc(TRACE_BUFFER_EVENTS * sizeof(TraceEvent));
+  FILE *file = fopen(path, "w");
+  if (events == NULL || file == NULL)
+  {
+    perror("Failed to dump the trace");
+    free(events);
+    if (file != NULL)
+      fclose(file);
+    return 1;
+  }
+
+  int pid = (int)getpid();
+  int first = 1;
+  fprintf(file, "{\"traceEvents\":[\n");
+  for (TraceBuffer *buffer = (TraceBuffer *)thread_registry_first(&buffers); buffer != NULL;
+       buffer = (TraceBuffer *)buffer->record.next)
+  {
+    size_t count = copy_events(buffer, events);
+    for (size_t i = 0; i < count; i++)
+    {
+      TraceEvent *event = &events[i];
+      fprintf(file, "%s{\"name\":", first ? "" : ",\n");
+      write_string(file, event->name);
+      fprintf(file, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u",
+              event->phase, (double)event->timestamp / 1000, pid, buffer->record.id);
+      if (event->phase == 'i')
+        fprintf(file, ",\"s\":\"t\"");
+      if (event->arg[0] != '\0')
+      {
+        fprintf(file, ",\"args\":{\"detail\":");
+        write_string(file, event->arg);
+        fputc('}', file);
+      }
+      fputc('}', file);
+      first = 0;
+    }
+  }
+  fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+  free(events);
+  if (fclose(file) != 0)
+  {
+    perror("Failed to dump the trace");
+    return 1;
+  }
+  return 0;
+}
+
+#else
+
+int trace_dump(const char *path)
+{
+  fprintf(stderr, "Cannot write %s: tracing is not built in (make TRACE=1)\n", path);
+  return 1;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef KVS_TRACE_H
+#define KVS_TRACE_H
+
+// Events kept per thread; older ones are overwritten.
+#define TRACE_BUFFER_EVENTS 16384
+// Bytes of the argument copied into an event, terminator included.
+#define TRACE_ARG_SIZE 48
+
+// Tracing of what each thread is doing, for a timeline viewer. Built in
+// only with KVS_TRACE defined (make TRACE=1); otherwise the trace points
+// compile to nothing.
+//
+// Each thread appends its events to a ring buffer of its own, without
+// locks or system calls; the buffers are only read when dumped. Events
+// are slices (a begin and an end on the same thread, which must nest) or
+// instants. Names must be string literals: only the pointer is kept.
+#ifdef KVS_TRACE
+
+/// Appends an event to the buffer of the calling thread.
+/// @param phase 'B' to begin a slice, 'E' to end it, 'i' for an instant.
+/// @param name Name of the event, with static storage.
+/// @param arg Detail copied into the event (truncated to TRACE_ARG_SIZE),
+/// NULL for none.
+void trace_record(char phase, const char *name, const char *arg);
+
+#define TRACE_BEGIN(name, arg) trace_record('B', (name), (arg))
+#define TRACE_END(name) trace_record('E', (name), NULL)
+#define TRACE_INSTANT(name, arg) trace_record('i', (name), (arg))
+
+#else
+
+#define TRACE_BEGIN(name, arg) ((void)0)
+#define TRACE_END(name) ((void)0)
+#define TRACE_INSTANT(name, arg) ((void)0)
+
+#endif
+
+/// Writes the events still buffered by every thread to a file, in the
+/// Trace Event JSON format (chrome://tracing, Perfetto). Threads may keep
+/// tracing meanwhile.
+/// @param path File to write.
+/// @return 0 if the file was written, 1 otherwise (always when tracing is
+/// not built in).
+int trace_dump(const char *path);
+
+#endif // KVS_TRACE_H
@@ -0,0 +1,249 @@
+// syscall(), as io_uring has no other libc wrapper
+#define _DEFAULT_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// The rings shared with the kernel, mapped into the process.
+typedef struct UringRing
+{
+  int fd;
+  // Writes submitted, or about to be, whose completion was not reaped.
+  unsigned int inflight;
+  // Entries queued that io_uring_enter did not take yet.
+  unsigned int unsubmitted;
+
+  _Atomic unsigned int *sq_tail;
+  unsigned int sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+
+  _Atomic unsigned int *cq_head;
+  _Atomic unsigned int *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *rings;
+  size_t rings_size;
+  size_t sqes_size;
+} UringRing;
+
+static atomic_int disabled = 0;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+// Tears the ring of a thread down when it exits.
+static pthread_key_t ring_key;
+static _Thread_local UringRing *local_ring = NULL;
+// Whether setting up the ring of this thread failed already.
+static _Thread_local int setup_failed = 0;
+
+void uring_disable()
+{
+  atomic_store(&disabled, 1);
+}
+
+// Submits the queued entries and, if wait, waits for a completion.
+// @return 0 on success, 1 otherwise (with errno set).
+static int ring_enter(UringRing *ring, unsigned int wait)
+{
+  for (;;)
+  {
+    long result = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, wait,
+                          wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (result >= 0)
+    {
+      ring->unsubmitted -= (unsigned int)result;
+      return 0;
+    }
+    if (errno != EINTR)
+      return 1;
+  }
+}
+
+// Hands every completion posted so far to its request.
+// @return Number of completions reaped.
+static unsigned int ring_reap(UringRing *ring)
+{
+  unsigned int head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+  unsigned int count = tail - head;
+  for (; head != tail; head++)
+  {
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    UringRequest *request = (UringRequest *)(uintptr_t)cqe->user_data;
+    request->result = cqe->res;
+    request->done = 1;
+  }
+  ring->inflight -= count;
+
+  // Frees the entries for the kernel to post more
+  atomic_store_explicit(ring->cq_head, tail, memory_order_release);
+  return count;
+}
+
+// Waits until at least one write in flight completes.
+// @return 0 on success, 1 otherwise (with errno set).
+static int ring_wait_any(UringRing *ring)
+{
+  while (ring_reap(ring) == 0)
+  {
+    if (ring_enter(ring, 1))
+      return 1;
+  }
+  return 0;
+}
+
+static void ring_destroy(void *arg)
+{
+  UringRing *ring = arg;
+
+  // Completions must not be posted into requests that are gone
+  while (ring->inflight > 0 && ring_wait_any(ring) == 0)
+    ;
+
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->rings, ring->rings_size);
+  close(ring->fd);
+  free(ring);
+}
+
+static void create_key()
+{
+  pthread_key_create(&ring_key, ring_destroy);
+}
+
+static UringRing *ring_setup()
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0)
+    return NULL;
+
+  // Writing at the current offset, like write() does, needs 5.6 or later,
+  // which always maps both queues at once
+  if (!(params.features & IORING_FEAT_RW_CUR_POS) || !(params.features & IORING_FEAT_SINGLE_MMAP))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  UringRing *ring = calloc(1, sizeof(UringRing));
+  if (ring == NULL)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+  if (ring->rings == MAP_FAILED)
+  {
+    close(fd);
+    free(ring);
+    return NULL;
+  }
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+  {
+    munmap(ring->rings, ring->rings_size);
+    close(fd);
+    free(ring);
+    return NULL;
+  }
+
+  char *base = ring->rings;
+  ring->fd = fd;
+  ring->sq_tail = (_Atomic unsigned int *)(base + params.sq_off.tail);
+  ring->sq_mask = *(unsigned int *)(base + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(base + params.sq_off.array);
+  ring->cq_head = (_Atomic unsigned int *)(base + params.cq_off.head);
+  ring->cq_tail = (_Atomic unsigned int *)(base + params.cq_off.tail);
+  ring->cq_mask = *(unsigned int *)(base + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+  return ring;
+}
+
+static UringRing *thread_ring()
+{
+  if (local_ring != NULL || setup_failed || atomic_load_explicit(&disabled, memory_order_relaxed))
+    return local_ring;
+
+  local_ring = ring_setup();
+  if (local_ring == NULL)
+  {
+    setup_failed = 1;
+    return NULL;
+  }
+
+  pthread_once(&key_once, create_key);
+  pthread_setspecific(ring_key, local_ring);
+  return local_ring;
+}
+
+int uring_write(int fd, const char *data, size_t len, UringRequest *request)
+{
+  UringRing *ring = thread_ring();
+  if (ring == NULL || atomic_load_explicit(&disabled, memory_order_relaxed) || len > INT_MAX)
+    return 1;
+
+  // No more writes in flight than the completion queue has room for
+  while (ring->inflight >= URING_ENTRIES)
+  {
+    if (ring_wait_any(ring))
+      return 1;
+  }
+
+  unsigned int tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+  unsigned int index = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->off = UINT64_MAX; // The current offset, which the write advances
+  sqe->addr = (uint64_t)(uintptr_t)data;
+  sqe->len = (uint32_t)len;
+  sqe->user_data = (uint64_t)(uintptr_t)request;
+  ring->sq_array[index] = index;
+
+  request->done = 0;
+  request->result = 0;
+  atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+  ring->inflight++;
+  ring->unsubmitted++;
+
+  // Left queued if this fails; waiting submits it again
+  ring_enter(ring, 0);
+  return 0;
+}
+
+int uring_wait(UringRequest *request)
+{
+  UringRing *ring = local_ring;
+  while (!request->done)
+  {
+    if (ring_reap(ring) > 0)
+      continue;
+
+    // The kernel may still be reading the bytes, so the caller cannot
+    // have them back before the write completes: failing to enter the
+    // ring (EAGAIN, EBUSY while completions pile up) is retried
+    if (ring_enter(ring, 1))
+      nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+  }
+  return request->result;
+}
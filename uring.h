@@ -0,0 +1,48 @@
+#ifndef KVS_URING_H
+#define KVS_URING_H
+
+#include <stddef.h>
+
+// Entries of the submission queue of each ring, and so the most writes a
+// thread can have in flight at once.
+#define URING_ENTRIES 64
+
+// Asynchronous writes through io_uring. Each thread submits to a ring of
+// its own, set up on first use and torn down when the thread exits, so a
+// write must be waited for by the thread that started it. Completions are
+// reaped in batches, whenever a thread waits for any of its writes.
+//
+// Where io_uring is not available (an old kernel, a seccomp filter) no
+// write is started, and callers write synchronously instead.
+
+// A write started with uring_write.
+typedef struct UringRequest
+{
+  // Set once the write completed.
+  int done;
+  // Bytes written, or a negated errno.
+  int result;
+} UringRequest;
+
+/// Stops writes from being started on any thread from now on.
+void uring_disable();
+
+/// Starts writing bytes at the current offset of a file descriptor. The
+/// bytes must stay untouched until the write completes, and no other write
+/// to the descriptor may be in flight meanwhile.
+/// @param fd File descriptor to write to.
+/// @param data Bytes to write.
+/// @param len Number of bytes to write, at most INT_MAX.
+/// @param request Request to track the write with until it completes.
+/// @return 0 if the write was started, 1 if it must be done synchronously.
+int uring_write(int fd, const char *data, size_t len, UringRequest *request);
+
+/// Waits until a write started by the calling thread completes, however
+/// long entering the ring keeps failing: the bytes are the caller's again
+/// once it returns.
+/// @param request Request of the write.
+/// @return Bytes written (possibly fewer than requested), or the negated
+/// errno the write failed with.
+int uring_wait(UringRequest *request);
+
+#endif // KVS_URING_H
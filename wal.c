@@ -0,0 +1,617 @@
+#include "wal.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "expiry.h"
+#include "output.h"
+#include "stats.h"
+
+#define WAL_HEADER_SIZE (2 * sizeof(uint32_t))
+// Largest checkpoint record, header included.
+#define WAL_CHECKPOINT_SIZE (WAL_HEADER_SIZE + 1 + 2 * sizeof(int64_t) + 1 + UINT8_MAX)
+
+typedef struct WalBuffer
+{
+  size_t used;
+  char data[WAL_BUFFER_SIZE];
+} WalBuffer;
+
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signaled when a flush completes.
+static pthread_cond_t wal_flushed = PTHREAD_COND_INITIALIZER;
+// Signaled when the log is closing.
+static pthread_cond_t wal_closing = PTHREAD_COND_INITIALIZER;
+
+static int wal_fd = -1;
+static char *wal_path = NULL;
+static WalSyncPolicy sync_policy;
+static unsigned int sync_interval_ms;
+
+// Records are appended to buffers[active] while the other one is being
+// written out, so a flush never blocks the jobs adding the next group.
+static WalBuffer buffers[2];
+static int active = 0;
+static int flushing = 0;
+// Set while the sync thread syncs wal_fd without the mutex.
+static int syncing = 0;
+static int failed = 0;
+static int closing = 0;
+
+// Positions in the log: everything up to appended is buffered, up to
+// written is in the file, and up to synced is on disk.
+static uint64_t appended = 0;
+static uint64_t written = 0;
+static uint64_t synced = 0;
+// Position of the last checkpoint, and bytes of the record naming its
+// snapshot that the file starts with; the file holds the records after
+// that position past them.
+static uint64_t checkpointed = 0;
+static uint64_t head_size = 0;
+
+static pthread_t sync_thread;
+static int sync_thread_started = 0;
+
+static uint32_t checksum(const char *data, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (unsigned char)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Fills the header of a record from its length and bytes.
+static void seal_record(char *header, size_t length)
+{
+  uint32_t length32 = (uint32_t)length;
+  uint32_t sum = checksum(header + WAL_HEADER_SIZE, length);
+  memcpy(header, &length32, sizeof(length32));
+  memcpy(header + sizeof(length32), &sum, sizeof(sum));
+}
+
+// @return Offset of the file a position of the log is at.
+static off_t file_offset(uint64_t position)
+{
+  return (off_t)(position - checkpointed + head_size);
+}
+
+// Reads a length-prefixed string of a record.
+// @return 0 if the string was read successfully, 1 otherwise.
+static int read_string(const char **p, const char *end, char *dest)
+{
+  if (*p >= end)
+    return 1;
+
+  size_t len = (uint8_t)**p;
+  (*p)++;
+  if (len >= MAX_STRING_SIZE || (size_t)(end - *p) < len)
+    return 1;
+
+  memcpy(dest, *p, len);
+  dest[len] = '\0';
+  *p += len;
+  return 0;
+}
+
+// Applies the batch held by a record to the table.
+// @return 0 if the record was applied successfully, 1 if it is malformed.
+static int replay_record(const char *p, const char *end, HashTable *ht)
+{
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  uint16_t count;
+  uint64_t expires_at = 0;
+
+  if ((size_t)(end - p) < 1 + sizeof(count))
+    return 1;
+  char op = *p++;
+  memcpy(&count, p, sizeof(count));
+  p += sizeof(count);
+  if ((op != WAL_WRITE && op != WAL_WRITE_EXPIRING && op != WAL_DELETE) || count > MAX_WRITE_SIZE)
+    return 1;
+
+  if (op == WAL_WRITE_EXPIRING)
+  {
+    if ((size_t)(end - p) < sizeof(expires_at))
+      return 1;
+    memcpy(&expires_at, p, sizeof(expires_at));
+    p += sizeof(expires_at);
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    if (read_string(&p, end, keys[i]) || (op != WAL_DELETE && read_string(&p, end, values[i])))
+      return 1;
+  }
+  if (p != end)
+    return 1;
+
+  // The time left is carried over to the clock of this run
+  uint64_t expires = 0;
+  if (op == WAL_WRITE_EXPIRING)
+  {
+    expires = stats_from_wall_ms(expires_at);
+    if (expires == 0)
+      op = WAL_DELETE; // The pairs written have expired since
+  }
+
+  // Nothing else can see the table yet
+  lock_stripes(ht, ALL_STRIPES, 1);
+  for (size_t i = 0; i < count; i++)
+  {
+    if (op != WAL_DELETE)
+      write_pair(ht, keys[i], values[i], expires);
+    else
+      delete_pair(ht, keys[i]);
+  }
+  unlock_stripes(ht, ALL_STRIPES);
+
+  for (size_t i = 0; i < count && expires != 0; i++)
+  {
+    expiry_schedule(keys[i], expires);
+  }
+
+  return 0;
+}
+
+// Checks that a log may be replayed on the snapshot restored, if it starts
+// with a checkpoint record.
+// @return Bytes of the checkpoint record, 0 if there is none, or SIZE_MAX
+// if the log must not be replayed.
+static size_t check_checkpoint(const char *path, const char *data, size_t size, const char *restored)
+{
+  uint32_t length, sum;
+  if (size < WAL_HEADER_SIZE + 1 || data[WAL_HEADER_SIZE] != WAL_CHECKPOINT)
+    return 0;
+  memcpy(&length, data, sizeof(length));
+  memcpy(&sum, data + sizeof(length), sizeof(sum));
+
+  const char *record = data + WAL_HEADER_SIZE;
+  int64_t seconds, nanoseconds;
+  size_t fixed = 1 + sizeof(seconds) + sizeof(nanoseconds) + 1;
+  if (length > size - WAL_HEADER_SIZE || length < fixed || checksum(record, length) != sum ||
+      (uint8_t)record[fixed - 1] != length - fixed)
+  {
+    fprintf(stderr, "%s starts with a corrupted checkpoint\n", path);
+    return SIZE_MAX;
+  }
+
+  memcpy(&seconds, record + 1, sizeof(seconds));
+  memcpy(&nanoseconds, record + 1 + sizeof(seconds), sizeof(nanoseconds));
+  int nameLen = (int)(length - fixed);
+  const char *name = record + fixed;
+
+  struct stat st;
+  if (restored == NULL)
+  {
+    fprintf(stderr, "%s only holds the changes since snapshot %.*s, which must be restored with it\n", path,
+            nameLen, name);
+    return SIZE_MAX;
+  }
+  if (stat(restored, &st) != 0 || st.st_mtim.tv_sec < seconds ||
+      (st.st_mtim.tv_sec == seconds && st.st_mtim.tv_nsec < nanoseconds))
+  {
+    fprintf(stderr, "%s only holds the changes since snapshot %.*s, newer than %s\n", path, nameLen, name,
+            restored);
+    return SIZE_MAX;
+  }
+
+  return WAL_HEADER_SIZE + length;
+}
+
+// Replays every complete record of a mapped log.
+// @return Length of the valid part of the log.
+static size_t replay(const char *data, size_t size, HashTable *ht)
+{
+  size_t offset = 0;
+  size_t records = 0;
+  while (size - offset >= WAL_HEADER_SIZE)
+  {
+    uint32_t length, sum;
+    memcpy(&length, data + offset, sizeof(length));
+    memcpy(&sum, data + offset + sizeof(length), sizeof(sum));
+
+    const char *record = data + offset + WAL_HEADER_SIZE;
+    if (length > size - offset - WAL_HEADER_SIZE || checksum(record, length) != sum ||
+        replay_record(record, record + length, ht))
+      break;
+
+    offset += WAL_HEADER_SIZE + length;
+    records++;
+  }
+
+  printf("Replayed %zu log records\n", records);
+  return offset;
+}
+
+// Writes out the active buffer, syncing it if the policy says so.
+// wal_mutex must be held; it is released during the write.
+static void flush_locked()
+{
+  flushing = 1;
+  WalBuffer *buffer = &buffers[active];
+  active ^= 1;
+  uint64_t target = appended;
+  pthread_mutex_unlock(&wal_mutex);
+
+  int error = output_write_all(wal_fd, OUTPUT_WAL, buffer->data, buffer->used);
+  if (!error && sync_policy == WAL_SYNC_ALWAYS)
+    error = fdatasync(wal_fd);
+  buffer->used = 0;
+
+  pthread_mutex_lock(&wal_mutex);
+  flushing = 0;
+  if (error)
+  {
+    perror("Failed to write the log");
+    failed = 1;
+  }
+  else
+  {
+    written = target;
+    if (sync_policy == WAL_SYNC_ALWAYS)
+      synced = target;
+  }
+  pthread_cond_broadcast(&wal_flushed);
+}
+
+// Syncs the log every sync_interval_ms, with WAL_SYNC_INTERVAL.
+static void *sync_worker()
+{
+  pthread_mutex_lock(&wal_mutex);
+  while (!closing)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += sync_interval_ms / 1000;
+    deadline.tv_nsec += (long)(sync_interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&wal_closing, &wal_mutex, &deadline);
+
+    uint64_t target = written;
+    if (target > synced)
+    {
+      // A checkpoint waits for the sync before replacing the file
+      syncing = 1;
+      pthread_mutex_unlock(&wal_mutex);
+      int error = fdatasync(wal_fd);
+      pthread_mutex_lock(&wal_mutex);
+      syncing = 0;
+      pthread_cond_broadcast(&wal_flushed);
+      if (error)
+        perror("Failed to sync the log");
+      else if (target > synced)
+        synced = target;
+    }
+  }
+  pthread_mutex_unlock(&wal_mutex);
+
+  return NULL;
+}
+
+int wal_open(const char *path, WalSyncPolicy policy, unsigned int interval_ms, HashTable *ht,
+             const char *restored)
+{
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0)
+  {
+    perror(path);
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    perror(path);
+    close(fd);
+    return 1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  size_t valid = 0;
+  if (size > 0)
+  {
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+      perror(path);
+      close(fd);
+      return 1;
+    }
+    posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+    size_t head = check_checkpoint(path, data, size, restored);
+    if (head != SIZE_MAX)
+      valid = head + replay(data + head, size - head, ht);
+    munmap(data, size);
+    if (head == SIZE_MAX)
+    {
+      close(fd);
+      return 1;
+    }
+  }
+
+  // A crash may have left a partial record behind
+  if (valid < size)
+  {
+    fprintf(stderr, "Discarding %zu bytes at the end of the log\n", size - valid);
+    if (ftruncate(fd, (off_t)valid) != 0)
+    {
+      perror(path);
+      close(fd);
+      return 1;
+    }
+  }
+
+  wal_path = strdup(path);
+  if (wal_path == NULL)
+  {
+    close(fd);
+    return 1;
+  }
+
+  wal_fd = fd;
+  sync_policy = policy;
+  sync_interval_ms = interval_ms;
+  active = 0;
+  buffers[0].used = buffers[1].used = 0;
+  flushing = failed = closing = 0;
+  appended = written = synced = valid;
+  checkpointed = head_size = 0;
+
+  if (policy == WAL_SYNC_INTERVAL)
+  {
+    if (pthread_create(&sync_thread, NULL, sync_worker, NULL) != 0)
+    {
+      perror("Failed to create log sync thread");
+      close(fd);
+      wal_fd = -1;
+      free(wal_path);
+      wal_path = NULL;
+      return 1;
+    }
+    sync_thread_started = 1;
+  }
+
+  return 0;
+}
+
+static void put_string(char **p, const char *str)
+{
+  size_t len = strlen(str);
+  *(*p)++ = (char)len;
+  memcpy(*p, str, len);
+  *p += len;
+}
+
+uint64_t wal_append(char op, size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+                    uint64_t expires_at)
+{
+  if (wal_fd < 0 || num_pairs == 0 || num_pairs > MAX_WRITE_SIZE)
+    return 0;
+
+  uint16_t count = (uint16_t)num_pairs;
+  size_t length = 1 + sizeof(count);
+  if (op == WAL_WRITE_EXPIRING)
+    length += sizeof(expires_at);
+  for (size_t i = 0; i < num_pairs; i++)
+  {
+    length += 1 + strlen(keys[i]);
+    if (op != WAL_DELETE)
+      length += 1 + strlen(values[i]);
+  }
+
+  pthread_mutex_lock(&wal_mutex);
+
+  // The buffer only fills up when no one committed for a while; the
+  // stripes are held meanwhile, but records must stay in order
+  while (buffers[active].used + WAL_HEADER_SIZE + length > WAL_BUFFER_SIZE)
+  {
+    if (!flushing)
+      flush_locked();
+    else
+      pthread_cond_wait(&wal_flushed, &wal_mutex);
+  }
+
+  WalBuffer *buffer = &buffers[active];
+  char *header = buffer->data + buffer->used;
+  char *record = header + WAL_HEADER_SIZE;
+  char *p = record;
+  *p++ = op;
+  memcpy(p, &count, sizeof(count));
+  p += sizeof(count);
+  if (op == WAL_WRITE_EXPIRING)
+  {
+    memcpy(p, &expires_at, sizeof(expires_at));
+    p += sizeof(expires_at);
+  }
+  for (size_t i = 0; i < num_pairs; i++)
+  {
+    put_string(&p, keys[i]);
+    if (op != WAL_DELETE)
+      put_string(&p, values[i]);
+  }
+
+  seal_record(header, length);
+
+  buffer->used += WAL_HEADER_SIZE + length;
+  appended += WAL_HEADER_SIZE + length;
+  uint64_t position = appended;
+
+  pthread_mutex_unlock(&wal_mutex);
+  return position;
+}
+
+int wal_commit(uint64_t position)
+{
+  if (position == 0)
+    return 0;
+
+  pthread_mutex_lock(&wal_mutex);
+  // Whoever finds no flush in progress writes out the records of every
+  // job waiting so far, its own included
+  while (written < position && !failed)
+  {
+    if (!flushing)
+      flush_locked();
+    else
+      pthread_cond_wait(&wal_flushed, &wal_mutex);
+  }
+  int result = written >= position ? 0 : 1;
+  pthread_mutex_unlock(&wal_mutex);
+
+  return result;
+}
+
+uint64_t wal_position()
+{
+  if (wal_fd < 0)
+    return 0;
+
+  pthread_mutex_lock(&wal_mutex);
+  uint64_t position = appended;
+  pthread_mutex_unlock(&wal_mutex);
+  return position;
+}
+
+// Builds the record naming the snapshot a checkpoint was taken on.
+// @return Bytes of the record, header included.
+static size_t encode_checkpoint(char *header, const char *snapshot, struct timespec captured)
+{
+  const char *slash = strrchr(snapshot, '/');
+  const char *name = slash != NULL ? slash + 1 : snapshot;
+  size_t nameLen = strlen(name);
+  if (nameLen > UINT8_MAX)
+    nameLen = UINT8_MAX;
+
+  int64_t seconds = captured.tv_sec;
+  int64_t nanoseconds = captured.tv_nsec;
+  char *p = header + WAL_HEADER_SIZE;
+  *p++ = WAL_CHECKPOINT;
+  memcpy(p, &seconds, sizeof(seconds));
+  p += sizeof(seconds);
+  memcpy(p, &nanoseconds, sizeof(nanoseconds));
+  p += sizeof(nanoseconds);
+  *p++ = (char)nameLen;
+  memcpy(p, name, nameLen);
+  p += nameLen;
+
+  size_t length = (size_t)(p - header) - WAL_HEADER_SIZE;
+  seal_record(header, length);
+  return WAL_HEADER_SIZE + length;
+}
+
+// Writes a checkpoint record, then copies the records after a position, to
+// a new log, which then replaces the current one. wal_mutex must be held,
+// with nothing being written or synced, and the position must be written.
+// @return 0 if the log was replaced, 1 otherwise.
+static int rotate_locked(uint64_t position, const char *head, size_t headLen)
+{
+  size_t len = strlen(wal_path);
+  char tmpPath[len + 5];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", wal_path);
+
+  int fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0)
+    return 1;
+
+  // Usually little: only what was written since the snapshot was taken
+  char chunk[65536];
+  off_t offset = file_offset(position);
+  off_t end = file_offset(written);
+  int error = output_write_all(fd, OUTPUT_WAL, head, headLen);
+  while (!error && offset < end)
+  {
+    size_t size = end - offset < (off_t)sizeof(chunk) ? (size_t)(end - offset) : sizeof(chunk);
+    ssize_t bytes = pread(wal_fd, chunk, size, offset);
+    error = bytes <= 0 || output_write_all(fd, OUTPUT_WAL, chunk, (size_t)bytes);
+    offset += bytes > 0 ? bytes : 0;
+  }
+
+  if (error || fdatasync(fd) != 0 || rename(tmpPath, wal_path) != 0)
+  {
+    close(fd);
+    unlink(tmpPath);
+    return 1;
+  }
+  // The old log is gone: failing here still leaves the new one in place
+  error = output_sync_directory(wal_path);
+
+  close(wal_fd);
+  wal_fd = fd;
+  checkpointed = position;
+  head_size = headLen;
+  return error;
+}
+
+int wal_checkpoint(uint64_t position, const char *snapshot, struct timespec captured)
+{
+  if (wal_fd < 0 || position == 0)
+    return 0;
+
+  pthread_mutex_lock(&wal_mutex);
+  // The records up to the position must be in the file, and the file must
+  // not be written nor synced while it is replaced
+  while ((flushing || syncing || written < position) && !failed)
+  {
+    if (!flushing && written < position)
+      flush_locked();
+    else
+      pthread_cond_wait(&wal_flushed, &wal_mutex);
+  }
+
+  int result = failed;
+  if (!failed && position > checkpointed)
+  {
+    char head[WAL_CHECKPOINT_SIZE];
+    result = rotate_locked(position, head, encode_checkpoint(head, snapshot, captured));
+    if (result)
+      perror("Failed to checkpoint the log");
+  }
+  pthread_mutex_unlock(&wal_mutex);
+  return result;
+}
+
+void wal_close()
+{
+  if (wal_fd < 0)
+    return;
+
+  pthread_mutex_lock(&wal_mutex);
+  while ((flushing || written < appended) && !failed)
+  {
+    if (!flushing)
+      flush_locked();
+    else
+      pthread_cond_wait(&wal_flushed, &wal_mutex);
+  }
+  closing = 1;
+  pthread_cond_broadcast(&wal_closing);
+  pthread_mutex_unlock(&wal_mutex);
+
+  if (sync_thread_started)
+  {
+    pthread_join(sync_thread, NULL);
+    sync_thread_started = 0;
+  }
+
+  if (sync_policy != WAL_SYNC_NEVER && fdatasync(wal_fd) != 0)
+    perror("Failed to sync the log");
+  close(wal_fd);
+  wal_fd = -1;
+  free(wal_path);
+  wal_path = NULL;
+}
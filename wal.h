@@ -0,0 +1,110 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "constants.h"
+#include "kvs.h"
+
+// Write-ahead log of every WRITE and DELETE batch. Records are appended to
+// an in-memory buffer while the stripes of their keys are held, so the log
+// orders conflicting batches as the table does. Committing then writes out
+// every record buffered so far: batches of concurrent jobs share a single
+// write (and fdatasync), one thread flushing for all of them.
+//
+// Record format, in host byte order:
+//   uint32_t size           bytes after the header
+//   uint32_t checksum       FNV-1a of those bytes
+//   uint8_t op              WAL_WRITE, WAL_WRITE_EXPIRING or WAL_DELETE
+//   uint16_t count          number of keys
+//   [uint64_t expires_at]   with WAL_WRITE_EXPIRING, milliseconds since
+//                           the Unix epoch the pairs expire at
+//   count times:
+//     uint8_t key_len, key bytes[, uint8_t value_len, value bytes]
+// A truncated or corrupted record ends the log: it is discarded, with
+// everything after it, when the log is opened.
+//
+// Once a snapshot of the table is durable, the records it already holds
+// are dropped (see wal_checkpoint), so the log only holds the changes
+// since the latest snapshot and must be restored together with it. Such a
+// log starts with a record naming the snapshot instead:
+//   uint8_t op              WAL_CHECKPOINT
+//   int64_t seconds, nanoseconds
+//                           wall-clock time the snapshot was captured at,
+//                           which is also its modification time
+//   uint8_t name_len, name bytes
+//                           file name of the snapshot
+#define WAL_WRITE 'W'
+#define WAL_WRITE_EXPIRING 'E'
+#define WAL_DELETE 'D'
+#define WAL_CHECKPOINT 'C'
+
+typedef enum WalSyncPolicy
+{
+  // Every commit waits for fdatasync.
+  WAL_SYNC_ALWAYS,
+  // Commits are written out at once but synced every few milliseconds.
+  WAL_SYNC_INTERVAL,
+  // Commits are written out, the system decides when to sync them.
+  WAL_SYNC_NEVER
+} WalSyncPolicy;
+
+/// Replays a log into a table, then opens it for appending. The log is
+/// created if it does not exist. A checkpointed log is refused unless the
+/// table was restored from its snapshot, or from one captured after it:
+/// replayed on anything older, its records would leave a partial table.
+/// @param path Path of the log file.
+/// @param policy When commits are synced to disk.
+/// @param interval_ms Milliseconds between syncs with WAL_SYNC_INTERVAL.
+/// @param ht Table to replay the log into.
+/// @param restored Path of the snapshot the table was restored from, NULL
+/// if it was not.
+/// @return 0 if the log was opened successfully, 1 otherwise.
+int wal_open(const char *path, WalSyncPolicy policy, unsigned int interval_ms, HashTable *ht,
+             const char *restored);
+
+/// Buffers a record of a batch. The stripes of the keys must be locked for
+/// writing.
+/// @param op WAL_WRITE, WAL_WRITE_EXPIRING or WAL_DELETE.
+/// @param num_pairs Number of keys in the batch.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings, NULL for WAL_DELETE.
+/// @param expires_at With WAL_WRITE_EXPIRING, milliseconds since the Unix
+/// epoch the pairs expire at; ignored otherwise. Pairs found expired when
+/// the log is replayed are removed instead of written.
+/// @return Position of the log the record ends at, to be committed, or 0
+/// if no log is open or the record could not be buffered.
+uint64_t wal_append(char op, size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+                    uint64_t expires_at);
+
+/// Waits until the log is durable, as set by the sync policy, up to a
+/// given position. Should be called with no stripes held, so that other
+/// batches can join the same flush.
+/// @param position Position returned by wal_append.
+/// @return 0 if the log was committed successfully, 1 otherwise.
+int wal_commit(uint64_t position);
+
+/// Gets the position of the log the records buffered so far end at. Read
+/// while holding every stripe, it is where a snapshot taken meanwhile
+/// stands in the log.
+/// @return Position of the log, 0 if no log is open.
+uint64_t wal_position();
+
+/// Drops the records up to a position from the log, once a snapshot that
+/// holds their changes is durable. A record naming the snapshot, then the
+/// records after the position, are copied to a new log, which replaces the
+/// old one atomically. Positions at or before a previous checkpoint are
+/// ignored.
+/// @param position Position returned by wal_position.
+/// @param snapshot Path of the snapshot.
+/// @param captured Wall-clock time the snapshot was captured at, which it
+/// is dated with.
+/// @return 0 if the log was checkpointed successfully, 1 otherwise.
+int wal_checkpoint(uint64_t position, const char *snapshot, struct timespec captured);
+
+/// Commits and syncs whatever is left in the log, then closes it.
+void wal_close();
+
+#endif // KVS_WAL_H
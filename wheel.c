@@ -0,0 +1,130 @@
+#include "wheel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+// Ticks spanned by a slot of a level.
+static uint64_t slot_span(unsigned int level)
+{
+  return (uint64_t)1 << (WHEEL_SLOT_BITS * level);
+}
+
+void wheel_init(TimingWheel *wheel, uint64_t now)
+{
+  for (unsigned int level = 0; level < WHEEL_LEVELS; level++)
+  {
+    for (size_t slot = 0; slot < WHEEL_SLOTS; slot++)
+    {
+      wheel->slots[level][slot] = NULL;
+    }
+  }
+  wheel->now = now;
+  wheel->count = 0;
+}
+
+// Links an entry into the lowest level whose turn reaches its deadline.
+// Entries due at the current tick go to the level 0 slot about to be
+// taken, which only happens while cascading.
+static void place(TimingWheel *wheel, WheelEntry *entry)
+{
+  uint64_t deadline = entry->deadline > wheel->now ? entry->deadline : wheel->now;
+  uint64_t delta = deadline - wheel->now;
+
+  unsigned int level = 0;
+  while (level < WHEEL_LEVELS - 1 && delta >= slot_span(level + 1))
+  {
+    level++;
+  }
+  if (delta >= slot_span(WHEEL_LEVELS))
+  {
+    // Out of reach: waits in the furthest slot, to be placed again once
+    // it is cascaded
+    deadline = wheel->now + slot_span(WHEEL_LEVELS) - 1;
+  }
+
+  size_t slot = (size_t)(deadline >> (WHEEL_SLOT_BITS * level)) & SLOT_MASK;
+  entry->next = wheel->slots[level][slot];
+  wheel->slots[level][slot] = entry;
+}
+
+int wheel_add(TimingWheel *wheel, const char *key, uint64_t deadline)
+{
+  WheelEntry *entry = malloc(sizeof(WheelEntry));
+  if (entry == NULL)
+    return 1;
+
+  strcpy(entry->key, key);
+  // The slot of the current tick was already taken
+  entry->deadline = deadline > wheel->now ? deadline : wheel->now + 1;
+  place(wheel, entry);
+  wheel->count++;
+  return 0;
+}
+
+// Spreads the current slot of a level over the levels below.
+static void cascade(TimingWheel *wheel, unsigned int level)
+{
+  size_t slot = (size_t)(wheel->now >> (WHEEL_SLOT_BITS * level)) & SLOT_MASK;
+  WheelEntry *entry = wheel->slots[level][slot];
+  wheel->slots[level][slot] = NULL;
+  while (entry != NULL)
+  {
+    WheelEntry *next = entry->next;
+    place(wheel, entry);
+    entry = next;
+  }
+}
+
+WheelEntry *wheel_advance(TimingWheel *wheel, uint64_t now)
+{
+  WheelEntry *due = NULL;
+  while (wheel->now < now)
+  {
+    if (wheel->count == 0)
+    {
+      // Nothing to cascade or take on the way
+      wheel->now = now;
+      break;
+    }
+
+    wheel->now++;
+    // A turn of a level starts once every level below has turned
+    for (unsigned int level = 1; level < WHEEL_LEVELS && (wheel->now & (slot_span(level) - 1)) == 0; level++)
+    {
+      cascade(wheel, level);
+    }
+
+    size_t slot = (size_t)wheel->now & SLOT_MASK;
+    WheelEntry *entry = wheel->slots[0][slot];
+    wheel->slots[0][slot] = NULL;
+    while (entry != NULL)
+    {
+      WheelEntry *next = entry->next;
+      entry->next = due;
+      due = entry;
+      wheel->count--;
+      entry = next;
+    }
+  }
+  return due;
+}
+
+void wheel_destroy(TimingWheel *wheel)
+{
+  for (unsigned int level = 0; level < WHEEL_LEVELS; level++)
+  {
+    for (size_t slot = 0; slot < WHEEL_SLOTS; slot++)
+    {
+      WheelEntry *entry = wheel->slots[level][slot];
+      while (entry != NULL)
+      {
+        WheelEntry *next = entry->next;
+        free(entry);
+        entry = next;
+      }
+    }
+  }
+  wheel_init(wheel, wheel->now);
+}
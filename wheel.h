@@ -0,0 +1,61 @@
+#ifndef KVS_WHEEL_H
+#define KVS_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Hierarchical timing wheel. Level 0 has a slot per tick; each slot of the
+// level above spans a whole turn of the level below, and is spread over
+// it (cascaded) when that turn starts. Adding a key and taking the keys
+// due are constant time per key, whatever the number of keys waiting.
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1u << WHEEL_SLOT_BITS)
+// 4 levels of 64 slots reach 2^24 ticks ahead; keys due later wait in the
+// last level and are cascaded again until they are in reach.
+#define WHEEL_LEVELS 4
+
+typedef struct WheelEntry
+{
+  struct WheelEntry *next;
+  // Tick the key is due at.
+  uint64_t deadline;
+  char key[MAX_STRING_SIZE];
+} WheelEntry;
+
+// Keys due at given ticks. It is not synchronized: the owner guards it
+// with a lock of its own.
+typedef struct TimingWheel
+{
+  WheelEntry *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  // Last tick taken by wheel_advance.
+  uint64_t now;
+  // Number of keys in the wheel.
+  size_t count;
+} TimingWheel;
+
+/// Initializes an empty wheel.
+/// @param wheel Wheel to initialize.
+/// @param now Current tick.
+void wheel_init(TimingWheel *wheel, uint64_t now);
+
+/// Adds a key to the wheel.
+/// @param wheel Wheel to add to.
+/// @param key Key to be added, shorter than MAX_STRING_SIZE.
+/// @param deadline Tick the key is due at; keys already due are taken by
+/// the next wheel_advance.
+/// @return 0 if the key was added, 1 otherwise.
+int wheel_add(TimingWheel *wheel, const char *key, uint64_t deadline);
+
+/// Moves the wheel forward, taking out the keys due up to a tick.
+/// @param wheel Wheel to advance.
+/// @param now Current tick; the wheel never moves back.
+/// @return Entries due, linked through next, to be freed by the caller.
+WheelEntry *wheel_advance(TimingWheel *wheel, uint64_t now);
+
+/// Frees every entry of a wheel.
+/// @param wheel Wheel to be destroyed.
+void wheel_destroy(TimingWheel *wheel);
+
+#endif // KVS_WHEEL_H